@@ -3,11 +3,10 @@
 
 #pragma once
 
-#include <list>
+#include <chrono>
 #include <memory>
-#include <mutex>
 #include <string>
-#include <tuple>
+#include <vector>
 
 #include "server_fwd.hpp"
 
@@ -19,22 +18,60 @@ namespace websocket
         Server();
         ~Server();
 
-        void start(const std::string& ip, unsigned short port, std::ostream& log);
+        void start(const std::string& ip, unsigned short port, std::ostream& log, const ServerOptions& options = ServerOptions());
+
+        // call the handlers on the server threads instead of queueing events for poll()
+        void start(const std::string& ip, unsigned short port, std::ostream& log, Handlers handlers, const ServerOptions& options = ServerOptions());
+
+        // closes the connections with CloseCode::GoingAway and waits up to ServerOptions::closeTimeout
+        // for their send queues to drain
         void stop();
 
         void sendText(ConnectionId connId, std::string message);
         void sendBinary(ConnectionId connId, std::string message);
+
+        // a message of any size, sent fragment by fragment as `producer` returns its parts on the server thread;
+        // messages sent to the connection meanwhile follow the whole stream; never compressed
+        void sendStream(ConnectionId connId, MessageProducer producer, bool isBinary);
+
+        // `length` bytes of the file from `offset` as a binary message, never compressed; on Linux the payload
+        // goes from the file to the socket with sendfile(2). The descriptor is duplicated, so the caller may close it.
+        void sendFile(ConnectionId connId, int fd, std::uint64_t offset, std::uint64_t length);
+
+        // queue many messages at once, each server thread is woken up once
+        void sendMany(std::vector<OutgoingMessage> messages);
+
+        // the frame is encoded once and shared by all recipients
+        void broadcastText(std::string message);
+        void broadcastText(std::vector<ConnectionId> connIds, std::string message);
+        void broadcastBinary(std::string message);
+        void broadcastBinary(std::vector<ConnectionId> connIds, std::string message);
         
         bool poll(Event& event, ConnectionId& connId, std::string& message);
 
+        // append up to maxEvents events to `events`, return their number
+        std::size_t pollBatch(std::vector<ServerEvent>& events, std::size_t maxEvents);
+
+        // block until an event may be available, return false on timeout
+        bool wait(std::chrono::milliseconds timeout);
+
+        // a file descriptor for the caller's own epoll/poll/select: it becomes readable when
+        // poll() finds the queue empty and then a new event arrives; -1 on Windows
+        int eventFd() const;
+
+        // close the socket at once, queued messages are lost
         void drop(ConnectionId connId);
 
+        // close handshake: the queued messages go out, then a Close frame with the code and
+        // the reason (at most 123 bytes of UTF-8); the client has ServerOptions::closeTimeout to answer
+        void drop(ConnectionId connId, CloseCode code, std::string reason = "");
+
+        // bytes waiting in the connection send queue, 0 if there is no such connection;
+        // waits for the server thread, must not be called after stop()
+        std::size_t queuedBytes(ConnectionId connId);
+
     private:
         class Impl;
         std::unique_ptr<Impl> m_impl;
-
-        using tuple_t = std::tuple<Event, ConnectionId, std::string>;
-        std::list<tuple_t> m_queue;
-        std::mutex m_mutex;
     };
 }
\ No newline at end of file
@@ -3,8 +3,12 @@
 
 #pragma once
 
+#include <cstddef>
+#include <memory>
+#include <unordered_set>
 #include <boost/asio.hpp>
 #include <boost/asio/spawn.hpp>
+#include <boost/asio/steady_timer.hpp>
 
 namespace websocket { namespace details
 {
@@ -12,10 +16,41 @@ namespace websocket { namespace details
     class Acceptor
     {
     public:
-        Acceptor(boost::asio::io_service& ioService, boost::asio::ip::tcp::endpoint endpoint, Callback& callback)
-            : m_acceptor{ioService, endpoint}
+        Acceptor(boost::asio::io_service& ioService, boost::asio::ip::tcp::endpoint endpoint, Callback& callback, bool reusePort = false)
+            : m_ioService(ioService)
+            , m_acceptor{ioService}
             , m_callback{callback}
+            , m_handshakeFinished{ioService}
         {
+            m_acceptor.open(endpoint.protocol());
+            m_acceptor.set_option(boost::asio::socket_base::reuse_address{true});
+#if defined SO_REUSEPORT
+            // every server thread listens on the same port, the kernel spreads connections between them
+            if (reusePort)
+                m_acceptor.set_option(boost::asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>{true});
+#else
+            (void)reusePort;
+#endif
+            auto&& tcp = callback.options().tcp;
+
+            // accepted sockets inherit the receive buffer, it must be set before listen() to get the right window scale
+            if (tcp.receiveBufferSize != 0)
+                m_acceptor.set_option(boost::asio::socket_base::receive_buffer_size{tcp.receiveBufferSize});
+
+            m_acceptor.bind(endpoint);
+
+#if defined TCP_DEFER_ACCEPT
+            if (tcp.deferAcceptSeconds != 0)
+                m_acceptor.set_option(boost::asio::detail::socket_option::integer<IPPROTO_TCP, TCP_DEFER_ACCEPT>{tcp.deferAcceptSeconds});
+#endif
+#if defined TCP_FASTOPEN
+            if (tcp.fastOpenQueue != 0)
+                m_acceptor.set_option(boost::asio::detail::socket_option::integer<IPPROTO_TCP, TCP_FASTOPEN>{tcp.fastOpenQueue});
+#endif
+
+            m_acceptor.listen(tcp.backlog != 0 ? tcp.backlog : SOMAXCONN);
+            m_acceptor.non_blocking(true);
+
             boost::asio::spawn(ioService, [this](boost::asio::yield_context yield) { acceptLoop(yield); });
         }
 
@@ -24,33 +59,126 @@ namespace websocket { namespace details
             m_isStopped = true;
             boost::system::error_code ingnoreError;
             m_acceptor.close(ingnoreError);
+            m_handshakeFinished.cancel(ingnoreError);
+
+            for (auto&& handshake : m_handshakes)
+                handshake->abort();
         }
 
     private:
+        // an accepted socket until its handshake is over
+        struct Handshake
+        {
+            explicit Handshake(boost::asio::io_service& ioService)
+                : socket{ioService}
+                , timer{ioService}
+            {}
+
+            void abort()
+            {
+                boost::system::error_code ingnoreError;
+                socket.close(ingnoreError);
+            }
+
+            boost::asio::ip::tcp::socket socket;
+            boost::asio::steady_timer timer;
+            bool isDone{false};
+        };
+
         void acceptLoop(boost::asio::yield_context& yield)
         {
             for (;;)
             {
-                boost::asio::ip::tcp::socket clientSocket{m_acceptor.get_io_service()};
+                // leave new clients in the listen backlog while too many handshakes are in progress
+                while (m_handshakes.size() >= m_callback.options().maxPendingHandshakes && !m_isStopped)
+                {
+                    boost::system::error_code ec;
+                    m_handshakeFinished.expires_at(boost::asio::steady_timer::time_point::max());
+                    m_handshakeFinished.async_wait(yield[ec]);
+                }
+
+                if (m_isStopped)
+                    return;
+
+                auto handshake = std::make_shared<Handshake>(m_ioService);
                 boost::system::error_code ec;
-                m_acceptor.async_accept(clientSocket, yield[ec]);
+                m_acceptor.async_accept(handshake->socket, yield[ec]);
 
                 if (m_isStopped)
                     return;
 
-                if (!ec)
+                if (ec)
                 {
-                    m_callback.onAccept(clientSocket, yield);
+                    m_callback.log("accept error: ", ec);
+                    continue;
                 }
-                else
+
+                startHandshake(handshake);
+
+                // a connection storm: take what else is in the backlog without waiting for the reactor again
+                auto&& options = m_callback.options();
+                for (std::size_t i = 1; i < options.tcp.acceptBatch && m_handshakes.size() < options.maxPendingHandshakes; ++i)
                 {
-                    m_callback.log("accept error: ", ec);
+                    handshake = std::make_shared<Handshake>(m_ioService);
+                    m_acceptor.accept(handshake->socket, ec);
+                    if (ec)
+                        break; // would_block, errors show up in async_accept()
+
+                    startHandshake(handshake);
                 }
             }
         }
 
+        void startHandshake(const std::shared_ptr<Handshake>& handshake)
+        {
+            tune(handshake->socket);
+            m_handshakes.insert(handshake);
+            boost::asio::spawn(m_ioService, [this, handshake](boost::asio::yield_context yield)
+            {
+                performHandshake(handshake, yield);
+            });
+        }
+
+        // failures are ignored, the connection works without the tuning
+        void tune(boost::asio::ip::tcp::socket& socket)
+        {
+            auto&& tcp = m_callback.options().tcp;
+            boost::system::error_code ignoreError;
+            if (tcp.noDelay)
+                socket.set_option(boost::asio::ip::tcp::no_delay{true}, ignoreError);
+
+            if (tcp.sendBufferSize != 0)
+                socket.set_option(boost::asio::socket_base::send_buffer_size{tcp.sendBufferSize}, ignoreError);
+        }
+
+        // each client gets its own coroutine, so a slow one doesn't hold up the others
+        void performHandshake(const std::shared_ptr<Handshake>& handshake, boost::asio::yield_context& yield)
+        {
+            handshake->timer.expires_from_now(m_callback.options().handshakeTimeout);
+            handshake->timer.async_wait([this, handshake](const boost::system::error_code& ec)
+            {
+                if (!ec && !handshake->isDone)
+                {
+                    m_callback.log("Handshake: timeout");
+                    handshake->abort();
+                }
+            });
+
+            m_callback.onAccept(handshake->socket, yield);
+
+            handshake->isDone = true;
+            boost::system::error_code ingnoreError;
+            handshake->timer.cancel(ingnoreError);
+
+            m_handshakes.erase(handshake);
+            m_handshakeFinished.cancel(ingnoreError);
+        }
+
         bool m_isStopped{false};
+        boost::asio::io_service& m_ioService;
         boost::asio::ip::tcp::acceptor m_acceptor;
         Callback& m_callback;
+        std::unordered_set<std::shared_ptr<Handshake>> m_handshakes;
+        boost::asio::steady_timer m_handshakeFinished;
     };
 }}
\ No newline at end of file
@@ -0,0 +1,156 @@
+// Websocket Server implementation
+// Belongs to the public domain
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+namespace websocket { namespace details
+{
+    // Lock-free bounded queue of preallocated slots, any number of producers and consumers.
+    // Dmitry Vyukov's algorithm: each slot has a sequence number telling whether it's free for
+    // the producer or ready for the consumer of the given round, so the two sides share no lock.
+    template<typename T>
+    class BoundedQueue
+    {
+    public:
+        // capacity is rounded up to a power of 2
+        explicit BoundedQueue(std::size_t capacity)
+        {
+            std::size_t size = 2;
+            while (size < capacity)
+                size *= 2;
+
+            m_mask = size - 1;
+            m_slots.reset(new Slot[size]);
+            for (std::size_t i = 0; i != size; ++i)
+                m_slots[i].sequence.store(i, std::memory_order_relaxed);
+        }
+
+        BoundedQueue(const BoundedQueue&) = delete;
+        void operator=(const BoundedQueue&) = delete;
+
+        std::size_t capacity() const { return m_mask + 1; }
+
+        // `value` is moved from only if there was room
+        bool tryPush(T& value)
+        {
+            auto pos = m_pushPos.load(std::memory_order_relaxed);
+            Slot* slot;
+            for (;;)
+            {
+                slot = &m_slots[pos & m_mask];
+                auto seq = slot->sequence.load(std::memory_order_acquire);
+                auto diff = static_cast<std::intptr_t>(seq - pos);
+                if (diff == 0)
+                {
+                    if (m_pushPos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                        break;
+                }
+                else if (diff < 0)
+                {
+                    return false; // full
+                }
+                else
+                {
+                    pos = m_pushPos.load(std::memory_order_relaxed);
+                }
+            }
+
+            slot->value = std::move(value);
+            slot->sequence.store(pos + 1, std::memory_order_release);
+            return true;
+        }
+
+        bool tryPop(T& value)
+        {
+            auto pos = m_popPos.load(std::memory_order_relaxed);
+            Slot* slot;
+            for (;;)
+            {
+                slot = &m_slots[pos & m_mask];
+                auto seq = slot->sequence.load(std::memory_order_acquire);
+                auto diff = static_cast<std::intptr_t>(seq - (pos + 1));
+                if (diff == 0)
+                {
+                    if (m_popPos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                        break;
+                }
+                else if (diff < 0)
+                {
+                    return false; // empty
+                }
+                else
+                {
+                    pos = m_popPos.load(std::memory_order_relaxed);
+                }
+            }
+
+            value = std::move(slot->value);
+            slot->sequence.store(pos + m_mask + 1, std::memory_order_release);
+            return true;
+        }
+
+        // pop up to `maxCount` values claimed with one atomic operation, pass each of them to `consume`
+        template<typename F>
+        std::size_t popBatch(std::size_t maxCount, F&& consume)
+        {
+            auto pos = m_popPos.load(std::memory_order_relaxed);
+            std::size_t count;
+            for (;;)
+            {
+                // count consecutive slots ready for this round
+                for (count = 0; count != maxCount && count <= m_mask; ++count)
+                {
+                    auto seq = m_slots[(pos + count) & m_mask].sequence.load(std::memory_order_acquire);
+                    if (seq != pos + count + 1)
+                        break;
+                }
+
+                if (count == 0)
+                    return 0;
+
+                if (m_popPos.compare_exchange_weak(pos, pos + count, std::memory_order_relaxed))
+                    break;
+            }
+
+            for (std::size_t i = 0; i != count; ++i)
+            {
+                auto&& slot = m_slots[(pos + i) & m_mask];
+                consume(std::move(slot.value));
+                slot.sequence.store(pos + i + m_mask + 1, std::memory_order_release);
+            }
+
+            return count;
+        }
+
+        // may be stale as soon as it returns
+        bool isEmpty() const
+        {
+            auto pos = m_popPos.load(std::memory_order_relaxed);
+            return m_slots[pos & m_mask].sequence.load(std::memory_order_acquire) != pos + 1;
+        }
+
+    private:
+        static const std::size_t CacheLineSize = 64;
+
+        struct Slot
+        {
+            std::atomic<std::size_t> sequence;
+            T value;
+        };
+
+        std::unique_ptr<Slot[]> m_slots;
+        std::size_t m_mask;
+
+        // producers and consumers don't share cache lines
+        char m_pad1[CacheLineSize];
+        std::atomic<std::size_t> m_pushPos{0};
+        char m_pad2[CacheLineSize];
+        std::atomic<std::size_t> m_popPos{0};
+        char m_pad3[CacheLineSize];
+    };
+}}
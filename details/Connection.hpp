@@ -3,14 +3,22 @@
 
 #pragma once
 
+#include <cassert>
+#include <cstdint>
 #include <deque>
+#include <exception>
 #include <memory>
 #include <string>
-#include <unordered_map>
+#include <type_traits>
+#include <vector>
 #include <boost/asio.hpp>
 
 #include "../server_fwd.hpp"
+#include "deflate.hpp"
 #include "frames.hpp"
+#include "RouteTable.hpp"
+#include "TimingWheel.hpp"
+#include "utf8.hpp"
 
 namespace websocket { namespace details
 {
@@ -18,19 +26,33 @@ namespace websocket { namespace details
     class Connection
     {
     public:
-        Connection(ConnectionId id, boost::asio::ip::tcp::socket socket, Callback& callback)
+        // takes over a place in route.connections
+        Connection(ConnectionId id, boost::asio::ip::tcp::socket socket, Callback& callback, RouteConfig& route, const DeflateParams& deflate)
             : m_id{id}
+            , m_timer{this}
+            , m_lastRecvTick{callback.currentTick()}
             , m_socket{std::move(socket)}
+            , m_receiver{route.route.maxMessageSize}
             , m_callback(callback)
+            , m_route(route)
         {
-            beginRecvFrame();
+            if (deflate.enabled)
+            {
+                m_deflate = std::make_unique<PerMessageDeflate>(deflate, route.route.deflate);
+                m_receiver.enableCompression();
+            }
+
+            beginRecv();
         }
 
         ~Connection()
         {
             assert(m_isClosed);
+            --m_route.connections;
         }
 
+        const RouteConfig& route() const { return m_route; }
+
         void close()
         {
             if (m_isClosed)
@@ -45,24 +67,249 @@ namespace websocket { namespace details
 
         void sendFrame(Opcode opcode, std::string data)
         {
-            m_sendQueue.emplace_back(opcode, std::move(data));
-            if (m_sendQueue.size() == 1)
-                sendNext();
+            if (!m_deflate || isControlFrame(opcode) || !m_deflate->shouldCompress(data.size()))
+            {
+                sendFrame(std::make_shared<const ServerFrame>(opcode, std::move(data)));
+                return;
+            }
+
+            // admitted before it is compressed: a dropped message would stay in the compression window
+            // and the client couldn't inflate the messages that refer to it
+            if (makeRoom(opcode, ServerFrame::MaxHeaderLen + m_deflate->maxCompressedSize(data.size())))
+                enqueue(std::make_shared<const ServerFrame>(opcode, m_deflate->compress(data.data(), data.size()), true));
+        }
+
+        // queue a frame shared with other connections, it is sent as is
+        void sendFrame(frame_ptr frame)
+        {
+            if (makeRoom(frame->opcode(), frame->size()))
+                enqueue(std::move(frame));
+        }
+
+        // send the parts from `producer` as the fragments of one message, uncompressed
+        void sendStream(Opcode opcode, MessageProducer producer)
+        {
+            if (m_isClosed || m_isCloseSent)
+                return;
+
+            if (m_stream)
+            {
+                m_pending.push_back({nullptr, opcode, std::move(producer)});
+                return;
+            }
+
+            m_stream.reset(new Stream{opcode, std::move(producer)});
+            pumpStream();
+        }
+
+        // Start the closing handshake: queue a Close frame after the messages already queued.
+        // Messages from the client are ignored from now on; its Close ends the connection.
+        void sendClose(std::string payload)
+        {
+            if (m_isClosed || m_isCloseSent)
+                return;
+
+            sendFrame(std::make_shared<const ServerFrame>(Opcode::Close, std::move(payload)));
+            m_isCloseSent = true;
+            m_callback.onCloseSent(*this);
         }
 
+        // bytes of the frames in the send queue, including the ones being written and the ones waiting for a stream
+        std::size_t queuedBytes() const { return m_queuedBytes + m_pendingBytes; }
+
+        // the payload of the client's Close frame, empty if there was none
+        const std::string& closePayload() const { return m_closePayload; }
+
     private:
+        // apply the overflow policy, return false if a new frame of up to `frameLen` bytes must not be queued
+        bool makeRoom(Opcode opcode, std::size_t frameLen)
+        {
+            if (m_isClosed || m_isCloseSent)
+                return false; // nothing may follow a Close frame
+
+            if (isControlFrame(opcode))
+                return true;
+
+            if (m_stream)
+                return makeRoomPending(frameLen);
+
+            if (m_sendQueue.empty())
+                return true;
+
+            auto&& options = m_callback.options();
+            auto overflows = [&]
+            {
+                return m_sendQueue.size() >= options.sendQueueMaxFrames || m_queuedBytes + frameLen > options.sendQueueMaxBytes;
+            };
+
+            if (!overflows())
+                return true;
+
+            switch (options.overflowPolicy)
+            {
+            case OverflowPolicy::DropOldest:
+                for (auto iter = m_sendQueue.begin() + m_framesInFlight; iter != m_sendQueue.end() && overflows(); )
+                {
+                    // fragments of a streamed message can't be dropped either,
+                    // nor compressed messages: the ones after them were compressed with them in the window
+                    auto&& frame = **iter;
+                    if (isControlFrame(frame.opcode()) || frame.opcode() == Opcode::Continuation || !frame.isFinal() || frame.isCompressed())
+                    {
+                        ++iter;
+                        continue;
+                    }
+
+                    m_queuedBytes -= frame.size();
+                    iter = m_sendQueue.erase(iter);
+                }
+
+                return !overflows();
+
+            case OverflowPolicy::Disconnect:
+                // the queue isn't empty, so a write is pending and the connection outlives this call
+                m_callback.log("#", m_id, ": send queue overflow");
+                m_callback.drop(*this);
+                return false;
+
+            default:
+                return false;
+            }
+        }
+
+        // the same limits for the messages waiting for a stream, only the new message can be dropped
+        bool makeRoomPending(std::size_t frameLen)
+        {
+            auto&& options = m_callback.options();
+            if (m_pending.size() < options.sendQueueMaxFrames && queuedBytes() + frameLen <= options.sendQueueMaxBytes)
+                return true;
+
+            if (options.overflowPolicy == OverflowPolicy::Disconnect)
+            {
+                // a stream is being sent, so a write is pending and the connection outlives this call
+                m_callback.log("#", m_id, ": send queue overflow");
+                m_callback.drop(*this);
+            }
+
+            return false;
+        }
+
+        // a frame admitted by makeRoom()
+        void enqueue(frame_ptr frame)
+        {
+            if (m_stream && !isControlFrame(frame->opcode()))
+            {
+                // data frames can't come between the fragments of a message
+                m_pendingBytes += frame->size();
+                m_pending.push_back({std::move(frame), Opcode::Continuation, nullptr});
+                updateWatermark();
+                return;
+            }
+
+            queueFrame(std::move(frame));
+        }
+
+        void queueFrame(frame_ptr frame)
+        {
+            m_queuedBytes += frame->size();
+            m_sendQueue.push_back(std::move(frame));
+
+            if (!m_isSending)
+                sendNext();
+
+            // after the write has started: an in-loop handler of the event may send again
+            updateWatermark();
+        }
+
+        // pull parts of the stream while the send queue has room, then start the messages that waited for it
+        void pumpStream()
+        {
+            auto&& options = m_callback.options();
+            while (m_stream && !m_isClosed && !m_isCloseSent && m_queuedBytes < options.sendBatchBytes)
+            {
+                std::string chunk;
+                auto isLast = true;
+                try
+                {
+                    isLast = !m_stream->producer(chunk);
+                }
+                catch (std::exception& e)
+                {
+                    m_callback.log("#", m_id, ": message producer failed: ", e.what());
+                    m_stream.reset();
+                    sendClose(details::closePayload(CloseCode::InternalError));
+                    return;
+                }
+
+                auto opcode = m_stream->isStarted ? Opcode::Continuation : m_stream->opcode;
+                m_stream->isStarted = true;
+                if (isLast)
+                    m_stream.reset();
+
+                queueFrame(std::make_shared<const ServerFrame>(opcode, std::move(chunk), false, isLast));
+
+                while (!m_stream && !m_pending.empty())
+                {
+                    auto next = std::move(m_pending.front());
+                    m_pending.pop_front();
+                    if (next.frame)
+                    {
+                        m_pendingBytes -= next.frame->size();
+                        queueFrame(std::move(next.frame));
+                    }
+                    else
+                    {
+                        m_stream.reset(new Stream{next.opcode, std::move(next.producer)});
+                    }
+                }
+            }
+        }
+
+        void updateWatermark()
+        {
+            auto&& options = m_callback.options();
+            if (!m_isAboveHighWatermark && queuedBytes() >= options.sendQueueHighWatermark)
+            {
+                m_isAboveHighWatermark = true;
+                m_callback.sendQueueEvent(*this, Event::HighWatermark);
+            }
+            else if (m_isAboveHighWatermark && queuedBytes() <= options.sendQueueLowWatermark)
+            {
+                m_isAboveHighWatermark = false;
+                m_callback.sendQueueEvent(*this, Event::LowWatermark);
+            }
+        }
+
+        // write as many queued frames as the batch limits allow with one gather write
         void sendNext()
         {
             m_isSending = true;
-            
-            auto&& frame = m_sendQueue.front();
-            std::array<boost::asio::const_buffer, 2> buffers
+
+            auto&& options = m_callback.options();
+            if (options.tcp.cork && !m_isCorked)
+                setCork(true);
+
+            std::size_t batchBytes = 0;
+            m_sendBuffers.clear();
+            m_framesInFlight = 0;
+
+            for (auto&& frame : m_sendQueue)
             {
-                boost::asio::buffer(frame.m_header, frame.m_headerLen),
-                boost::asio::buffer(frame.m_data)
-            };
+                auto frameLen = frame->m_headerLen + frame->m_data.size();
+                if (m_framesInFlight != 0 && (m_framesInFlight == options.sendBatchFrames || batchBytes + frameLen > options.sendBatchBytes))
+                    break;
+
+                m_sendBuffers.push_back(boost::asio::buffer(frame->m_header, frame->m_headerLen));
+                if (!frame->m_data.empty())
+                    m_sendBuffers.push_back(boost::asio::buffer(frame->m_data));
+
+                batchBytes += frameLen;
+                ++m_framesInFlight;
+
+                if (frame->m_file)
+                    break; // its payload follows the header, see onSendComplete()
+            }
 
-            boost::asio::async_write(m_socket, buffers,
+            boost::asio::async_write(m_socket, m_sendBuffers,
                 [this](const boost::system::error_code& ec, std::size_t)
                 {
                     onSendComplete(ec);
@@ -78,27 +325,87 @@ namespace websocket { namespace details
             }
             else if (!m_isClosed)
             {
-                m_sendQueue.pop_front();
+                auto&& file = m_sendQueue[m_framesInFlight - 1]->m_file;
+                if (file && !m_isFileSent)
+                {
+                    m_isSending = true;
+                    m_fileBytesSent = 0;
+                    sendFilePayload(*file);
+                    return;
+                }
+
+                m_isFileSent = false;
+                for (std::size_t i = 0; i != m_framesInFlight; ++i)
+                    m_queuedBytes -= m_sendQueue[i]->size();
+
+                m_sendQueue.erase(m_sendQueue.begin(), m_sendQueue.begin() + m_framesInFlight);
+
                 if (!m_sendQueue.empty())
                     sendNext();
 
-                return;
+                pumpStream();
+
+                // the next write is under way, so a frame sent by an in-loop handler of the event just joins the queue
+                updateWatermark();
+
+                // the queue is written: push out the partial segment held by the cork
+                if (!m_isSending && m_isCorked)
+                    setCork(false);
+
+                // the Close frame has been written, now the socket can be closed
+                if (m_isSending || !m_isClosing)
+                    return;
             }
 
             m_callback.drop(*this);
         }
 
-        void beginRecvFrame()
+        // TCP_CORK holds partial segments while a burst of frames is written, so small frames share packets
+        void setCork(bool isCorked)
+        {
+            m_isCorked = isCorked;
+#if defined TCP_CORK
+            boost::system::error_code ignoreError;
+            m_socket.set_option(boost::asio::detail::socket_option::boolean<IPPROTO_TCP, TCP_CORK>{isCorked}, ignoreError);
+#endif
+        }
+
+        // move the file payload of the last frame in flight to the socket, as fast as the socket takes it
+        void sendFilePayload(const FilePayload& file)
         {
-            auto&& isComplete = [this](const boost::system::error_code& ec, std::size_t bytesTransferred)
+            boost::system::error_code ec;
+            if (m_fileBytesSent != file.length())
             {
-                return ec ? 0 : m_receiver.needReceiveMore(bytesTransferred);
-            };
+                m_socket.native_non_blocking(true, ec);
+                if (!ec)
+                    m_fileBytesSent += file.writeSome(m_socket.native_handle(), m_fileBytesSent, ec);
 
+                if ((!ec && m_fileBytesSent != file.length()) || ec == boost::asio::error::would_block)
+                {
+                    // a write of null_buffers completes when the socket is writable
+                    m_socket.async_write_some(boost::asio::null_buffers(),
+                        [this, &file](const boost::system::error_code& ec, std::size_t)
+                        {
+                            if (ec || m_isClosed)
+                                onSendComplete(ec ? ec : boost::asio::error::operation_aborted);
+                            else
+                                sendFilePayload(file);
+                        });
+                    return;
+                }
+            }
+
+            m_isFileSent = !ec;
+            onSendComplete(ec);
+        }
+
+        void beginRecv()
+        {
+            m_receiver.prepareBuffer();
             auto&& buffer = boost::asio::buffer(m_receiver.getBufferTail(), m_receiver.getBufferTailSize());
 
             m_isReading = true;
-            boost::asio::async_read(m_socket, buffer, isComplete, [this](const boost::system::error_code& ec, std::size_t bytesTransferred)
+            m_socket.async_read_some(buffer, [this](const boost::system::error_code& ec, std::size_t bytesTransferred)
             {
                 onRecvComplete(ec, bytesTransferred);
             });
@@ -106,8 +413,6 @@ namespace websocket { namespace details
 
         void onRecvComplete(const boost::system::error_code& ec, std::size_t bytesTransferred)
         {
-            m_isReading = false;
-
             if (ec)
             {
                 if (ec.value() != boost::asio::error::eof)
@@ -115,77 +420,386 @@ namespace websocket { namespace details
             }
             else if (!m_isClosed)
             {
+                // m_isReading stays set, so handlers dropping this connection don't destroy it under our feet
+                m_lastRecvTick = m_callback.currentTick();
+                m_isPingSent = false;
                 m_receiver.addBytes(bytesTransferred);
-                if (m_receiver.isValidFrame())
-                {
-                    if (m_receiver.opcode() == Opcode::Close)
-                    {
-                        sendFrame(Opcode::Close, {});
-                    }
-                    else
-                    {
-                        m_receiver.unmask();
-                        m_callback.processFrame(m_id, m_receiver.opcode(), m_receiver.message());
-                        m_receiver.shiftBuffer();
-                        beginRecvFrame();
-                        return;
-                    }
-                }
-                else
+                if (processFrames())
                 {
-                    m_callback.log("#", m_id, ": invalid frame");
+                    beginRecv();
+                    return;
                 }
             }
 
+            m_isReading = false;
+            if (m_isClosing && m_isSending && !m_isClosed)
+                return; // onSendComplete() closes the connection once the Close frame is written
+
             m_callback.drop(*this);
         }
 
+        // dispatch all complete frames in the receive buffer, return false if the connection must be dropped
+        bool processFrames()
+        {
+            while (m_receiver.isValidFrame())
+            {
+                if (!m_receiver.isFrameComplete())
+                    return true;
+
+                m_receiver.unmask();
+                if (m_receiver.opcode() == Opcode::Close)
+                    return processClose();
+
+                // messages crossing our Close frame are ignored, only the client's Close matters
+                if (!m_isCloseSent && !processFrame())
+                    return false;
+
+                m_receiver.shiftBuffer();
+                if (m_isClosed)
+                    return false;
+            }
+
+            if (m_receiver.isTooLong())
+                return failConnection(CloseCode::MessageTooBig, "message is too long");
+
+            return failConnection(CloseCode::ProtocolError, "invalid frame");
+        }
+
+        // the client's Close frame: answer it unless it is the answer to ours, and stop reading
+        bool processClose()
+        {
+            auto payload = m_receiver.payload();
+            auto len = static_cast<std::size_t>(m_receiver.payloadLen());
+
+            if (len == 1)
+                return failConnection(CloseCode::ProtocolError, "invalid close payload");
+
+            if (len != 0)
+            {
+                auto code = std::uint16_t(std::uint8_t(payload[0]) << 8 | std::uint8_t(payload[1]));
+                if (!isValidCloseCode(code))
+                    return failConnection(CloseCode::ProtocolError, "invalid close code");
+
+                Utf8Validator utf8;
+                if (m_callback.options().validateUtf8 && !(utf8.validate(payload + 2, len - 2) && utf8.isComplete()))
+                    return failConnection(CloseCode::InvalidPayload, "invalid UTF-8 close reason");
+            }
+
+            m_closePayload.assign(payload, len);
+
+            // echo the status code
+            sendClose(std::string(payload, std::min<std::size_t>(len, 2)));
+            m_isClosing = true;
+            return false;
+        }
+
+        bool processFrame()
+        {
+            auto opcode = m_receiver.opcode();
+            auto isFinal = m_receiver.isFinalFragment();
+            auto len = static_cast<std::size_t>(m_receiver.payloadLen());
+
+            if (isControlFrame(opcode))
+            {
+                // any data counts as activity, so a pong needs no handling
+                if (opcode == Opcode::Ping)
+                    sendFrame(Opcode::Pong, std::string(m_receiver.payload(), len));
+                return true;
+            }
+
+            if (opcode == Opcode::Continuation)
+            {
+                if (!m_isFragmented)
+                    return failConnection(CloseCode::ProtocolError, "unexpected continuation frame");
+
+                opcode = m_messageOpcode;
+            }
+            else if (m_isFragmented)
+            {
+                return failConnection(CloseCode::ProtocolError, "new message inside a fragmented one");
+            }
+            else
+            {
+                m_isCompressed = m_receiver.isCompressed();
+            }
+
+            m_isFragmented = !isFinal;
+            m_messageOpcode = opcode;
+
+            if (m_isCompressed)
+                return processCompressedFrame(opcode, isFinal);
+
+            if (opcode == Opcode::Text && !validateText(m_receiver.payload(), len, isFinal))
+                return failConnection(CloseCode::InvalidPayload, "invalid UTF-8 text");
+
+            if (m_message.empty() && (isFinal || m_callback.options().streamFragments))
+            {
+                m_callback.processFrame(*this, opcode, m_receiver.payload(), len, isFinal);
+                return true;
+            }
+
+            if (len > m_route.route.maxMessageSize - m_message.size())
+                return failConnection(CloseCode::MessageTooBig, "fragmented message is too long");
+
+            m_message.append(m_receiver.payload(), len);
+            if (isFinal)
+            {
+                m_callback.processFrame(*this, opcode, std::move(m_message), true);
+                m_message.clear();
+            }
+
+            return true;
+        }
+
+        bool processCompressedFrame(Opcode opcode, bool isFinal)
+        {
+            auto&& options = m_callback.options();
+            auto offset = m_message.size();
+            auto len = static_cast<std::size_t>(m_receiver.payloadLen());
+
+            switch (m_deflate->decompress(m_receiver.payload(), len, isFinal, m_message, m_route.route.maxMessageSize))
+            {
+            case PerMessageDeflate::Result::OK:
+                break;
+            case PerMessageDeflate::Result::TooBig:
+                return failConnection(CloseCode::MessageTooBig, "decompressed message is too long");
+            default:
+                return failConnection(CloseCode::InvalidPayload, "invalid compressed data");
+            }
+
+            if (opcode == Opcode::Text && !validateText(m_message.data() + offset, m_message.size() - offset, isFinal))
+                return failConnection(CloseCode::InvalidPayload, "invalid UTF-8 text");
+
+            if (isFinal || options.streamFragments)
+            {
+                m_callback.processFrame(*this, opcode, std::move(m_message), isFinal);
+                m_message.clear();
+            }
+
+            return true;
+        }
+
+        bool validateText(const char* data, std::size_t size, bool isFinal)
+        {
+            if (!m_callback.options().validateUtf8)
+                return true;
+
+            if (!m_utf8.validate(data, size))
+                return false;
+
+            if (!isFinal)
+                return true;
+
+            auto isComplete = m_utf8.isComplete();
+            m_utf8.reset();
+            return isComplete;
+        }
+
+        // send Close frame with the status code, return false to stop reading and close once it is written
+        bool failConnection(CloseCode code, const char* reason)
+        {
+            m_callback.log("#", m_id, ": ", reason);
+            sendClose(details::closePayload(code));
+            m_isClosing = true;
+            return false;
+        }
+
     public:
         ConnectionId m_id;
         bool m_isSending{false};
         bool m_isReading{false};
         bool m_isClosed{false};
-        
+        bool m_isCloseSent{false};
+
+        // ping and idle timeouts, see ServerLogic::onTimer()
+        typename TimingWheel<Connection>::Node m_timer;
+        std::uint64_t m_lastRecvTick;
+        bool m_isPingSent{false};
+
     private:
         boost::asio::ip::tcp::socket m_socket;
-        std::deque<ServerFrame> m_sendQueue;
+        std::deque<frame_ptr> m_sendQueue;
+        std::vector<boost::asio::const_buffer> m_sendBuffers;
+        std::size_t m_framesInFlight{0}; // the first frames of m_sendQueue being written
+        std::size_t m_queuedBytes{0};
+        bool m_isFileSent{false}; // the file payload of the frame in flight
+        std::uint64_t m_fileBytesSent{0};
+        bool m_isCorked{false};
+
+        // the streamed message being sent and the messages waiting for it
+        struct Stream
+        {
+            Opcode opcode;
+            MessageProducer producer;
+            bool isStarted{false};
+        };
+
+        struct PendingMessage
+        {
+            frame_ptr frame;         // a complete message, or
+            Opcode opcode;           // ... a stream
+            MessageProducer producer;
+        };
+
+        std::unique_ptr<Stream> m_stream;
+        std::deque<PendingMessage> m_pending;
+        std::size_t m_pendingBytes{0};
+        bool m_isAboveHighWatermark{false};
         FrameReceiver m_receiver;
         Callback& m_callback;
+        RouteConfig& m_route;
+
+        // reassembly of a fragmented message
+        bool m_isFragmented{false};
+        Opcode m_messageOpcode{Opcode::Continuation};
+        std::string m_message;
+        Utf8Validator m_utf8;
+
+        // closing handshake: the socket is closed once the send queue is written
+        bool m_isClosing{false};
+        std::string m_closePayload;
+
+        // permessage-deflate, if negotiated
+        std::unique_ptr<PerMessageDeflate> m_deflate;
+        bool m_isCompressed{false};
+    };
+
+    // ConnectionId = generation << 32 | (slot index + 1) << shardBits | shard index.
+    // The shard tells which server thread owns the connection, the generation tells a reused slot
+    // from the one the id was given for. The first connection in a slot has generation 0,
+    // so with one thread ids start at 1, 2, 3...
+    struct ConnectionIdLayout
+    {
+        unsigned shard{0};
+        unsigned shardBits{0};
+
+        static unsigned bitsFor(std::size_t shards)
+        {
+            unsigned bits = 0;
+            while ((std::size_t(1) << bits) < shards)
+                ++bits;
+            return bits;
+        }
+
+        std::size_t shardOf(ConnectionId id) const { return id & ((ConnectionId(1) << shardBits) - 1); }
+
+        // slot index, garbage for ids that weren't made by makeId()
+        std::size_t indexOf(ConnectionId id) const { return std::size_t((id & 0xFFFFFFFFu) >> shardBits) - 1; }
+
+        ConnectionId makeId(std::size_t index, std::uint32_t generation) const
+        {
+            return (ConnectionId(generation) << 32) | (ConnectionId(index + 1) << shardBits) | shard;
+        }
     };
 
+    // Slot map: connections live in chunks of slots that never move, freed slots are reused
     template<typename Callback>
     class ConnectionTable
     {
     public:
         using conn_t = Connection<Callback>;
 
-        conn_t& add(boost::asio::ip::tcp::socket&& socket, Callback& callback)
+        explicit ConnectionTable(ConnectionIdLayout idLayout = ConnectionIdLayout())
+            : m_idLayout(idLayout)
+        {}
+
+        ~ConnectionTable()
+        {
+            forEach([this](conn_t& conn) { erase(conn); });
+        }
+
+        ConnectionTable(const ConnectionTable&) = delete;
+        void operator=(const ConnectionTable&) = delete;
+
+        conn_t& add(boost::asio::ip::tcp::socket&& socket, Callback& callback, RouteConfig& route, const DeflateParams& deflate)
         {
-            ++m_lastConnId;
-            auto&& pair = m_connections.emplace(m_lastConnId,
-                std::make_unique<conn_t>(m_lastConnId, std::move(socket), callback));
-            return *pair.first->second;
+            auto index = allocateSlot();
+            auto&& slot = slotAt(index);
+            auto connId = m_idLayout.makeId(index, slot.generation);
+
+            try
+            {
+                new (&slot.storage) conn_t(connId, std::move(socket), callback, route, deflate);
+            }
+            catch (...)
+            {
+                --route.connections;
+                m_freeSlots.push_back(index);
+                throw;
+            }
+
+            slot.id = connId;
+            return slot.get();
         }
 
         conn_t* find(ConnectionId connId)
         {
-            auto iter = m_connections.find(connId);
-            return iter == m_connections.end() ? nullptr : iter->second.get();
+            auto index = m_idLayout.indexOf(connId);
+            if (index >= m_slotCount)
+                return nullptr;
+
+            auto&& slot = slotAt(index);
+            return slot.id == connId ? &slot.get() : nullptr;
         }
 
         void erase(conn_t& conn)
         {
-            m_connections.erase(conn.m_id);
+            auto index = m_idLayout.indexOf(conn.m_id);
+            auto&& slot = slotAt(index);
+            assert(slot.id == conn.m_id);
+
+            conn.~conn_t();
+            slot.id = 0;
+            ++slot.generation;
+            m_freeSlots.push_back(index);
         }
 
-        void closeAll()
+        // `f` may erase the connection it is given
+        template<typename F>
+        void forEach(F&& f)
         {
-            for (auto&& conn : m_connections)
-                conn.second->close();
+            for (std::size_t i = 0; i != m_slotCount; ++i)
+            {
+                auto&& slot = slotAt(i);
+                if (slot.id != 0)
+                    f(slot.get());
+            }
         }
 
+        bool isEmpty() const { return m_freeSlots.size() == m_slotCount; }
+
     private:
-        ConnectionId m_lastConnId{0};
-        std::unordered_map<ConnectionId, std::unique_ptr<conn_t>> m_connections;
+        static const std::size_t ChunkSize = 256;
+
+        struct Slot
+        {
+            ConnectionId id{0}; // 0 - free
+            std::uint32_t generation{0};
+            typename std::aligned_storage<sizeof(conn_t), alignof(conn_t)>::type storage;
+
+            conn_t& get() { return *reinterpret_cast<conn_t*>(&storage); }
+        };
+
+        Slot& slotAt(std::size_t index) { return m_chunks[index / ChunkSize][index % ChunkSize]; }
+
+        std::size_t allocateSlot()
+        {
+            if (!m_freeSlots.empty())
+            {
+                auto index = m_freeSlots.back();
+                m_freeSlots.pop_back();
+                return index;
+            }
+
+            if (m_slotCount == m_chunks.size() * ChunkSize)
+                m_chunks.emplace_back(new Slot[ChunkSize]);
+
+            return m_slotCount++;
+        }
+
+        ConnectionIdLayout m_idLayout;
+        std::vector<std::unique_ptr<Slot[]>> m_chunks;
+        std::size_t m_slotCount{0};
+        std::vector<std::size_t> m_freeSlots;
     };
 }}
@@ -0,0 +1,148 @@
+// Websocket Server implementation
+// Belongs to the public domain
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <limits>
+#include <system_error>
+
+#if defined _WIN32
+#include <condition_variable>
+#include <mutex>
+#else
+#include <cerrno>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#if defined __linux__
+#include <sys/eventfd.h>
+#endif
+#endif
+
+namespace websocket { namespace details
+{
+    // Wakes up a consumer waiting for a queue to become non-empty.
+    // The consumer arms the notifier when it finds the queue empty and checks the queue once more;
+    // a producer signals only if the notifier is armed, so busy periods cost no system calls.
+    class EventNotifier
+    {
+    public:
+        EventNotifier()
+        {
+#if defined __linux__
+            m_readFd = m_writeFd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            if (m_readFd == -1)
+                throw std::system_error(errno, std::system_category(), "eventfd");
+#elif !defined _WIN32
+            int fds[2];
+            if (::pipe(fds) != 0)
+                throw std::system_error(errno, std::system_category(), "pipe");
+
+            m_readFd = fds[0];
+            m_writeFd = fds[1];
+            for (auto fd : fds)
+            {
+                ::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL) | O_NONBLOCK);
+                ::fcntl(fd, F_SETFD, FD_CLOEXEC);
+            }
+#endif
+        }
+
+        ~EventNotifier()
+        {
+#if !defined _WIN32
+            ::close(m_readFd);
+            if (m_writeFd != m_readFd)
+                ::close(m_writeFd);
+#endif
+        }
+
+        EventNotifier(const EventNotifier&) = delete;
+        void operator=(const EventNotifier&) = delete;
+
+        // readable while the consumer may have something to do; -1 if not supported
+        int fd() const { return m_readFd; }
+
+        // consumer: called after the queue was found empty, the queue must be checked again afterwards
+        void arm()
+        {
+            if (m_isArmed.load(std::memory_order_relaxed))
+                return; // nothing was signalled since the last arm()
+
+            clear();
+            m_isArmed.store(true, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+        }
+
+        // producer: called after a push
+        void notify()
+        {
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (!m_isArmed.load(std::memory_order_relaxed) || !m_isArmed.exchange(false))
+                return;
+
+#if defined _WIN32
+            {
+                std::lock_guard<std::mutex> lock{m_mutex};
+                m_isSignalled = true;
+            }
+            m_cv.notify_all();
+#elif defined __linux__
+            std::uint64_t one = 1;
+            auto rc = ::write(m_writeFd, &one, sizeof(one));
+            (void)rc;
+#else
+            char one = 1;
+            auto rc = ::write(m_writeFd, &one, sizeof(one));
+            (void)rc;
+#endif
+        }
+
+        // consumer: wait for notify() after arm(), return false on timeout
+        bool wait(std::chrono::milliseconds timeout)
+        {
+#if defined _WIN32
+            std::unique_lock<std::mutex> lock{m_mutex};
+            return m_cv.wait_for(lock, timeout, [this] { return m_isSignalled; });
+#else
+            auto ms = std::max<long long>(0, std::min<long long>(timeout.count(), std::numeric_limits<int>::max()));
+            pollfd pfd{m_readFd, POLLIN, 0};
+            int rc;
+            do
+            {
+                rc = ::poll(&pfd, 1, static_cast<int>(ms));
+            } while (rc < 0 && errno == EINTR);
+
+            return rc > 0;
+#endif
+        }
+
+    private:
+        void clear()
+        {
+#if defined _WIN32
+            std::lock_guard<std::mutex> lock{m_mutex};
+            m_isSignalled = false;
+#else
+            char buf[64];
+            while (::read(m_readFd, buf, sizeof(buf)) > 0)
+                ;
+#endif
+        }
+
+        std::atomic<bool> m_isArmed{false};
+#if defined _WIN32
+        std::mutex m_mutex;
+        std::condition_variable m_cv;
+        bool m_isSignalled{false};
+        int m_readFd{-1};
+#else
+        int m_readFd{-1};
+        int m_writeFd{-1};
+#endif
+    };
+}}
@@ -0,0 +1,185 @@
+// Websocket Server implementation
+// Belongs to the public domain
+
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <system_error>
+#include <boost/asio/error.hpp>
+
+#if !defined _WIN32
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#if defined __linux__
+#include <ctime>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/sendfile.h>
+#else
+#include <sys/mman.h>
+#endif
+#endif
+
+namespace websocket { namespace details
+{
+#if defined __linux__
+    // sendfile(2) has no MSG_NOSIGNAL: SIGPIPE is blocked in the calling thread for the duration of the call
+    // and one raised by the call is consumed, so a client that resets the connection doesn't kill the process
+    class SigPipeGuard
+    {
+    public:
+        SigPipeGuard()
+        {
+            sigemptyset(&m_pipeSet);
+            sigaddset(&m_pipeSet, SIGPIPE);
+            pthread_sigmask(SIG_BLOCK, &m_pipeSet, &m_oldSet);
+
+            sigset_t pending;
+            m_wasPending = sigpending(&pending) == 0 && sigismember(&pending, SIGPIPE) == 1;
+        }
+
+        ~SigPipeGuard()
+        {
+            // a failed call left EPIPE in errno
+            auto error = errno;
+            if (error == EPIPE && !m_wasPending)
+            {
+                const timespec noWait{0, 0};
+                while (sigtimedwait(&m_pipeSet, nullptr, &noWait) == -1 && errno == EINTR)
+                    ;
+            }
+
+            pthread_sigmask(SIG_SETMASK, &m_oldSet, nullptr);
+            errno = error;
+        }
+
+        SigPipeGuard(const SigPipeGuard&) = delete;
+        void operator=(const SigPipeGuard&) = delete;
+
+    private:
+        sigset_t m_pipeSet;
+        sigset_t m_oldSet;
+        bool m_wasPending;
+    };
+#endif
+
+    // A range of a file sent as the payload of a frame. It keeps its own descriptor, so the caller may close theirs.
+    // Linux moves the data with sendfile(2) and it never enters user space; other systems write from a mapping.
+    // Immutable, so a frame with a file payload can be queued on several connections.
+    class FilePayload
+    {
+    public:
+        FilePayload(int fd, std::uint64_t offset, std::uint64_t length)
+            : m_offset{offset}
+            , m_length{length}
+        {
+#if defined _WIN32
+            (void)fd;
+            throw std::runtime_error("sending files isn't supported on this platform");
+#else
+            m_fd = ::fcntl(fd, F_DUPFD_CLOEXEC, 0);
+            if (m_fd == -1)
+                throw std::system_error(errno, std::system_category(), "dup");
+
+#if !defined __linux__
+            if (length != 0)
+            {
+                // mmap wants a page-aligned offset
+                auto pageSize = std::uint64_t(::sysconf(_SC_PAGESIZE));
+                auto mapOffset = offset / pageSize * pageSize;
+                m_mapSize = std::size_t(offset - mapOffset + length);
+                m_map = ::mmap(nullptr, m_mapSize, PROT_READ, MAP_SHARED, m_fd, off_t(mapOffset));
+                if (m_map == MAP_FAILED)
+                {
+                    auto error = errno;
+                    ::close(m_fd);
+                    throw std::system_error(error, std::system_category(), "mmap");
+                }
+
+                m_data = static_cast<const char*>(m_map) + (offset - mapOffset);
+            }
+#endif
+#endif
+        }
+
+        ~FilePayload()
+        {
+#if !defined _WIN32
+#if !defined __linux__
+            if (m_map)
+                ::munmap(m_map, m_mapSize);
+#endif
+            ::close(m_fd);
+#endif
+        }
+
+        FilePayload(const FilePayload&) = delete;
+        void operator=(const FilePayload&) = delete;
+
+        std::uint64_t length() const { return m_length; }
+
+        // write some of the range after the first `sent` bytes to a non-blocking socket, return the bytes written;
+        // 0 with `ec` set to would_block when the socket buffer is full
+        std::size_t writeSome(int socket, std::uint64_t sent, boost::system::error_code& ec) const
+        {
+            // a long file doesn't hold up the other connections of the thread
+            const std::uint64_t MaxWrite = 1024 * 1024;
+            auto size = std::size_t(std::min(m_length - sent, MaxWrite));
+            ec.clear();
+
+#if defined _WIN32
+            (void)socket;
+            (void)size;
+            ec = boost::system::errc::make_error_code(boost::system::errc::not_supported);
+            return 0;
+#else
+#if defined __linux__
+            auto offset = off_t(m_offset + sent);
+            ssize_t n;
+            {
+                SigPipeGuard guard;
+                n = ::sendfile(socket, m_fd, &offset, size);
+            }
+#else
+#if defined MSG_NOSIGNAL
+            const int flags = MSG_NOSIGNAL;
+#else
+            const int flags = 0;
+#if defined SO_NOSIGPIPE
+            // no MSG_NOSIGNAL on BSD and macOS, the socket itself is told not to raise SIGPIPE
+            const int noSigPipe = 1;
+            ::setsockopt(socket, SOL_SOCKET, SO_NOSIGPIPE, &noSigPipe, sizeof(noSigPipe));
+#endif
+#endif
+            auto n = ::send(socket, m_data + sent, size, flags);
+#endif
+            if (n > 0)
+                return std::size_t(n);
+
+            if (n == 0)
+                ec = boost::asio::error::eof; // the file is shorter than the range
+            else if (errno == EAGAIN || errno == EWOULDBLOCK)
+                ec = boost::asio::error::would_block;
+            else
+                ec = boost::system::error_code(errno, boost::system::system_category());
+
+            return 0;
+#endif
+        }
+
+    private:
+        int m_fd{-1};
+        std::uint64_t m_offset;
+        std::uint64_t m_length;
+#if !defined _WIN32 && !defined __linux__
+        void* m_map{nullptr};
+        std::size_t m_mapSize{0};
+        const char* m_data{nullptr};
+#endif
+    };
+}}
@@ -0,0 +1,144 @@
+// Websocket Server implementation
+// Belongs to the public domain
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "http.hpp"
+#include "../server_fwd.hpp"
+
+namespace websocket { namespace details
+{
+    const RouteId NoRoute = RouteId(-1);
+
+    // a route and its state shared by the server threads
+    struct RouteConfig
+    {
+        RouteId id{0};
+        Route route;
+        const Handlers* handlers{nullptr}; // events of the route go to the event queue if null
+        std::atomic<std::size_t> connections{0};
+    };
+
+    // Finds the route of a request path in a trie of path segments, so the cost depends on
+    // the path length rather than on the number of routes. Not modified after construction.
+    class RouteTable
+    {
+    public:
+        // route 0 is "/" with the server-wide limits and `handlers`, ServerOptions::routes follow it;
+        // a later route with the same path replaces an earlier one
+        RouteTable(const ServerOptions& options, const Handlers* handlers)
+        {
+            Route defaultRoute;
+            defaultRoute.path = "/";
+            defaultRoute.maxMessageSize = options.maxMessageSize;
+            defaultRoute.deflate = options.deflate;
+            add(defaultRoute, handlers);
+
+            for (auto&& route : options.routes)
+                add(route, nullptr);
+        }
+
+        RouteTable(const RouteTable&) = delete;
+        void operator=(const RouteTable&) = delete;
+
+        // nullptr if no route serves the path
+        RouteConfig* find(http::Span path)
+        {
+            auto node = &m_root;
+            auto found = node->prefixRoute;
+
+            auto iter = path.begin;
+            if (iter == path.end || *iter != '/')
+                return nullptr;
+
+            // a trailing '/' is ignored like in add()
+            while (iter != path.end && iter + 1 != path.end)
+            {
+                auto segmentEnd = iter + 1;
+                while (segmentEnd != path.end && *segmentEnd != '/')
+                    ++segmentEnd;
+
+                node = node->child(iter + 1, segmentEnd);
+                if (!node)
+                    break;
+
+                if (node->prefixRoute != NoRoute)
+                    found = node->prefixRoute;
+
+                iter = segmentEnd;
+            }
+
+            if (node && node->exactRoute != NoRoute)
+                found = node->exactRoute;
+
+            return found == NoRoute ? nullptr : m_routes[found].get();
+        }
+
+        RouteConfig& operator[](RouteId id) { return *m_routes[id]; }
+        std::size_t size() const { return m_routes.size(); }
+
+    private:
+        struct Node
+        {
+            std::vector<std::pair<std::string, std::unique_ptr<Node>>> children;
+            RouteId exactRoute{NoRoute};
+            RouteId prefixRoute{NoRoute};
+
+            Node* child(const char* begin, const char* end)
+            {
+                for (auto&& c : children)
+                {
+                    if (c.first.size() == std::size_t(end - begin) && c.first.compare(0, c.first.size(), begin, end - begin) == 0)
+                        return c.second.get();
+                }
+
+                return nullptr;
+            }
+        };
+
+        void add(const Route& route, const Handlers* handlers)
+        {
+            if (route.path.empty() || route.path[0] != '/')
+                throw std::invalid_argument("route path must start with '/': " + route.path);
+
+            auto isSet = route.handlers.onOpen || route.handlers.onMessage || route.handlers.onClose || route.handlers.onEvent;
+
+            std::unique_ptr<RouteConfig> config{new RouteConfig};
+            config->id = RouteId(m_routes.size());
+            config->route = route;
+            config->handlers = isSet ? &config->route.handlers : handlers;
+
+            // "/a/b" is the root, "a" and "b"; "/" and "/a/" end with an empty segment that isn't stored
+            auto node = &m_root;
+            auto&& path = route.path;
+            for (std::size_t pos = 0; pos + 1 < path.size();)
+            {
+                auto next = std::min(path.find('/', pos + 1), path.size());
+                auto child = node->child(&path[pos + 1], path.data() + next);
+                if (!child)
+                {
+                    node->children.emplace_back(path.substr(pos + 1, next - pos - 1), std::unique_ptr<Node>{new Node});
+                    child = node->children.back().second.get();
+                }
+
+                node = child;
+                pos = next;
+            }
+
+            (route.matchPrefix ? node->prefixRoute : node->exactRoute) = config->id;
+            m_routes.push_back(std::move(config));
+        }
+
+        Node m_root;
+        std::vector<std::unique_ptr<RouteConfig>> m_routes;
+    };
+}}
@@ -3,13 +3,22 @@
 
 #pragma once
 
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
 #include <functional>
+#include <limits>
+#include <mutex>
 #include <ostream>
+#include <sstream>
+#include <stdexcept>
 #include <string>
 #include <boost/asio.hpp>
+#include <boost/asio/steady_timer.hpp>
 
 #include "Connection.hpp"
 #include "handshake.hpp"
+#include "TimingWheel.hpp"
 #include "../server_fwd.hpp"
 
 namespace websocket { namespace details
@@ -17,81 +26,311 @@ namespace websocket { namespace details
     class ServerLogic
     {
     public:
+        // `callback(event, connId, message, route)` queues an event
         template<typename Callback>
-        ServerLogic(std::ostream& log, Callback&& callback)
+        ServerLogic(boost::asio::io_service& ioService, std::ostream& log, const ServerOptions& options, RouteTable& routes, Callback&& callback,
+            ConnectionIdLayout idLayout = ConnectionIdLayout())
             : m_log{log}
+            , m_options(options)
+            , m_routes(routes)
             , m_callback(callback)
-        {}
+            , m_pingTicks{toTicks(options.pingInterval)}
+            , m_idleTicks{toTicks(options.idleTimeout)}
+            , m_closeTicks{toTicks(options.closeTimeout)}
+            , m_tickTimer{ioService}
+            , m_connTable{idLayout}
+        {
+            if (hasTimers())
+                startTicking();
+        }
 
         using conn_t = Connection<ServerLogic>;
 
-        void processFrame(ConnectionId id, Opcode opcode, std::string message)
+        // passed to the handlers of the routes
+        void setContext(LoopContext& context)
+        {
+            m_context = &context;
+        }
+
+        // message in the receive buffer
+        void processFrame(conn_t& conn, Opcode opcode, const char* data, std::size_t size, bool isFinal)
         {
-            if (opcode == Opcode::Text || opcode == Opcode::Binary)
+            auto handlers = conn.route().handlers;
+            if (opcode != Opcode::Text && opcode != Opcode::Binary)
             {
-                m_callback(Event::Message, id, message);
+                log("#", conn.m_id, ": WARNING: unknown opcode ", (int)opcode);
+            }
+            else if (handlers)
+            {
+                if (handlers->onMessage)
+                    handlers->onMessage(*m_context, conn.m_id, MessageView{data, size}, isFinal);
             }
             else
             {
-                log("#", id, ": WARNING: unknown opcode ", (int)opcode);
+                m_callback(isFinal ? Event::Message : Event::MessageFragment, conn.m_id, std::string(data, size), conn.route().id);
             }
         }
 
+        // reassembled or decompressed message
+        void processFrame(conn_t& conn, Opcode opcode, std::string message, bool isFinal)
+        {
+            if (conn.route().handlers)
+                processFrame(conn, opcode, message.data(), message.size(), isFinal);
+            else
+                m_callback(isFinal ? Event::Message : Event::MessageFragment, conn.m_id, std::move(message), conn.route().id);
+        }
+
+        void sendQueueEvent(conn_t& conn, Event event)
+        {
+            auto handlers = conn.route().handlers;
+            if (!handlers)
+                m_callback(event, conn.m_id, "", conn.route().id);
+            else if (handlers->onEvent)
+                handlers->onEvent(*m_context, conn.m_id, event);
+        }
+
         void drop(conn_t& conn)
         {
             if (!conn.m_isClosed)
             {
                 conn.close();
-                m_callback(Event::Disconnect, conn.m_id, "");
+                m_timers.cancel(conn.m_timer);
+
+                auto handlers = conn.route().handlers;
+                if (!handlers)
+                    m_callback(Event::Disconnect, conn.m_id, conn.closePayload(), conn.route().id);
+                else if (handlers->onClose)
+                    handlers->onClose(*m_context, conn.m_id);
             }
 
             if (!conn.m_isReading && !conn.m_isSending)
+            {
                 m_connTable.erase(conn);
+
+                // the thread exits when its last connection is gone
+                if (m_isStopped && m_connTable.isEmpty())
+                {
+                    boost::system::error_code ignoreError;
+                    m_tickTimer.cancel(ignoreError);
+                }
+            }
+        }
+
+        // closing handshake started by the server, the client is dropped if it doesn't finish it in closeTimeout
+        void close(conn_t& conn, CloseCode code, const std::string& reason)
+        {
+            if (m_closeTicks == 0)
+                drop(conn);
+            else
+                conn.sendClose(closePayload(code, reason));
+        }
+
+        // a Close frame is queued: the send queue and the closing handshake must complete before the deadline
+        void onCloseSent(conn_t& conn)
+        {
+            m_timers.schedule(conn.m_timer, m_timers.now() + std::max<std::uint64_t>(m_closeTicks, 1));
+            startTicking();
         }
 
         template<typename... Ts>
         void log(Ts&&... t)
         {
-            int h[]{(m_log << t, 0)...};
+            std::ostringstream line;
+            int h[]{(line << t, 0)...};
             (void)h;
-            m_log << std::endl;
+
+            writeLog(line.str());
         }
 
         void onAccept(boost::asio::ip::tcp::socket& clientSocket, boost::asio::yield_context& yield)
         {
-            if (performHandshake(clientSocket, yield))
+            DeflateParams deflate;
+            RouteConfig* route = nullptr;
+            std::string query;
+            if (performHandshake(clientSocket, yield, deflate, route, query))
             {
-                auto& conn = m_connTable.add(std::move(clientSocket), *this);
-                m_callback(Event::NewConnection, conn.m_id, "");
+                if (m_isStopped)
+                {
+                    --route->connections;
+                    return;
+                }
+
+                auto& conn = m_connTable.add(std::move(clientSocket), *this, *route, deflate);
+                if (hasTimers())
+                    scheduleTimer(conn);
+
+                if (!route->handlers)
+                    m_callback(Event::NewConnection, conn.m_id, std::move(query), route->id);
+                else if (route->handlers->onOpen)
+                    route->handlers->onOpen(*m_context, conn.m_id);
             }
         }
 
         conn_t* find(ConnectionId id) { return m_connTable.find(id); }
 
+        template<typename F>
+        void forEach(F&& f) { m_connTable.forEach(std::forward<F>(f)); }
+
+        const ServerOptions& options() const { return m_options; }
+
+        // the timing wheel tick, connections remember when they last received data
+        std::uint64_t currentTick() const { return m_timers.now(); }
+
+        // close the connections with CloseCode::GoingAway, the send queues drain within closeTimeout
         void stop()
         {
-            m_connTable.closeAll();
+            m_isStopped = true;
+            m_connTable.forEach([this](conn_t& conn) { close(conn, CloseCode::GoingAway, ""); });
+
+            if (m_connTable.isEmpty())
+            {
+                boost::system::error_code ignoreError;
+                m_tickTimer.cancel(ignoreError);
+            }
         }
 
     private:
         void operator=(const ServerLogic&) = delete;
 
-        bool performHandshake(boost::asio::ip::tcp::socket& socket, boost::asio::yield_context& yield)
+        // rounded up, 0 stays 0
+        std::uint64_t toTicks(std::chrono::milliseconds duration) const
         {
-            boost::system::error_code ec;
-            boost::asio::streambuf buf;
-            boost::asio::async_read_until(socket, buf, "\r\n\r\n", yield[ec]);
-            if (ec)
+            if (duration.count() <= 0)
+                return 0;
+
+            if (m_options.timerTick.count() <= 0)
+                throw std::invalid_argument("ServerOptions::timerTick must be positive");
+
+            return std::uint64_t((duration.count() + m_options.timerTick.count() - 1) / m_options.timerTick.count());
+        }
+
+        bool hasTimers() const { return m_pingTicks != 0 || m_idleTicks != 0; }
+
+        // one steady_timer per thread drives the timers of all its connections;
+        // it starts with the server if pings or idle timeouts are enabled, with the first closing handshake otherwise
+        void startTicking()
+        {
+            if (m_isTicking)
+                return;
+
+            m_isTicking = true;
+            m_nextTick = std::chrono::steady_clock::now();
+            scheduleTick();
+        }
+
+        void scheduleTick()
+        {
+            m_nextTick += m_options.timerTick;
+            m_tickTimer.expires_at(m_nextTick);
+            m_tickTimer.async_wait([this](const boost::system::error_code& ec)
             {
-                log("Handshake: read error: ", ec);
-                return false;
+                if (!ec)
+                    m_timers.advance([this](conn_t& conn) { onTimer(conn); });
+
+                if (ec || (m_isStopped && m_connTable.isEmpty()))
+                    m_isTicking = false;
+                else
+                    scheduleTick();
+            });
+        }
+
+        // wake up at the next ping or idle deadline counted from the last data received
+        void scheduleTimer(conn_t& conn)
+        {
+            auto due = std::numeric_limits<std::uint64_t>::max();
+            if (m_pingTicks != 0)
+                due = conn.m_isPingSent ? m_timers.now() + m_pingTicks : conn.m_lastRecvTick + m_pingTicks;
+
+            if (m_idleTicks != 0)
+                due = std::min(due, conn.m_lastRecvTick + m_idleTicks);
+
+            m_timers.schedule(conn.m_timer, due);
+        }
+
+        // receiving doesn't touch the wheel, so a timer can find that the client has spoken since it was set
+        void onTimer(conn_t& conn)
+        {
+            if (conn.m_isCloseSent)
+            {
+                log("#", conn.m_id, ": close timeout");
+                drop(conn);
+                return;
+            }
+
+            auto silentTicks = m_timers.now() - conn.m_lastRecvTick;
+            if (m_idleTicks != 0 && silentTicks >= m_idleTicks)
+            {
+                log("#", conn.m_id, ": idle timeout");
+                drop(conn);
+                return;
+            }
+
+            if (m_pingTicks != 0 && silentTicks >= m_pingTicks)
+            {
+                conn.sendFrame(Opcode::Ping, {});
+                conn.m_isPingSent = true;
             }
 
-            std::istream requestStream(&buf);
-            std::ostringstream replyStream;
-            auto status = handshake(requestStream, replyStream);
+            scheduleTimer(conn);
+        }
+
+        // on success `route` has a place in route->connections reserved for the new connection
+        bool performHandshake(boost::asio::ip::tcp::socket& socket, boost::asio::yield_context& yield, DeflateParams& deflate,
+            RouteConfig*& route, std::string& query)
+        {
+            auto selectRoute = [&](const http::RequestView& rq, const DeflateOptions*& deflateOptions)
+            {
+                auto found = m_routes.find(rq.requestPath);
+                if (!found)
+                    return http::Status::NotFound;
+
+                auto maxConnections = found->route.maxConnections;
+                if (found->connections.fetch_add(1) >= maxConnections && maxConnections != 0)
+                {
+                    --found->connections;
+                    return http::Status::ServiceUnavailable;
+                }
+
+                route = found;
+                deflateOptions = &found->route.deflate;
+                query.assign(rq.query.begin, rq.query.end);
+                return http::Status::OK;
+            };
+
+            // the request is parsed in place, nothing is allocated unless permessage-deflate is negotiated
+            char request[HandshakeRequestSize];
+            std::size_t size = 0;
+            HandshakeReply reply;
+            http::Status status;
+            boost::system::error_code ec;
+
+            for (;;)
+            {
+                if (size == sizeof(request))
+                {
+                    status = http::Status::RequestEntityTooLarge;
+                    writeErrorReply(status, reply);
+                    break;
+                }
+
+                auto n = socket.async_read_some(boost::asio::buffer(request + size, sizeof(request) - size), yield[ec]);
+                if (ec)
+                {
+                    log("Handshake: read error: ", ec);
+                    return false;
+                }
+
+                auto scanFrom = size < 3 ? 0 : size - 3;
+                size += n;
+                if (http::parser::findRequestEnd(request + scanFrom, request + size))
+                {
+                    // bytes after the request are rejected, the client must wait for the reply before sending frames
+                    status = routeHandshake(request, request + size, reply, selectRoute, deflate);
+                    break;
+                }
+            }
 
-            boost::asio::async_write(socket, boost::asio::buffer(replyStream.str()), yield[ec]);
+            boost::asio::async_write(socket, boost::asio::buffer(reply.data(), reply.size()), yield[ec]);
 
             if (status != http::Status::OK)
             {
@@ -102,14 +341,37 @@ namespace websocket { namespace details
             if (ec)
             {
                 log("Handshake: write error: ", ec);
+                --route->connections;
                 return false;
             }
 
             return true;
         }
 
+        // the log can be shared by several server threads; one mutex for every line, whatever log() was called with
+        void writeLog(const std::string& line)
+        {
+            static std::mutex mutex;
+            std::lock_guard<std::mutex> lock{mutex};
+            m_log << line << std::endl;
+        }
+
         std::ostream& m_log;
-        std::function<void(Event, ConnectionId, std::string)> m_callback;
+        ServerOptions m_options;
+        RouteTable& m_routes;
+        std::function<void(Event, ConnectionId, std::string, RouteId)> m_callback;
+
+        // ping and idle timeouts of the connections
+        std::uint64_t m_pingTicks;
+        std::uint64_t m_idleTicks;
+        std::uint64_t m_closeTicks;
+        TimingWheel<conn_t> m_timers;
+        boost::asio::steady_timer m_tickTimer;
+        std::chrono::steady_clock::time_point m_nextTick;
+        bool m_isTicking{false};
+        bool m_isStopped{false};
+
         ConnectionTable<ServerLogic> m_connTable;
+        LoopContext* m_context{nullptr};
     };
 }}
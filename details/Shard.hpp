@@ -0,0 +1,324 @@
+// Websocket Server implementation
+// Belongs to the public domain
+
+#pragma once
+
+#include <atomic>
+#include <cassert>
+#include <deque>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <boost/asio.hpp>
+
+#include "Acceptor.hpp"
+#include "BoundedQueue.hpp"
+#include "ServerLogic.hpp"
+#include "../server_fwd.hpp"
+
+namespace websocket { namespace details
+{
+    class Shard;
+
+    // a request from another thread, queued for the shard thread
+    struct Command
+    {
+        enum class Type { Send, Broadcast, Drop, Close, Stream };
+
+        Type type{Type::Send};
+        ConnectionId connId{0};
+        bool isBinary{false};
+        std::string message;             // Send, the reason for Close
+        CloseCode closeCode{CloseCode::Normal}; // Close
+        MessageProducer producer;        // Stream
+        frame_ptr frame;                 // Broadcast
+        std::vector<ConnectionId> connIds; // Broadcast to these connections, all if empty
+    };
+
+    // passes calls of a server thread on to the connections of the other threads
+    class ShardRouter
+    {
+    public:
+        virtual void send(ConnectionId connId, std::string message, bool isBinary) = 0;
+        virtual void sendStream(ConnectionId connId, MessageProducer producer, bool isBinary) = 0;
+        virtual void sendFrame(ConnectionId connId, const frame_ptr& frame) = 0;
+        virtual void drop(ConnectionId connId) = 0;
+        virtual void drop(ConnectionId connId, CloseCode code, std::string reason) = 0;
+        virtual void broadcast(const frame_ptr& frame, const Shard* except) = 0;
+
+    protected:
+        ~ShardRouter() {}
+    };
+
+    // A server thread with its own io_service, acceptor and connections.
+    // Everything but the constructor, post() and join() is called on the shard thread.
+    class Shard : public LoopContext
+    {
+    public:
+        using conn_t = ServerLogic::conn_t;
+
+        // `callback` queues the events of the routes without handlers
+        template<typename Callback>
+        Shard(boost::asio::ip::tcp::endpoint endpoint, std::ostream& log, const ServerOptions& options, RouteTable& routes, Callback&& callback,
+            ShardRouter& router, ConnectionIdLayout idLayout, bool reusePort)
+            : m_commands{options.commandQueueSize}
+            , m_logic{m_ioService, log, options, routes, std::forward<Callback>(callback), idLayout}
+            , m_acceptor{m_ioService, endpoint, m_logic, reusePort}
+            , m_router(router)
+            , m_idLayout(idLayout)
+        {
+            m_logic.setContext(*this);
+        }
+
+        ~Shard()
+        {
+            assert(!m_workerThread || !m_workerThread->joinable());
+        }
+
+        void start()
+        {
+            m_workerThread.reset(new std::thread{[this]{ workerThread(); }});
+        }
+
+        template<typename F>
+        void post(F&& f)
+        {
+            m_ioService.post(std::forward<F>(f));
+        }
+
+        // any thread: queue a command, it runs after wakeUp()
+        void push(Command& command)
+        {
+            if (!m_hasSpilled.load(std::memory_order_acquire) && m_commands.tryPush(command))
+                return;
+
+            // the ring is full: keep the order in a locked list instead of blocking the caller
+            std::lock_guard<std::mutex> lock{m_spillMutex};
+            m_spilled.push_back(std::move(command));
+            m_hasSpilled.store(true, std::memory_order_release);
+        }
+
+        // any thread: make the shard thread run the queued commands, one wakeup for many commands
+        void wakeUp()
+        {
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (!m_isDrainScheduled.exchange(true))
+                post([this] { runCommands(); });
+        }
+
+        void submit(Command command)
+        {
+            push(command);
+            wakeUp();
+        }
+
+        void stop()
+        {
+            post([this]
+            {
+                m_isStopped = true;
+                m_acceptor.stop();
+                m_logic.stop();
+            });
+        }
+
+        void join()
+        {
+            if (m_workerThread)
+                m_workerThread->join();
+        }
+
+        void send(ConnectionId connId, std::string message, bool isBinary)
+        {
+            if (auto conn = m_logic.find(connId))
+            {
+                auto op = isBinary ? Opcode::Binary : Opcode::Text;
+                conn->sendFrame(op, std::move(message));
+            }
+        }
+
+        void broadcast(const frame_ptr& frame)
+        {
+            m_logic.forEach([&](conn_t& conn) { conn.sendFrame(frame); });
+        }
+
+        void broadcast(const frame_ptr& frame, const std::vector<ConnectionId>& connIds)
+        {
+            for (auto connId : connIds)
+            {
+                if (auto conn = m_logic.find(connId))
+                    conn->sendFrame(frame);
+            }
+        }
+
+        // LoopContext, called by the handlers
+        void sendText(ConnectionId connId, std::string message) override { sendInLoop(connId, std::move(message), false); }
+        void sendBinary(ConnectionId connId, std::string message) override { sendInLoop(connId, std::move(message), true); }
+        void broadcastText(std::string message) override { broadcastInLoop(std::move(message), false); }
+        void broadcastBinary(std::string message) override { broadcastInLoop(std::move(message), true); }
+
+        void sendStream(ConnectionId connId, MessageProducer producer, bool isBinary) override
+        {
+            if (!isLocal(connId))
+                m_router.sendStream(connId, std::move(producer), isBinary);
+            else if (auto conn = m_logic.find(connId))
+                conn->sendStream(isBinary ? Opcode::Binary : Opcode::Text, std::move(producer));
+        }
+
+        void sendFile(ConnectionId connId, int fd, std::uint64_t offset, std::uint64_t length) override
+        {
+            auto frame = std::make_shared<const ServerFrame>(Opcode::Binary, std::make_shared<const FilePayload>(fd, offset, length));
+            if (!isLocal(connId))
+                m_router.sendFrame(connId, frame);
+            else if (auto conn = m_logic.find(connId))
+                conn->sendFrame(frame);
+        }
+
+        void drop(ConnectionId connId) override
+        {
+            if (isLocal(connId))
+            {
+                if (auto conn = m_logic.find(connId))
+                    m_logic.drop(*conn);
+            }
+            else
+            {
+                m_router.drop(connId);
+            }
+        }
+
+        void drop(ConnectionId connId, CloseCode code, std::string reason) override
+        {
+            if (isLocal(connId))
+            {
+                if (auto conn = m_logic.find(connId))
+                    m_logic.close(*conn, code, reason);
+            }
+            else
+            {
+                m_router.drop(connId, code, std::move(reason));
+            }
+        }
+
+        std::size_t queuedBytes(ConnectionId connId) override
+        {
+            auto conn = m_logic.find(connId);
+            return conn ? conn->queuedBytes() : 0;
+        }
+
+    private:
+        void runCommands()
+        {
+            auto&& run = [this](Command&& command) { runCommand(command); };
+            const std::size_t BatchSize = 256;
+
+            for (;;)
+            {
+                while (m_commands.popBatch(BatchSize, run) != 0)
+                    ;
+
+                if (m_hasSpilled.load(std::memory_order_acquire))
+                {
+                    std::deque<Command> spilled;
+                    {
+                        std::lock_guard<std::mutex> lock{m_spillMutex};
+                        while (m_commands.popBatch(BatchSize, run) != 0)
+                            ; // commands queued before the spilled ones
+                        spilled.swap(m_spilled);
+                        m_hasSpilled.store(false, std::memory_order_release);
+                    }
+
+                    for (auto&& command : spilled)
+                        runCommand(command);
+                }
+
+                m_isDrainScheduled.store(false);
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                if (m_commands.isEmpty() && !m_hasSpilled.load(std::memory_order_acquire))
+                    return;
+
+                if (m_isDrainScheduled.exchange(true))
+                    return; // a producer has posted another run
+            }
+        }
+
+        void runCommand(Command& command)
+        {
+            switch (command.type)
+            {
+            case Command::Type::Send:
+                send(command.connId, std::move(command.message), command.isBinary);
+                break;
+            case Command::Type::Broadcast:
+                if (command.connIds.empty())
+                    broadcast(command.frame);
+                else
+                    broadcast(command.frame, command.connIds);
+                break;
+            case Command::Type::Drop:
+                drop(command.connId);
+                break;
+            case Command::Type::Close:
+                drop(command.connId, command.closeCode, std::move(command.message));
+                break;
+            case Command::Type::Stream:
+                sendStream(command.connId, std::move(command.producer), command.isBinary);
+                break;
+            }
+        }
+
+        bool isLocal(ConnectionId connId) const { return m_idLayout.shardOf(connId) == m_idLayout.shard; }
+
+        void sendInLoop(ConnectionId connId, std::string message, bool isBinary)
+        {
+            if (isLocal(connId))
+                send(connId, std::move(message), isBinary);
+            else
+                m_router.send(connId, std::move(message), isBinary);
+        }
+
+        void broadcastInLoop(std::string message, bool isBinary)
+        {
+            auto frame = std::make_shared<const ServerFrame>(isBinary ? Opcode::Binary : Opcode::Text, std::move(message));
+            broadcast(frame);
+            m_router.broadcast(frame, this);
+        }
+
+        void workerThread()
+        {
+            while (!m_isStopped)
+            {
+                try
+                {
+                    m_ioService.run();
+                    assert(m_isStopped);
+                }
+                catch (std::exception& e)
+                {
+                    m_logic.log("ERROR: ", e.what());
+                }
+            }
+        }
+
+        bool m_isStopped{false};
+
+        // commands from other threads
+        BoundedQueue<Command> m_commands;
+        std::atomic<bool> m_isDrainScheduled{false};
+        std::atomic<bool> m_hasSpilled{false};
+        std::mutex m_spillMutex;
+        std::deque<Command> m_spilled;
+
+        boost::asio::io_service m_ioService;
+        std::unique_ptr<std::thread> m_workerThread;
+
+        ServerLogic m_logic;
+        Acceptor<ServerLogic> m_acceptor;
+        ShardRouter& m_router;
+        ConnectionIdLayout m_idLayout;
+    };
+}}
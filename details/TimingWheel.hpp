@@ -0,0 +1,142 @@
+// Websocket Server implementation
+// Belongs to the public domain
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+namespace websocket { namespace details
+{
+    // Hashed timing wheel: a timer due at tick T waits in slot T % slots, so scheduling and cancelling
+    // are O(1) and a tick only visits the timers of one slot. Timers further than `slots` ticks away
+    // stay in their slot for several turns of the wheel. Not thread-safe.
+    template<typename T>
+    class TimingWheel
+    {
+    public:
+        // intrusive list hook, embedded in the owner; unlinks itself when destroyed
+        class Node
+        {
+        public:
+            explicit Node(T* owner = nullptr)
+                : m_owner{owner}
+            {}
+
+            ~Node() { unlink(); }
+
+            Node(const Node&) = delete;
+            void operator=(const Node&) = delete;
+
+            bool isScheduled() const { return m_next != nullptr; }
+            std::uint64_t dueTick() const { return m_dueTick; }
+
+        private:
+            friend class TimingWheel;
+
+            void unlink()
+            {
+                if (!m_next)
+                    return;
+
+                m_prev->m_next = m_next;
+                m_next->m_prev = m_prev;
+                m_prev = m_next = nullptr;
+            }
+
+            // insert before `head`, i.e. at the end of its list
+            void linkBefore(Node& head)
+            {
+                m_prev = head.m_prev;
+                m_next = &head;
+                head.m_prev->m_next = this;
+                head.m_prev = this;
+            }
+
+            void makeHead() { m_prev = m_next = this; }
+
+            T* m_owner;
+            Node* m_prev{nullptr};
+            Node* m_next{nullptr};
+            std::uint64_t m_dueTick{0};
+        };
+
+        // slots are rounded up to a power of 2
+        explicit TimingWheel(std::size_t slots = 512)
+        {
+            std::size_t size = 1;
+            while (size < slots)
+                size *= 2;
+
+            m_mask = size - 1;
+            m_slots.reset(new Node[size]);
+            for (std::size_t i = 0; i != size; ++i)
+                m_slots[i].makeHead();
+        }
+
+        ~TimingWheel()
+        {
+            // leave the remaining nodes unlinked, their owners may outlive the wheel
+            for (std::size_t i = 0; i <= m_mask; ++i)
+            {
+                auto&& head = m_slots[i];
+                while (head.m_next != &head)
+                    head.m_next->unlink();
+                head.m_prev = head.m_next = nullptr;
+            }
+        }
+
+        TimingWheel(const TimingWheel&) = delete;
+        void operator=(const TimingWheel&) = delete;
+
+        std::uint64_t now() const { return m_now; }
+
+        // (re)schedule `node` for the absolute `tick`, the next tick if it's not in the future
+        void schedule(Node& node, std::uint64_t tick)
+        {
+            node.unlink();
+            node.m_dueTick = tick > m_now ? tick : m_now + 1;
+            node.linkBefore(m_slots[node.m_dueTick & m_mask]);
+        }
+
+        void cancel(Node& node) { node.unlink(); }
+
+        // move to the next tick, call onExpired(owner) for each timer due;
+        // the callback may schedule or destroy any node
+        template<typename F>
+        void advance(F&& onExpired)
+        {
+            ++m_now;
+
+            Node expired;
+            expired.makeHead();
+
+            auto&& head = m_slots[m_now & m_mask];
+            for (auto node = head.m_next; node != &head;)
+            {
+                auto next = node->m_next;
+                if (node->m_dueTick <= m_now)
+                {
+                    node->unlink();
+                    node->linkBefore(expired);
+                }
+                node = next;
+            }
+
+            while (expired.m_next != &expired)
+            {
+                auto node = expired.m_next;
+                node->unlink();
+                onExpired(*node->m_owner);
+            }
+
+            expired.m_prev = expired.m_next = nullptr;
+        }
+
+    private:
+        std::unique_ptr<Node[]> m_slots; // list heads
+        std::size_t m_mask;
+        std::uint64_t m_now{0};
+    };
+}}
@@ -3,28 +3,53 @@
 
 #pragma once
 
+#include <cstddef>
+#include <cstdint>
 #include <string>
-#if defined _MSC_VER
-#pragma warning(push)
-#pragma warning(disable: 4127) // conditional expression is constant
-#endif
-#include <boost/archive/iterators/base64_from_binary.hpp>
-#include <boost/archive/iterators/transform_width.hpp>
-#if defined _MSC_VER
-#pragma warning(pop)
-#endif
+
+// size of the encoded data
+inline std::size_t b64encodedSize(std::size_t size)
+{
+    return (size + 2) / 3 * 4;
+}
+
+// write b64encodedSize(size) characters to `out`, return their count
+inline std::size_t b64encode(const void* data, std::size_t size, char* out)
+{
+    static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+    auto bytes = static_cast<const std::uint8_t*>(data);
+    auto start = out;
+    for (; size >= 3; size -= 3, bytes += 3)
+    {
+        std::uint32_t triple = bytes[0] << 16 | bytes[1] << 8 | bytes[2];
+        *out++ = alphabet[triple >> 18];
+        *out++ = alphabet[(triple >> 12) & 0x3F];
+        *out++ = alphabet[(triple >> 6) & 0x3F];
+        *out++ = alphabet[triple & 0x3F];
+    }
+
+    if (size != 0)
+    {
+        std::uint32_t triple = bytes[0] << 16 | (size == 2 ? bytes[1] << 8 : 0);
+        *out++ = alphabet[triple >> 18];
+        *out++ = alphabet[(triple >> 12) & 0x3F];
+        *out++ = size == 2 ? alphabet[(triple >> 6) & 0x3F] : '=';
+        *out++ = '=';
+    }
+
+    return out - start;
+}
 
 inline std::string b64encode(const void* data, std::size_t size)
 {
-    using namespace boost::archive::iterators;
-    using iter_t = base64_from_binary<transform_width<const char*, 6, 8>>;
-    auto bytes = static_cast<const char*>(data);
-    std::string encoded(iter_t{bytes}, iter_t{bytes + size});
-    encoded.append("\0\2\1"[size % 3], '='); // TBD: looks too hacky
+    std::string encoded(b64encodedSize(size), '\0');
+    if (size != 0)
+        b64encode(data, size, &encoded[0]);
     return encoded;
 }
 
 inline std::string b64encode(const std::string& data)
 {
-    return b64encode(&data[0], data.size());
-}
\ No newline at end of file
+    return b64encode(data.data(), data.size());
+}
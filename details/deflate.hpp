@@ -0,0 +1,416 @@
+// permessage-deflate extension
+// http://tools.ietf.org/html/rfc7692
+
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <zlib.h>
+
+#include "../server_fwd.hpp"
+
+namespace websocket { namespace details
+{
+    // negotiated extension parameters
+    struct DeflateParams
+    {
+        bool enabled{false};
+        bool serverNoContextTakeover{false};
+        bool clientNoContextTakeover{false};
+        int serverMaxWindowBits{15};
+        int clientMaxWindowBits{15};
+    };
+
+    namespace deflate_impl
+    {
+        inline bool isTokenChar(char c)
+        {
+            return c > 32 && c < 127 && !std::strchr("()<>@,;:\\\"/[]?={}", c);
+        }
+
+        inline void eatWhitespace(const char*& iter, const char* end)
+        {
+            while (iter != end && (*iter == ' ' || *iter == '\t'))
+                ++iter;
+        }
+
+        inline bool parseToken(const char*& iter, const char* end, std::string& token)
+        {
+            auto start = iter;
+            while (iter != end && isTokenChar(*iter))
+                ++iter;
+
+            token.assign(start, iter);
+            return !token.empty();
+        }
+
+        // token | quoted-string
+        inline bool parseValue(const char*& iter, const char* end, std::string& value)
+        {
+            if (iter == end || *iter != '"')
+                return parseToken(iter, end, value);
+
+            value.clear();
+            for (++iter; iter != end; ++iter)
+            {
+                if (*iter == '"')
+                {
+                    ++iter;
+                    return true;
+                }
+
+                if (*iter == '\\' && ++iter == end)
+                    return false;
+
+                value.push_back(*iter);
+            }
+
+            return false;
+        }
+
+        inline bool parseWindowBits(const std::string& value, int& bits)
+        {
+            auto isDigit = [](char c) { return c >= '0' && c <= '9'; };
+            if (value.empty() || value.size() > 2 || value[0] == '0' || !std::all_of(begin(value), end(value), isDigit))
+                return false;
+
+            bits = std::stoi(value);
+            return bits >= 8 && bits <= 15;
+        }
+
+        struct Offer
+        {
+            std::string name;
+            bool serverNoContextTakeover{false};
+            bool clientNoContextTakeover{false};
+            int serverMaxWindowBits{0}; // 0 - not present
+            int clientMaxWindowBits{0}; // 0 - not present, -1 - present without a value
+            bool isValid{true};
+        };
+
+        // extension = extension-token *( ";" extension-param ), see RFC 6455 9.1
+        inline bool parseOffer(const char*& iter, const char* end, Offer& offer)
+        {
+            eatWhitespace(iter, end);
+            if (!parseToken(iter, end, offer.name))
+                return false;
+
+            std::string param, value;
+            for (;;)
+            {
+                eatWhitespace(iter, end);
+                if (iter == end || *iter != ';')
+                    return true;
+
+                ++iter;
+                eatWhitespace(iter, end);
+                if (!parseToken(iter, end, param))
+                    return false;
+
+                eatWhitespace(iter, end);
+                auto hasValue = iter != end && *iter == '=';
+                if (hasValue)
+                {
+                    ++iter;
+                    eatWhitespace(iter, end);
+                    if (!parseValue(iter, end, value))
+                        return false;
+                }
+
+                auto flag = [&](bool& f)
+                {
+                    if (f || hasValue)
+                        offer.isValid = false;
+                    f = true;
+                };
+
+                if (param == "server_no_context_takeover")
+                {
+                    flag(offer.serverNoContextTakeover);
+                }
+                else if (param == "client_no_context_takeover")
+                {
+                    flag(offer.clientNoContextTakeover);
+                }
+                else if (param == "server_max_window_bits")
+                {
+                    if (offer.serverMaxWindowBits != 0 || !hasValue || !parseWindowBits(value, offer.serverMaxWindowBits))
+                        offer.isValid = false;
+                }
+                else if (param == "client_max_window_bits")
+                {
+                    if (offer.clientMaxWindowBits != 0)
+                        offer.isValid = false;
+                    else if (!hasValue)
+                        offer.clientMaxWindowBits = -1;
+                    else if (!parseWindowBits(value, offer.clientMaxWindowBits))
+                        offer.isValid = false;
+                }
+                else
+                {
+                    offer.isValid = false;
+                }
+            }
+        }
+
+        inline bool acceptOffer(const Offer& offer, const DeflateOptions& options, DeflateParams& params)
+        {
+            if (!offer.isValid || offer.name != "permessage-deflate")
+                return false;
+
+            // zlib can't compress with 256-byte window
+            auto serverBits = std::max(9, std::min(options.serverMaxWindowBits, 15));
+            if (offer.serverMaxWindowBits != 0)
+            {
+                if (offer.serverMaxWindowBits < serverBits)
+                {
+                    if (offer.serverMaxWindowBits < 9)
+                        return false;
+
+                    serverBits = offer.serverMaxWindowBits;
+                }
+            }
+
+            auto clientBits = 15;
+            if (offer.clientMaxWindowBits != 0)
+            {
+                clientBits = std::max(8, std::min(options.clientMaxWindowBits, 15));
+                if (offer.clientMaxWindowBits > 0)
+                    clientBits = std::min(clientBits, offer.clientMaxWindowBits);
+            }
+
+            params.enabled = true;
+            params.serverNoContextTakeover = offer.serverNoContextTakeover || options.serverNoContextTakeover;
+            params.clientNoContextTakeover = offer.clientNoContextTakeover || options.clientNoContextTakeover;
+            params.serverMaxWindowBits = serverBits;
+            params.clientMaxWindowBits = clientBits;
+            return true;
+        }
+    }
+
+    // pick the first acceptable permessage-deflate offer from the Sec-WebSocket-Extensions header value
+    inline bool negotiateDeflate(const char* begin, const char* end, const DeflateOptions& options, DeflateParams& params)
+    {
+        params = DeflateParams{};
+        if (!options.enabled)
+            return false;
+
+        auto iter = begin;
+        for (;;)
+        {
+            deflate_impl::Offer offer;
+            if (!deflate_impl::parseOffer(iter, end, offer))
+                return false;
+
+            if (deflate_impl::acceptOffer(offer, options, params))
+                return true;
+
+            deflate_impl::eatWhitespace(iter, end);
+            if (iter == end || *iter != ',')
+                return false;
+
+            ++iter;
+        }
+    }
+
+    inline bool negotiateDeflate(const std::string& extensions, const DeflateOptions& options, DeflateParams& params)
+    {
+        return negotiateDeflate(extensions.data(), extensions.data() + extensions.size(), options, params);
+    }
+
+    // write the value of the Sec-WebSocket-Extensions response header with out.append(data, size)
+    template<typename Output>
+    void writeDeflateResponse(const DeflateParams& params, Output& out)
+    {
+        auto append = [&](const char* s) { out.append(s, std::strlen(s)); };
+        auto appendBits = [&](int bits)
+        {
+            char digits[2] = {char('0' + bits / 10), char('0' + bits % 10)};
+            if (bits < 10)
+                out.append(digits + 1, 1);
+            else
+                out.append(digits, 2);
+        };
+
+        append("permessage-deflate");
+        if (params.serverNoContextTakeover)
+            append("; server_no_context_takeover");
+        if (params.clientNoContextTakeover)
+            append("; client_no_context_takeover");
+        if (params.serverMaxWindowBits != 15)
+        {
+            append("; server_max_window_bits=");
+            appendBits(params.serverMaxWindowBits);
+        }
+        if (params.clientMaxWindowBits != 15)
+        {
+            append("; client_max_window_bits=");
+            appendBits(params.clientMaxWindowBits);
+        }
+    }
+
+    // value of the Sec-WebSocket-Extensions response header
+    inline std::string deflateResponse(const DeflateParams& params)
+    {
+        std::string response;
+        writeDeflateResponse(params, response);
+        return response;
+    }
+
+    // compressor and decompressor of one connection
+    class PerMessageDeflate
+    {
+    public:
+        PerMessageDeflate(const DeflateParams& params, const DeflateOptions& options)
+            : m_params(params)
+            , m_minCompressSize{options.minCompressSize}
+        {
+            std::memset(&m_deflate, 0, sizeof(m_deflate));
+            std::memset(&m_inflate, 0, sizeof(m_inflate));
+
+            auto memLevel = std::max(1, std::min(options.memLevel, 9));
+            if (deflateInit2(&m_deflate, options.compressionLevel, Z_DEFLATED, -params.serverMaxWindowBits, memLevel, Z_DEFAULT_STRATEGY) != Z_OK)
+                throw std::runtime_error("permessage-deflate: deflateInit2 failed");
+
+            // a larger window can always inflate data compressed with a smaller one
+            if (inflateInit2(&m_inflate, -std::max(9, params.clientMaxWindowBits)) != Z_OK)
+            {
+                deflateEnd(&m_deflate);
+                throw std::runtime_error("permessage-deflate: inflateInit2 failed");
+            }
+        }
+
+        ~PerMessageDeflate()
+        {
+            deflateEnd(&m_deflate);
+            inflateEnd(&m_inflate);
+        }
+
+        PerMessageDeflate(const PerMessageDeflate&) = delete;
+        void operator=(const PerMessageDeflate&) = delete;
+
+        bool shouldCompress(std::size_t size) const { return size != 0 && size >= m_minCompressSize; }
+
+        // the longest output of compress() for `size` bytes
+        std::size_t maxCompressedSize(std::size_t size)
+        {
+            // uLong is 32-bit on Windows, longer messages get the generic bound of zlib
+            auto bound = size <= std::numeric_limits<uLong>::max() / 2
+                ? std::size_t(deflateBound(&m_deflate, static_cast<uLong>(size)))
+                : size + ((size + 7) >> 3) + ((size + 63) >> 6) + 5;
+
+            // the sync flush appends an empty stored block, 4 bytes of it are removed
+            return bound + 6 - 4;
+        }
+
+        // compress a whole non-empty message
+        std::string compress(const char* data, std::size_t size)
+        {
+            std::string out;
+            out.resize(maxCompressedSize(size) + 4);
+
+            // avail_in and avail_out are uInt, a message of 4 GiB or more is fed in parts
+            const std::size_t MaxChunk = std::numeric_limits<uInt>::max();
+            m_deflate.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+            auto remaining = size;
+
+            std::size_t outLen = 0;
+            do
+            {
+                auto chunk = std::min(remaining, MaxChunk);
+                m_deflate.avail_in = static_cast<uInt>(chunk);
+                remaining -= chunk;
+                auto flush = remaining == 0 ? Z_SYNC_FLUSH : Z_NO_FLUSH;
+
+                do
+                {
+                    // a sync flush into 6 bytes or less would repeat the flush marker
+                    if (out.size() - outLen <= 6)
+                        out.resize(out.size() * 2);
+
+                    auto room = std::min(out.size() - outLen, MaxChunk);
+                    m_deflate.next_out = reinterpret_cast<Bytef*>(&out[outLen]);
+                    m_deflate.avail_out = static_cast<uInt>(room);
+                    deflate(&m_deflate, flush);
+                    outLen += room - m_deflate.avail_out;
+                } while (m_deflate.avail_out == 0);
+            } while (remaining != 0);
+
+            // remove 00 00 FF FF of the empty stored block, RFC 7692 7.2.1
+            out.resize(outLen - 4);
+
+            if (m_params.serverNoContextTakeover)
+                deflateReset(&m_deflate);
+
+            return out;
+        }
+
+        enum class Result { OK, TooBig, Error };
+
+        // decompress a fragment of a compressed message, append it to `out`
+        Result decompress(const char* data, std::size_t size, bool isFinal, std::string& out, std::size_t maxSize)
+        {
+            auto result = inflateData(data, size, out, maxSize);
+            if (result == Result::OK && isFinal)
+            {
+                static const char tail[] = {0, 0, -1, -1};
+                result = inflateData(tail, sizeof(tail), out, maxSize);
+
+                if (m_params.clientNoContextTakeover)
+                    inflateReset(&m_inflate);
+            }
+
+            return result;
+        }
+
+        const DeflateParams& params() const { return m_params; }
+
+    private:
+        Result inflateData(const char* data, std::size_t size, std::string& out, std::size_t maxSize)
+        {
+            m_inflate.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+            m_inflate.avail_in = static_cast<uInt>(size);
+
+            auto outLen = out.size();
+            for (;;)
+            {
+                if (outLen == out.size())
+                    out.resize(std::min(maxSize + 1, std::max(out.size() * 2, outLen + 4 * size + 64)));
+
+                m_inflate.next_out = reinterpret_cast<Bytef*>(&out[outLen]);
+                m_inflate.avail_out = static_cast<uInt>(out.size() - outLen);
+                auto rc = inflate(&m_inflate, Z_SYNC_FLUSH);
+                outLen = out.size() - m_inflate.avail_out;
+
+                if (outLen > maxSize)
+                {
+                    out.resize(outLen);
+                    return Result::TooBig;
+                }
+
+                if (rc == Z_STREAM_END)
+                    inflateReset(&m_inflate); // the client has set BFINAL, next block starts a new stream
+                else if (rc != Z_OK && rc != Z_BUF_ERROR)
+                    break;
+
+                if (m_inflate.avail_in == 0 && m_inflate.avail_out != 0)
+                {
+                    out.resize(outLen);
+                    return Result::OK;
+                }
+            }
+
+            out.resize(outLen);
+            return Result::Error;
+        }
+
+        DeflateParams m_params;
+        std::size_t m_minCompressSize;
+        z_stream m_deflate;
+        z_stream m_inflate;
+    };
+}}
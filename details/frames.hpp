@@ -3,12 +3,18 @@
 
 #pragma once
 
+#include <algorithm>
 #include <cstddef>
 #include <cstdint>
 #include <cstring>
+#include <memory>
 #include <stdexcept>
 #include <string>
 
+#include "FilePayload.hpp"
+#include "mask.hpp"
+#include "../server_fwd.hpp"
+
 namespace websocket { namespace details
 {
     enum class Opcode
@@ -23,29 +29,82 @@ namespace websocket { namespace details
         ReservedB, ReservedC, ReservedD, ReservedE, ReservedF,
     };
 
+    inline bool isControlFrame(Opcode opcode)
+    {
+        return (static_cast<int>(opcode) & 0x08) != 0;
+    }
+
+    // payload of a Close frame: 2-byte status code in network byte order
+    inline std::string closePayload(CloseCode code)
+    {
+        auto n = static_cast<std::uint16_t>(code);
+        return{char(n >> 8), char(n & 0xFF)};
+    }
+
+    // ... followed by the UTF-8 reason, cut to the 123 bytes left in a control frame at a character boundary
+    inline std::string closePayload(CloseCode code, const std::string& reason)
+    {
+        const std::size_t MaxReasonSize = 125 - 2;
+        auto size = reason.size();
+        if (size > MaxReasonSize)
+        {
+            size = MaxReasonSize;
+            while (size != 0 && (static_cast<unsigned char>(reason[size]) & 0xC0) == 0x80)
+                --size;
+        }
+
+        return closePayload(code).append(reason, 0, size);
+    }
+
+    // status codes a peer may send, see RFC 6455, 7.4
+    inline bool isValidCloseCode(std::uint16_t code)
+    {
+        return (code >= 1000 && code <= 1003) || (code >= 1007 && code <= 1014) || (code >= 3000 && code <= 4999);
+    }
+
     struct ServerFrame
     {
-        ServerFrame(Opcode opcode, std::string data)
+        // a fragment of a streamed message if isFinal is false; the fragments after the first one are Continuation frames
+        ServerFrame(Opcode opcode, std::string data, bool isCompressed = false, bool isFinal = true)
             : m_data(std::move(data))
         {
-            writeOpcode(opcode);
-            writeLen();
+            writeOpcode(opcode, isCompressed, isFinal);
+            writeLen(m_data.size());
         }
 
-        std::uint8_t m_header[1 + 1 + 8];
+        // the payload is a range of a file, written after the header
+        ServerFrame(Opcode opcode, std::shared_ptr<const FilePayload> file)
+            : m_file(std::move(file))
+        {
+            writeOpcode(opcode, false, true);
+            writeLen(m_file->length());
+        }
+
+        // of an unmasked server frame
+        static const std::size_t MaxHeaderLen = 1 + 1 + 8;
+
+        Opcode opcode() const { return static_cast<Opcode>(m_header[0] & 0x0F); }
+        bool isFinal() const { return (m_header[0] & 0x80) != 0; }
+        bool isCompressed() const { return (m_header[0] & 0x40) != 0; }
+
+        // bytes held in memory, a file payload isn't counted
+        std::size_t size() const { return m_headerLen + m_data.size(); }
+
+        std::uint8_t m_header[MaxHeaderLen];
         std::uint8_t m_headerLen;
         std::string m_data;
+        std::shared_ptr<const FilePayload> m_file;
 
     private:
-        void writeOpcode(Opcode op)
+        void writeOpcode(Opcode op, bool isCompressed, bool isFinal)
         {
             const auto FinalFragmentFlag = 0x80;
-            m_header[0] = FinalFragmentFlag | static_cast<std::uint8_t>(op);
+            const auto CompressedFlag = 0x40; // RSV1, see RFC 7692 6
+            m_header[0] = (isFinal ? FinalFragmentFlag : 0) | (isCompressed ? CompressedFlag : 0) | static_cast<std::uint8_t>(op);
         }
 
-        void writeLen()
+        void writeLen(std::uint64_t n)
         {
-            auto n = m_data.size();
             if (n <= 125)
             {
                 m_headerLen = 1 + 1;
@@ -59,50 +118,64 @@ namespace websocket { namespace details
                 m_header[2] = (n >> 8) & 0xFF;
                 m_header[3] = n & 0xFF;
             }
-            else if (n <= 0xFFffFFff)
+            else
             {
+                // the most significant bit must be 0, see RFC 6455 5.2
+                if (n >> 63)
+                    throw std::length_error("websocket message is too long");
+
                 m_headerLen = 1 + 1 + 8;
                 m_header[1] = 127;
-
-                m_header[2] = 0;
-                m_header[3] = 0;
-                m_header[4] = 0;
-                m_header[5] = 0;
-                m_header[6] = (n >> 8 * 3) & 0xFF;
-                m_header[7] = (n >> 8 * 2) & 0xFF;
-                m_header[8] = (n >> 8 * 1) & 0xFF;
-                m_header[9] = n & 0xFF;
-            }
-            else
-            {
-                throw std::length_error("websocket message is too long");
+                for (auto i = 0; i != 8; ++i)
+                    m_header[2 + i] = (n >> 8 * (7 - i)) & 0xFF;
             }
         }
     };
 
+    // encoded frames are immutable, so one frame can be queued on many connections
+    using frame_ptr = std::shared_ptr<const ServerFrame>;
+
     class FrameReceiver
     {
     public:
         static const auto MinHeaderLen = 1 + 1 + 4;
-        static const auto MaxPayloadLen = 125;
-        static const auto BufferSize = MinHeaderLen + MaxPayloadLen;
+        static const auto MaxHeaderLen = 1 + 1 + 8 + 4;
+        static const std::size_t InitialBufferSize = 4096;
+        static const std::size_t DefaultMaxMessageSize = 1024 * 1024;
+
+        // don't issue a read into less free space than this, move the pending data to the buffer start instead
+        static const std::size_t MinReadSize = 512;
+
+        // shrink back to InitialBufferSize after this many frames that used less than a quarter of the buffer
+        static const auto ShrinkAfterFrames = 16;
 
-        FrameReceiver() {}
+        explicit FrameReceiver(std::size_t maxMessageSize = DefaultMaxMessageSize)
+            : m_buffer{new char[InitialBufferSize]}
+            , m_bufferSize{InitialBufferSize}
+            , m_maxMessageSize{maxMessageSize}
+        {}
 
-        void* getBufferTail() { return m_buffer; }
-        std::size_t getBufferTailSize() { return BufferSize; }
+        // accept RSV1 bit of the first frame of a data message
+        void enableCompression() { m_isCompressionEnabled = true; }
+
+        char* getBufferTail() { return m_buffer.get() + m_dataLen; }
+        std::size_t getBufferTailSize() const { return m_bufferSize - m_dataLen; }
 
         std::size_t needReceiveMore(std::size_t bytesWritten) const
         {
-            auto available = m_dataLen + bytesWritten;
+            auto available = bytesAvailable() + bytesWritten;
             if (!isValidFrame(available))
                 return 0;
 
             if (available < 2)
-                return 1;
+                return 2 - available;
+
+            auto headerLen = std::size_t(payloadStart());
+            if (available < headerLen)
+                return headerLen - available;
 
-            auto needBytes = frameLen() - available;
-            return needBytes > 0 ? std::size_t(needBytes) : 0;
+            auto len = frameLen();
+            return len > available ? std::size_t(len - available) : 0;
         }
 
         void addBytes(std::size_t n)
@@ -110,17 +183,27 @@ namespace websocket { namespace details
             m_dataLen += n;
         }
 
+        // bytes of the current frame (and the frames after it) in the buffer
+        std::size_t bytesAvailable() const { return m_dataLen - m_frameStart; }
+
         bool isValidFrame() const
         {
-            return isValidFrame(m_dataLen);
+            return isValidFrame(bytesAvailable());
         }
 
         bool isValidFrame(std::size_t bytesAvailable) const
         {
             if (bytesAvailable == 0)
                 return true;
-            
-            if (!isFinalFragment())
+
+            const auto isControl = isControlFrame(opcode());
+            if (isControl && !isFinalFragment())
+                return false;
+
+            if (isRsv2() || isRsv3())
+                return false;
+
+            if (isCompressed() && (!m_isCompressionEnabled || isControl || opcode() == Opcode::Continuation))
                 return false;
 
             if (bytesAvailable == 1)
@@ -129,38 +212,132 @@ namespace websocket { namespace details
             if (!isMasked())
                 return false;
 
-            if (payloadLen() > MaxPayloadLen)
+            if (isControl && lengthFieldLen() != 0)
+                return false; // control frame payload must be 125 bytes or less
+
+            if (bytesAvailable < std::size_t(2 + lengthFieldLen()))
+                return true;
+
+            if (payloadLen() > m_maxMessageSize)
                 return false;
 
             return true;
         }
 
-        bool isFinalFragment() const { return (m_buffer[0] & 0x80) != 0; }
-        Opcode opcode() const { return static_cast<Opcode>(m_buffer[0] & 0x0F); }
-        bool isMasked() const { return (m_buffer[1] & 0x80) != 0; }
-        int payloadLen() const { return m_buffer[1] & 0x7f; }
-        int payloadStart() const { return MinHeaderLen; }
-        int frameLen() const { return payloadStart() + payloadLen(); }
-        std::string message() const { return{m_buffer + payloadStart(), static_cast<unsigned>(payloadLen())}; }
+        // the frame is invalid because its payload exceeds the message size limit
+        bool isTooLong() const
+        {
+            auto available = bytesAvailable();
+            return available >= 2 && available >= std::size_t(2 + lengthFieldLen()) && payloadLen() > m_maxMessageSize;
+        }
+
+        bool isFrameComplete() const
+        {
+            return isHeaderComplete() && bytesAvailable() >= frameLen();
+        }
+
+        // make room for the next read: the rest of the current frame must fit into the buffer
+        void prepareBuffer()
+        {
+            auto needed = isHeaderComplete() ? std::size_t(frameLen()) : std::size_t(MaxHeaderLen);
+
+            if (needed > m_bufferSize)
+                reallocate(std::max(needed, std::min(m_bufferSize * 2, m_maxMessageSize + MaxHeaderLen)));
+            else if (m_frameStart != 0 && (m_frameStart + needed > m_bufferSize || getBufferTailSize() < MinReadSize))
+                compact();
+        }
+
+        bool isFinalFragment() const { return (frame()[0] & 0x80) != 0; }
+        bool isCompressed() const { return (frame()[0] & 0x40) != 0; }
+        bool isRsv2() const { return (frame()[0] & 0x20) != 0; }
+        bool isRsv3() const { return (frame()[0] & 0x10) != 0; }
+        Opcode opcode() const { return static_cast<Opcode>(frame()[0] & 0x0F); }
+        bool isMasked() const { return (frame()[1] & 0x80) != 0; }
+        int lengthFieldLen() const
+        {
+            auto len7 = frame()[1] & 0x7f;
+            return len7 == 126 ? 2 : len7 == 127 ? 8 : 0;
+        }
+        std::uint64_t payloadLen() const
+        {
+            auto lenFieldLen = lengthFieldLen();
+            if (lenFieldLen == 0)
+                return frame()[1] & 0x7f;
+
+            auto lenField = reinterpret_cast<const std::uint8_t*>(frame()) + 2;
+            std::uint64_t n = 0;
+            for (auto i = 0; i != lenFieldLen; ++i)
+                n = (n << 8) | lenField[i];
+
+            return n;
+        }
+        int payloadStart() const { return 1 + 1 + lengthFieldLen() + 4; }
+        std::uint64_t frameLen() const { return payloadStart() + payloadLen(); }
+        const char* payload() const { return frame() + payloadStart(); }
+        std::string message() const { return{payload(), static_cast<std::size_t>(payloadLen())}; }
 
         void unmask()
         {
-            auto data = m_buffer + payloadStart();
+            auto data = m_buffer.get() + m_frameStart + payloadStart();
             auto key = data - 4;
-
-            for (auto i = 0; i != payloadLen(); ++i)
-                data[i] ^= key[i % 4];
+            applyMask(data, static_cast<std::size_t>(payloadLen()), key);
         }
 
+        // skip the current frame
         void shiftBuffer()
         {
-            auto currentFrameLen = frameLen();
-            m_dataLen -= currentFrameLen;
-            std::memmove(m_buffer, m_buffer + currentFrameLen, m_dataLen);
+            auto currentFrameLen = static_cast<std::size_t>(frameLen());
+            m_frameStart += currentFrameLen;
+            if (m_frameStart == m_dataLen)
+                m_frameStart = m_dataLen = 0;
+
+            if (m_bufferSize == InitialBufferSize)
+                return;
+
+            if (currentFrameLen < m_bufferSize / 4)
+                ++m_smallFrames;
+            else
+                m_smallFrames = 0;
+
+            if (m_smallFrames >= ShrinkAfterFrames && bytesAvailable() <= InitialBufferSize)
+                reallocate(InitialBufferSize);
         }
 
+        std::size_t bufferSize() const { return m_bufferSize; }
+
     private:
-        char m_buffer[BufferSize];
+        const char* frame() const { return m_buffer.get() + m_frameStart; }
+
+        bool isHeaderComplete() const
+        {
+            auto available = bytesAvailable();
+            return available >= 2 && available >= std::size_t(payloadStart());
+        }
+
+        void compact()
+        {
+            std::memmove(m_buffer.get(), m_buffer.get() + m_frameStart, bytesAvailable());
+            m_dataLen -= m_frameStart;
+            m_frameStart = 0;
+        }
+
+        void reallocate(std::size_t newSize)
+        {
+            std::unique_ptr<char[]> newBuffer{new char[newSize]};
+            std::memcpy(newBuffer.get(), m_buffer.get() + m_frameStart, bytesAvailable());
+            m_buffer = std::move(newBuffer);
+            m_bufferSize = newSize;
+            m_dataLen -= m_frameStart;
+            m_frameStart = 0;
+            m_smallFrames = 0;
+        }
+
+        std::unique_ptr<char[]> m_buffer;
+        std::size_t m_bufferSize;
+        std::size_t m_frameStart{0};
         std::size_t m_dataLen{0};
+        std::size_t m_maxMessageSize;
+        int m_smallFrames{0};
+        bool m_isCompressionEnabled{false};
     };
 }}
\ No newline at end of file
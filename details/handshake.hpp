@@ -3,86 +3,149 @@
 
 #pragma once
 
-#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <cstring>
 #include <string>
 #include "http_parser.hpp"
 #include "sha1.hpp"
 #include "base64.hpp"
+#include "deflate.hpp"
 
 namespace websocket { namespace details
 {
-    inline http::Status validateRequest(const http::Request& rq)
+    // the request path is checked by the route selector of routeHandshake()
+    inline http::Status validateRequest(const http::RequestView& rq)
     {
         if (rq.method != http::Method::GET)
             return http::Status::MethodNotAllowed;
 
-        if (rq.requestPath != "/")
-            return http::Status::NotFound;
-
         if (rq.httpVersion != http::Version::v1_1)
             return http::Status::HTTPVersionNotSupported;
 
         if (rq.secWebSocketVersion != 13)
             return http::Status::NotImplemented;
 
-        if (std::find(begin(rq.connection), end(rq.connection), "upgrade") == end(rq.connection))
-            return http::Status::BadRequest;
-
-        if (std::find_if(begin(rq.upgrade), end(rq.upgrade), [](const http::Product& p) { return p.name == "websocket"; }) == end(rq.upgrade))
+        if (!rq.connectionUpgrade || !rq.upgradeWebsocket)
             return http::Status::BadRequest;
 
         return http::Status::OK;
     }
 
-    inline std::string calcSecKeyHash(const std::string& clientKey)
+    // longest handshake request the server reads
+    const std::size_t HandshakeRequestSize = 8192;
+
+    const std::size_t SecKeyHashSize = 28; // base64 of SHA-1
+
+    // write SecKeyHashSize characters to `out`
+    inline void calcSecKeyHash(const char* clientKey, std::size_t size, char* out)
     {
-        auto websocketKeyGUID = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+        static const char websocketKeyGUID[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
 
         SHA1 sha1;
-        sha1.update(&clientKey[0], clientKey.size());
-        sha1.update(websocketKeyGUID, std::strlen(websocketKeyGUID));
+        sha1.update(clientKey, size);
+        sha1.update(websocketKeyGUID, sizeof(websocketKeyGUID) - 1);
         char sha1Buffer[SHA1::DIGEST_SIZE];
         sha1.digest(sha1Buffer);
 
-        return b64encode(sha1Buffer, SHA1::DIGEST_SIZE);
+        b64encode(sha1Buffer, SHA1::DIGEST_SIZE, out);
     }
 
-    inline http::Status processHandshakeRequest(std::istream& stream, http::Request& rq)
+    inline std::string calcSecKeyHash(const std::string& clientKey)
     {
-        rq.secWebSocketVersion = 0;
+        std::string hash(SecKeyHashSize, '\0');
+        calcSecKeyHash(clientKey.data(), clientKey.size(), &hash[0]);
+        return hash;
+    }
 
-        if (!http::parser::parseRequestLine(stream, rq))
-            return http::Status::BadRequest;
+    // Handshake reply in a fixed buffer
+    class HandshakeReply
+    {
+    public:
+        static const std::size_t Capacity = 512;
 
-        if (!http::parser::parseRequestHeaders(stream, rq))
-            return http::Status::BadRequest;
+        void append(const char* data, std::size_t size)
+        {
+            assert(size <= Capacity - m_size);
+            std::memcpy(m_data + m_size, data, size);
+            m_size += size;
+        }
 
-        stream.peek();
-        if (!stream.eof())
-            return http::Status::BadRequest;
+        void append(const char* s) { append(s, std::strlen(s)); }
+
+        const char* data() const { return m_data; }
+        std::size_t size() const { return m_size; }
 
-        return validateRequest(rq);
+    private:
+        char m_data[Capacity];
+        std::size_t m_size{0};
+    };
+
+    inline void writeErrorReply(http::Status status, HandshakeReply& reply)
+    {
+        auto n = int(status);
+        char code[] = {char('0' + n / 100), char('0' + n / 10 % 10), char('0' + n % 10)};
+        reply.append("HTTP/1.1 ");
+        reply.append(code, sizeof(code));
+        reply.append(" :(\r\n\r\n");
     }
 
-    inline http::Status handshake(std::istream& requestStream, std::ostream& replyStream)
+    // [begin, end) is the whole request up to http::parser::findRequestEnd(); no heap allocations
+    // unless permessage-deflate is enabled and offered.
+    // `selectRoute(rq, deflateOptions)` returns the status for the request path and sets the extension options of the endpoint.
+    template<typename RouteSelector>
+    inline http::Status routeHandshake(const char* begin, const char* end, HandshakeReply& reply, RouteSelector&& selectRoute, DeflateParams& deflate)
     {
-        http::Request rq;
-        auto status = processHandshakeRequest(requestStream, rq);
+        http::RequestView rq;
+        auto status = http::parser::parseRequest(begin, end, rq) == end ? validateRequest(rq) : http::Status::BadRequest;
 
+        const DeflateOptions* deflateOptions = nullptr;
         if (status == http::Status::OK)
+            status = selectRoute(static_cast<const http::RequestView&>(rq), deflateOptions);
+
+        if (status != http::Status::OK)
         {
-            replyStream <<
-                "HTTP/1.1 101 Switching Protocols\r\n"
-                "Upgrade: websocket\r\n"
-                "Connection: Upgrade\r\n"
-                "Sec-WebSocket-Accept: " << calcSecKeyHash(rq.secWebSocketKey) << "\r\n"
-                "\r\n";
+            writeErrorReply(status, reply);
+            return status;
         }
-        else
+
+        char secKeyHash[SecKeyHashSize];
+        calcSecKeyHash(rq.secWebSocketKey.begin, rq.secWebSocketKey.size(), secKeyHash);
+
+        reply.append(
+            "HTTP/1.1 101 Switching Protocols\r\n"
+            "Upgrade: websocket\r\n"
+            "Connection: Upgrade\r\n"
+            "Sec-WebSocket-Accept: ");
+        reply.append(secKeyHash, SecKeyHashSize);
+        reply.append("\r\n");
+
+        deflate = DeflateParams{};
+        for (std::size_t i = 0; i != rq.extensionHeaders; ++i)
         {
-            replyStream << "HTTP/1.1 " << (int)status << " :(\r\n\r\n";
+            auto&& extensions = rq.secWebSocketExtensions[i];
+            if (negotiateDeflate(extensions.begin, extensions.end, *deflateOptions, deflate))
+            {
+                reply.append("Sec-WebSocket-Extensions: ");
+                writeDeflateResponse(deflate, reply);
+                reply.append("\r\n");
+                break;
+            }
         }
 
+        reply.append("\r\n");
         return status;
     }
+
+    // a server with the only endpoint "/"
+    inline http::Status handshake(const char* begin, const char* end, HandshakeReply& reply, const DeflateOptions& deflateOptions, DeflateParams& deflate)
+    {
+        auto selectRoute = [&](const http::RequestView& rq, const DeflateOptions*& options)
+        {
+            options = &deflateOptions;
+            return http::parser::equals(rq.requestPath, "/") ? http::Status::OK : http::Status::NotFound;
+        };
+
+        return routeHandshake(begin, end, reply, selectRoute, deflate);
+    }
 }}
\ No newline at end of file
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cstddef>
 #include <string>
 #include <vector>
 
@@ -125,8 +126,41 @@ namespace http
 
         int secWebSocketVersion;
         std::string secWebSocketKey;
+        std::string secWebSocketExtensions;
 
         std::vector<Product> upgrade;
         std::vector<std::string> connection;
     };
+
+    // a piece of the request buffer
+    struct Span
+    {
+        const char* begin{nullptr};
+        const char* end{nullptr};
+
+        std::size_t size() const { return end - begin; }
+        bool empty() const { return begin == end; }
+        std::string str() const { return{begin, end}; }
+    };
+
+    // a request parsed in place, the spans point into the request buffer
+    struct RequestView
+    {
+        static const std::size_t MaxExtensionHeaders = 4;
+
+        Method method{Method::Unsupported};
+        Span requestPath;
+        Span query; // after '?' in the request target
+        Version httpVersion{Version::Unsupported};
+
+        int secWebSocketVersion{0};
+        Span secWebSocketKey;
+
+        // values of the Sec-WebSocket-Extensions headers, more headers are ignored
+        Span secWebSocketExtensions[MaxExtensionHeaders];
+        std::size_t extensionHeaders{0};
+
+        bool upgradeWebsocket{false};  // Upgrade lists the websocket product
+        bool connectionUpgrade{false}; // Connection lists the upgrade token
+    };
 }
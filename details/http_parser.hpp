@@ -1,11 +1,21 @@
 #pragma once
 
+#include <algorithm>
+#include <cstring>
 #include <istream>
 #include <boost/algorithm/string/predicate.hpp>
 #include <boost/algorithm/string/case_conv.hpp>
 
 #include "http.hpp"
 
+#if defined __SSE2__ || defined _M_X64 || (defined _M_IX86_FP && _M_IX86_FP >= 2)
+#define HTTP_PARSER_HAS_SSE2 1
+#include <emmintrin.h>
+#if defined _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
 namespace http { namespace parser
 {
     // see RFC2616 5.1 Request-Line (http://www.w3.org/Protocols/rfc2616/rfc2616-sec5.html#sec5.1)
@@ -133,6 +143,7 @@ namespace http { namespace parser
     {
         request.upgrade.clear();
         request.connection.clear();
+        request.secWebSocketExtensions.clear();
 
         std::string headerLine;
         while (std::getline(stream, headerLine))
@@ -180,6 +191,14 @@ namespace http { namespace parser
                 if (!parseBase64Raw(iter, request.secWebSocketKey))
                     return false;
             }
+            else if (fieldName("sec-websocket-extensions:")) // 1#extension, parsed during negotiation
+            {
+                eatWhitespace(iter);
+                if (!request.secWebSocketExtensions.empty())
+                    request.secWebSocketExtensions += ", ";
+                request.secWebSocketExtensions += iter;
+                iter = "";
+            }
             else
             {
                 iter = "";
@@ -191,4 +210,254 @@ namespace http { namespace parser
         }
         return false;
     }
-}}
\ No newline at end of file
+
+    // Parser of a complete request held in memory, see parseRequest().
+    // Works on [iter, end) spans, doesn't copy or allocate.
+
+    // first `c` in [iter, end) or `end`, 16 bytes at a time where SSE2 is available
+    inline const char* findByte(const char* iter, const char* end, char c)
+    {
+#if defined HTTP_PARSER_HAS_SSE2
+        auto pattern = _mm_set1_epi8(c);
+        for (; end - iter >= 16; iter += 16)
+        {
+            auto block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(iter));
+            auto mask = static_cast<unsigned>(_mm_movemask_epi8(_mm_cmpeq_epi8(block, pattern)));
+            if (mask != 0)
+            {
+#if defined _MSC_VER
+                unsigned long index;
+                _BitScanForward(&index, mask);
+                return iter + index;
+#else
+                return iter + __builtin_ctz(mask);
+#endif
+            }
+        }
+#endif
+        while (iter != end && *iter != c)
+            ++iter;
+        return iter;
+    }
+
+    // end of the empty line closing the headers or nullptr if the request is incomplete;
+    // to continue after more data has arrived, scan again from 3 bytes before the old end
+    inline const char* findRequestEnd(const char* iter, const char* end)
+    {
+        for (;;)
+        {
+            iter = findByte(iter, end, '\r');
+            if (end - iter < 4)
+                return nullptr;
+
+            if (std::memcmp(iter, "\r\n\r\n", 4) == 0)
+                return iter + 4;
+
+            ++iter;
+        }
+    }
+
+    inline void skipWhitespace(const char*& iter, const char* end)
+    {
+        while (iter != end && (*iter == ' ' || *iter == '\t'))
+            ++iter;
+    }
+
+    // compare with a lowercase literal ignoring case
+    inline bool iequals(Span span, const char* lower)
+    {
+        for (auto iter = span.begin; iter != span.end; ++iter, ++lower)
+        {
+            auto c = *iter >= 'A' && *iter <= 'Z' ? char(*iter + ('a' - 'A')) : *iter;
+            if (!*lower || c != *lower)
+                return false;
+        }
+
+        return !*lower;
+    }
+
+    inline bool equals(Span span, const char* s)
+    {
+        auto n = std::strlen(s);
+        return span.size() == n && std::memcmp(span.begin, s, n) == 0;
+    }
+
+    inline bool scanToken(const char*& iter, const char* end, Span& token)
+    {
+        token.begin = iter;
+        while (iter != end && !isControl(*iter) && !isSeparator(*iter))
+            ++iter;
+
+        token.end = iter;
+        return !token.empty();
+    }
+
+    // 1#element up to `end`, `parseElem(iter, end)` parses one element
+    template<typename ElementParser>
+    inline bool scanList(const char* iter, const char* end, ElementParser&& parseElem)
+    {
+        for (;;)
+        {
+            skipWhitespace(iter, end);
+            if (!parseElem(iter, end))
+                return false;
+
+            skipWhitespace(iter, end);
+            if (iter == end)
+                return true;
+
+            if (*iter != ',')
+                return false;
+
+            ++iter;
+        }
+    }
+
+    inline bool parseRequestLine(const char* iter, const char* end, RequestView& request)
+    {
+        auto methodEnd = findByte(iter, end, ' ');
+        if (methodEnd == end)
+            return false;
+
+        Span method{iter, methodEnd};
+        if (equals(method, "GET")) request.method = Method::GET;
+        else if (equals(method, "POST")) request.method = Method::POST;
+        else request.method = Method::Unsupported;
+
+        iter = methodEnd + 1;
+        auto pathEnd = findByte(iter, end, ' ');
+        if (pathEnd == end || pathEnd == iter)
+            return false;
+
+        auto queryStart = findByte(iter, pathEnd, '?');
+        request.requestPath = {iter, queryStart};
+        if (queryStart != pathEnd)
+            request.query = {queryStart + 1, pathEnd};
+
+        Span version{pathEnd + 1, end};
+        if (version.empty()) return false;
+        if (equals(version, "HTTP/1.1")) request.httpVersion = Version::v1_1;
+        else if (equals(version, "HTTP/1.0")) request.httpVersion = Version::v1_0;
+        else request.httpVersion = Version::Unsupported;
+
+        return true;
+    }
+
+    inline bool parseHeader(Span name, const char* iter, const char* end, RequestView& request)
+    {
+        skipWhitespace(iter, end);
+
+        if (iequals(name, "upgrade")) // 1#product
+        {
+            return scanList(iter, end, [&](const char*& i, const char* e)
+            {
+                Span product, version;
+                if (!scanToken(i, e, product))
+                    return false;
+
+                if (i != e && *i == '/' && !scanToken(++i, e, version))
+                    return false;
+
+                request.upgradeWebsocket = request.upgradeWebsocket || iequals(product, "websocket");
+                return true;
+            });
+        }
+
+        if (iequals(name, "connection")) // 1#token
+        {
+            return scanList(iter, end, [&](const char*& i, const char* e)
+            {
+                Span token;
+                if (!scanToken(i, e, token))
+                    return false;
+
+                request.connectionUpgrade = request.connectionUpgrade || iequals(token, "upgrade");
+                return true;
+            });
+        }
+
+        if (iequals(name, "sec-websocket-version")) // 0-255
+        {
+            auto version = 0;
+            for (; iter != end && *iter >= '0' && *iter <= '9'; ++iter)
+                version = std::min(version * 10 + (*iter - '0'), 1000);
+
+            request.secWebSocketVersion = version;
+        }
+        else if (iequals(name, "sec-websocket-key")) // base64
+        {
+            auto isBase64Char = [](char c)
+            {
+                return
+                    (c >= 'A' && c <= 'Z') ||
+                    (c >= 'a' && c <= 'z') ||
+                    (c >= '0' && c <= '9') ||
+                    c == '+' || c == '/';
+            };
+
+            request.secWebSocketKey.begin = iter;
+            while (iter != end && isBase64Char(*iter))
+                ++iter;
+            while (iter != end && *iter == '=')
+                ++iter;
+
+            request.secWebSocketKey.end = iter;
+            if (request.secWebSocketKey.empty())
+                return false;
+        }
+        else if (iequals(name, "sec-websocket-extensions")) // 1#extension, parsed during negotiation
+        {
+            while (end != iter && (end[-1] == ' ' || end[-1] == '\t'))
+                --end;
+
+            if (request.extensionHeaders != RequestView::MaxExtensionHeaders)
+                request.secWebSocketExtensions[request.extensionHeaders++] = {iter, end};
+
+            iter = end;
+        }
+        else
+        {
+            iter = end;
+        }
+
+        skipWhitespace(iter, end);
+        return iter == end;
+    }
+
+    // [begin, end) must hold the request line and the headers up to findRequestEnd(),
+    // returns the end of the parsed request or nullptr if it's malformed
+    inline const char* parseRequest(const char* begin, const char* end, RequestView& request)
+    {
+        request = RequestView{};
+
+        auto lineEnd = [end](const char* iter) -> const char*
+        {
+            auto cr = findByte(iter, end, '\r');
+            return end - cr >= 2 && cr[1] == '\n' ? cr : nullptr;
+        };
+
+        auto eol = lineEnd(begin);
+        if (!eol || !parseRequestLine(begin, eol, request))
+            return nullptr;
+
+        for (auto iter = eol + 2;; iter = eol + 2)
+        {
+            eol = lineEnd(iter);
+            if (!eol)
+                return nullptr;
+
+            if (eol == iter)
+                return eol + 2; // end of headers
+
+            if (*iter == ' ' || *iter == '\t')
+                continue; // a header field extends to next line
+
+            auto colon = findByte(iter, eol, ':');
+            if (colon == eol)
+                continue;
+
+            if (!parseHeader({iter, colon}, colon + 1, eol, request))
+                return nullptr;
+        }
+    }
+}}
@@ -0,0 +1,190 @@
+// Websocket Server implementation
+// Belongs to the public domain
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#if defined __SSE2__ || defined _M_X64 || (defined _M_IX86_FP && _M_IX86_FP >= 2)
+#define WEBSOCKET_HAS_SSE2 1
+#include <emmintrin.h>
+#endif
+
+#if (defined __GNUC__ && (defined __x86_64__ || defined __i386__)) || (defined _MSC_VER && (defined _M_X64 || defined _M_IX86))
+#define WEBSOCKET_HAS_AVX2 1
+#include <immintrin.h>
+#if defined _MSC_VER
+#include <intrin.h>
+#define WEBSOCKET_TARGET_AVX2
+#else
+#define WEBSOCKET_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+namespace websocket { namespace details
+{
+    // Masking kernels: XOR `size` bytes of `data` with the 4-byte masking `key`.
+    // `keyOffset` is the position of data[0] within the payload, so a payload can be processed in pieces.
+    using mask_fn = void(*)(char* data, std::size_t size, const char* key, std::size_t keyOffset);
+
+    inline void applyMaskBytewise(char* data, std::size_t size, const char* key, std::size_t keyOffset)
+    {
+        for (std::size_t i = 0; i != size; ++i)
+            data[i] ^= key[(keyOffset + i) % 4];
+    }
+
+    namespace mask_impl
+    {
+        // process bytes up to the `alignment` boundary, return the key rotated for the aligned part
+        inline std::uint32_t alignHead(char*& data, char* end, const char* key, std::size_t& keyOffset, std::size_t alignment)
+        {
+            while (data != end && reinterpret_cast<std::uintptr_t>(data) % alignment != 0)
+                *data++ ^= key[keyOffset++ % 4];
+
+            char rotated[4];
+            for (auto i = 0; i != 4; ++i)
+                rotated[i] = key[(keyOffset + i) % 4];
+
+            std::uint32_t key32;
+            std::memcpy(&key32, rotated, 4);
+            return key32;
+        }
+
+        inline void maskTail(char* data, char* end, std::uint32_t key32)
+        {
+            char key[4];
+            std::memcpy(key, &key32, 4);
+            for (auto i = 0; data != end; ++i)
+                *data++ ^= key[i % 4];
+        }
+    }
+
+    inline void applyMaskWordwise(char* data, std::size_t size, const char* key, std::size_t keyOffset)
+    {
+        auto end = data + size;
+        auto key32 = mask_impl::alignHead(data, end, key, keyOffset, sizeof(std::uint64_t));
+        auto key64 = (std::uint64_t(key32) << 32) | key32;
+
+        for (; end - data >= 8; data += 8)
+        {
+            std::uint64_t word;
+            std::memcpy(&word, data, 8);
+            word ^= key64;
+            std::memcpy(data, &word, 8);
+        }
+
+        mask_impl::maskTail(data, end, key32);
+    }
+
+#if defined WEBSOCKET_HAS_SSE2
+    inline void applyMaskSse2(char* data, std::size_t size, const char* key, std::size_t keyOffset)
+    {
+        auto end = data + size;
+        auto key32 = mask_impl::alignHead(data, end, key, keyOffset, 16);
+        auto key128 = _mm_set1_epi32(static_cast<int>(key32));
+
+        for (; end - data >= 64; data += 64)
+        {
+            auto p = reinterpret_cast<__m128i*>(data);
+            auto a = _mm_xor_si128(_mm_load_si128(p + 0), key128);
+            auto b = _mm_xor_si128(_mm_load_si128(p + 1), key128);
+            auto c = _mm_xor_si128(_mm_load_si128(p + 2), key128);
+            auto d = _mm_xor_si128(_mm_load_si128(p + 3), key128);
+            _mm_store_si128(p + 0, a);
+            _mm_store_si128(p + 1, b);
+            _mm_store_si128(p + 2, c);
+            _mm_store_si128(p + 3, d);
+        }
+
+        for (; end - data >= 16; data += 16)
+        {
+            auto p = reinterpret_cast<__m128i*>(data);
+            _mm_store_si128(p, _mm_xor_si128(_mm_load_si128(p), key128));
+        }
+
+        mask_impl::maskTail(data, end, key32);
+    }
+#endif
+
+#if defined WEBSOCKET_HAS_AVX2
+    WEBSOCKET_TARGET_AVX2
+    inline void applyMaskAvx2(char* data, std::size_t size, const char* key, std::size_t keyOffset)
+    {
+        auto end = data + size;
+        auto key32 = mask_impl::alignHead(data, end, key, keyOffset, 32);
+        auto key256 = _mm256_set1_epi32(static_cast<int>(key32));
+
+        for (; end - data >= 128; data += 128)
+        {
+            auto p = reinterpret_cast<__m256i*>(data);
+            auto a = _mm256_xor_si256(_mm256_load_si256(p + 0), key256);
+            auto b = _mm256_xor_si256(_mm256_load_si256(p + 1), key256);
+            auto c = _mm256_xor_si256(_mm256_load_si256(p + 2), key256);
+            auto d = _mm256_xor_si256(_mm256_load_si256(p + 3), key256);
+            _mm256_store_si256(p + 0, a);
+            _mm256_store_si256(p + 1, b);
+            _mm256_store_si256(p + 2, c);
+            _mm256_store_si256(p + 3, d);
+        }
+
+        for (; end - data >= 32; data += 32)
+        {
+            auto p = reinterpret_cast<__m256i*>(data);
+            _mm256_store_si256(p, _mm256_xor_si256(_mm256_load_si256(p), key256));
+        }
+
+        mask_impl::maskTail(data, end, key32);
+    }
+
+    inline bool cpuHasAvx2()
+    {
+#if defined _MSC_VER
+        int info[4];
+        __cpuid(info, 0);
+        if (info[0] < 7)
+            return false;
+
+        __cpuid(info, 1);
+        const auto osxsave = 1 << 27, avx = 1 << 28;
+        if ((info[2] & (osxsave | avx)) != (osxsave | avx))
+            return false;
+
+        if ((_xgetbv(0) & 0x6) != 0x6) // OS saves XMM and YMM state
+            return false;
+
+        __cpuidex(info, 7, 0);
+        return (info[1] & (1 << 5)) != 0;
+#else
+        return __builtin_cpu_supports("avx2") != 0;
+#endif
+    }
+#endif
+
+    inline mask_fn selectMaskKernel()
+    {
+#if defined WEBSOCKET_HAS_AVX2
+        if (cpuHasAvx2())
+            return applyMaskAvx2;
+#endif
+#if defined WEBSOCKET_HAS_SSE2
+        return applyMaskSse2;
+#else
+        return applyMaskWordwise;
+#endif
+    }
+
+    inline void applyMask(char* data, std::size_t size, const char* key, std::size_t keyOffset = 0)
+    {
+        // short payloads are not worth an indirect call
+        if (size < 16)
+        {
+            applyMaskBytewise(data, size, key, keyOffset);
+            return;
+        }
+
+        static const auto kernel = selectMaskKernel();
+        kernel(data, size, key, keyOffset);
+    }
+}}
@@ -3,18 +3,41 @@
 
 #pragma once
 
+#include <algorithm>
 #include <array>
 #include <cstdint>
 #include <cstddef>
+#include <cstring>
 #include <stdexcept>
 
+#if (defined __GNUC__ && (defined __x86_64__ || defined __i386__)) || (defined _MSC_VER && (defined _M_X64 || defined _M_IX86))
+#define WEBSOCKET_HAS_SHA_NI 1
+#include <immintrin.h>
+#if defined _MSC_VER
+#include <intrin.h>
+#define WEBSOCKET_TARGET_SHA_NI
+#else
+#include <cpuid.h>
+#define WEBSOCKET_TARGET_SHA_NI __attribute__((target("sha,sse4.1")))
+#endif
+#endif
+
 class SHA1
 {
 public:
     static const auto DIGEST_SIZE = 20;
+    static const auto BLOCK_SIZE = 64;
+
+    // Block kernels: update `hash` with `blocks` 64-byte blocks of `data`
+    using kernel_fn = void(*)(std::uint32_t* hash, const std::uint8_t* data, std::size_t blocks);
 
     SHA1()
-        : m_totalBits(0)
+        : SHA1(defaultKernel())
+    {}
+
+    explicit SHA1(kernel_fn kernel)
+        : m_kernel(kernel)
+        , m_totalBits(0)
         , m_blockPos(0)
         , m_finalized(false)
     {
@@ -36,19 +59,40 @@ public:
         if (!buffer)
             throw std::invalid_argument("sha1: null input buffer");
 
-        const auto message_array = (const std::uint8_t*)buffer;
+        if (size > (UINT64_MAX - m_totalBits) / 8)
+            throw std::length_error("sha1: message is too long");
 
-        for (auto i = 0u; i != size; ++i)
+        m_totalBits += std::uint64_t(size) * 8;
+
+        auto data = static_cast<const std::uint8_t*>(buffer);
+
+        // complete the buffered block
+        if (m_blockPos != 0)
         {
-            m_block[m_blockPos++] = message_array[i];
+            auto n = std::min<std::size_t>(size, BLOCK_SIZE - m_blockPos);
+            std::memcpy(&m_block[m_blockPos], data, n);
+            m_blockPos += int(n);
+            data += n;
+            size -= n;
+
+            if (m_blockPos != BLOCK_SIZE)
+                return;
 
-            m_totalBits += 8;
-            if (m_totalBits == 0)
-                throw std::length_error("sha1: message is too long");
+            m_kernel(m_hash.data(), m_block.data(), 1);
+            m_blockPos = 0;
+        }
 
-            if (m_blockPos == BLOCK_SIZE)
-                processBlock();
+        // whole blocks straight from the input
+        auto blocks = size / BLOCK_SIZE;
+        if (blocks != 0)
+        {
+            m_kernel(m_hash.data(), data, blocks);
+            data += blocks * BLOCK_SIZE;
+            size -= blocks * BLOCK_SIZE;
         }
+
+        std::memcpy(m_block.data(), data, size);
+        m_blockPos = int(size);
     }
 
     void digest(void* buffer)
@@ -72,53 +116,152 @@ public:
             writeUInt32BE(Message_Digest + i * 4, m_hash[i]);
     }
 
-private:
-    static const auto BLOCK_SIZE = 64;
+    static void processBlocksPortable(std::uint32_t* hash, const std::uint8_t* data, std::size_t blocks)
+    {
+        for (; blocks != 0; --blocks, data += BLOCK_SIZE)
+        {
+            std::uint32_t W[80];
+
+            for (auto i = 0; i != BLOCK_SIZE / 4; ++i)
+                W[i] = readUInt32BE(data + i * 4);
+
+            for (auto i = 16; i != 80; ++i)
+                W[i] = rol32(W[i - 3] ^ W[i - 8] ^ W[i - 14] ^ W[i - 16], 1);
+
+            auto A = hash[0];
+            auto B = hash[1];
+            auto C = hash[2];
+            auto D = hash[3];
+            auto E = hash[4];
+
+            auto f1 = [&]{ return (B & C) | (~B & D); };
+            auto f2 = [&]{ return B ^ C ^ D; };
+            auto f3 = [&]{ return (B & C) | (B & D) | (C & D); };
+            auto f4 = f2;
+
+            auto calc = [&](int t, std::uint32_t f, std::uint32_t K)
+            {
+                auto temp = rol32(A, 5) + f + E + W[t] + K;
+                E = D;
+                D = C;
+                C = rol32(B, 30);
+                B = A;
+                A = temp;
+            };
+
+            auto t = 0;
+            for (; t != 20; ++t) calc(t, f1(), 0x5A827999u);
+            for (; t != 40; ++t) calc(t, f2(), 0x6ED9EBA1u);
+            for (; t != 60; ++t) calc(t, f3(), 0x8F1BBCDCu);
+            for (; t != 80; ++t) calc(t, f4(), 0xCA62C1D6u);
+
+            hash[0] += A;
+            hash[1] += B;
+            hash[2] += C;
+            hash[3] += D;
+            hash[4] += E;
+        }
+    }
 
-    void processBlock()
+#if defined WEBSOCKET_HAS_SHA_NI
+    // Intel SHA extensions: each sha1rnds4 does 4 rounds, sha1msg1/sha1msg2 compute the message schedule
+    WEBSOCKET_TARGET_SHA_NI
+    static void processBlocksShaNi(std::uint32_t* hash, const std::uint8_t* data, std::size_t blocks)
     {
-        std::uint32_t W[80];
+        const auto byteSwap = _mm_set_epi64x(0x0001020304050607LL, 0x08090A0B0C0D0E0FLL);
 
-        for (auto i = 0; i != BLOCK_SIZE / 4; ++i)
-            W[i] = readUInt32BE(&m_block[i * 4]);
+        auto abcd = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(hash)), 0x1B);
+        auto e0 = _mm_set_epi32(int(hash[4]), 0, 0, 0);
 
-        for (auto i = 16; i != 80; ++i)
-            W[i] = rol32(W[i - 3] ^ W[i - 8] ^ W[i - 14] ^ W[i - 16], 1);
+        for (; blocks != 0; --blocks, data += BLOCK_SIZE)
+        {
+            auto abcdSave = abcd;
+            auto eSave = e0;
+
+            __m128i msg[4];
+            __m128i e[2] = {e0, e0};
+
+            // rounds 4*i .. 4*i+3; msg[i % 4] holds their schedule words, e[i % 2] the E value.
+            // Words of group j are msg2(msg1(W[j-4], W[j-3]) ^ W[j-2], W[j-1]), computed in steps j-3 .. j-1.
+            for (auto i = 0; i != 20; ++i)
+            {
+                auto&& w = msg[i % 4];
+                if (i < 4)
+                    w = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i * 16)), byteSwap);
+
+                auto&& ex = e[i % 2];
+                if (i == 0)
+                    ex = _mm_add_epi32(ex, w);
+                else
+                    ex = _mm_sha1nexte_epu32(ex, w);
+
+                e[(i + 1) % 2] = abcd;
+
+                if (i >= 3 && i <= 18)
+                    msg[(i + 1) % 4] = _mm_sha1msg2_epu32(msg[(i + 1) % 4], w);
+
+                switch (i / 5)
+                {
+                case 0: abcd = _mm_sha1rnds4_epu32(abcd, ex, 0); break;
+                case 1: abcd = _mm_sha1rnds4_epu32(abcd, ex, 1); break;
+                case 2: abcd = _mm_sha1rnds4_epu32(abcd, ex, 2); break;
+                default: abcd = _mm_sha1rnds4_epu32(abcd, ex, 3); break;
+                }
+
+                if (i >= 1 && i <= 16)
+                    msg[(i + 3) % 4] = _mm_sha1msg1_epu32(msg[(i + 3) % 4], w);
+
+                if (i >= 2 && i <= 17)
+                    msg[(i + 2) % 4] = _mm_xor_si128(msg[(i + 2) % 4], w);
+            }
+
+            e0 = _mm_sha1nexte_epu32(e[0], eSave);
+            abcd = _mm_add_epi32(abcd, abcdSave);
+        }
 
-        auto A = m_hash[0];
-        auto B = m_hash[1];
-        auto C = m_hash[2];
-        auto D = m_hash[3];
-        auto E = m_hash[4];
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(hash), _mm_shuffle_epi32(abcd, 0x1B));
+        hash[4] = std::uint32_t(_mm_extract_epi32(e0, 3));
+    }
 
-        auto f1 = [&]{ return (B & C) | (~B & D); };
-        auto f2 = [&]{ return B ^ C ^ D; };
-        auto f3 = [&]{ return (B & C) | (B & D) | (C & D); };
-        auto f4 = f2;
+    static bool cpuHasShaNi()
+    {
+        const auto ssse3 = 1 << 9, sse41 = 1 << 19, sha = 1 << 29;
+#if defined _MSC_VER
+        int info[4];
+        __cpuid(info, 0);
+        if (info[0] < 7)
+            return false;
+
+        __cpuid(info, 1);
+        if ((info[2] & (ssse3 | sse41)) != (ssse3 | sse41))
+            return false;
+
+        __cpuidex(info, 7, 0);
+        return (info[1] & sha) != 0;
+#else
+        unsigned eax, ebx, ecx, edx;
+        if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || (ecx & (ssse3 | sse41)) != unsigned(ssse3 | sse41))
+            return false;
+
+        return __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx & sha) != 0;
+#endif
+    }
+#endif
 
-        auto calc = [&](int t, std::uint32_t f, std::uint32_t K)
-        {
-            auto temp = rol32(A, 5) + f + E + W[t] + K;
-            E = D;
-            D = C;
-            C = rol32(B, 30);
-            B = A;
-            A = temp;
-        };
-
-        auto t = 0;
-        for (; t != 20; ++t) calc(t, f1(), 0x5A827999u);
-        for (; t != 40; ++t) calc(t, f2(), 0x6ED9EBA1u);
-        for (; t != 60; ++t) calc(t, f3(), 0x8F1BBCDCu);
-        for (; t != 80; ++t) calc(t, f4(), 0xCA62C1D6u);
-
-        m_hash[0] += A;
-        m_hash[1] += B;
-        m_hash[2] += C;
-        m_hash[3] += D;
-        m_hash[4] += E;
+    static kernel_fn selectKernel()
+    {
+#if defined WEBSOCKET_HAS_SHA_NI
+        if (cpuHasShaNi())
+            return processBlocksShaNi;
+#endif
+        return processBlocksPortable;
+    }
 
-        m_blockPos = 0;
+private:
+    static kernel_fn defaultKernel()
+    {
+        static const auto kernel = selectKernel();
+        return kernel;
     }
 
     void finalize()
@@ -130,12 +273,14 @@ private:
         if (m_blockPos > messageBitsIdx)
         {
             clearBlockTo(BLOCK_SIZE);
-            processBlock();
+            m_kernel(m_hash.data(), m_block.data(), 1);
+            m_blockPos = 0;
         }
 
         clearBlockTo(messageBitsIdx);
         writeUInt64BE(&m_block[messageBitsIdx], m_totalBits);
-        processBlock();
+        m_kernel(m_hash.data(), m_block.data(), 1);
+        m_blockPos = 0;
     }
 
     void clearBlockTo(int toIndex)
@@ -144,7 +289,7 @@ private:
             m_block[m_blockPos++] = 0;
     }
 
-    static std::uint32_t readUInt32BE(std::uint8_t* buf)
+    static std::uint32_t readUInt32BE(const std::uint8_t* buf)
     {
         return
             buf[0] << 24 |
@@ -169,6 +314,7 @@ private:
 
     static std::uint32_t rol32(std::uint32_t value, int n) { return (value << n) | (value >> (32 - n)); }
 
+    kernel_fn m_kernel;
     std::array<uint32_t, DIGEST_SIZE / 4> m_hash;
     std::array<std::uint8_t, BLOCK_SIZE> m_block;
     uint64_t m_totalBits;
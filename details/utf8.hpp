@@ -0,0 +1,315 @@
+// UTF-8 validation
+// http://www.ietf.org/rfc/rfc3629.txt
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#if (defined __GNUC__ && (defined __x86_64__ || defined __i386__)) || (defined _MSC_VER && (defined _M_X64 || defined _M_IX86))
+#define WEBSOCKET_HAS_SSSE3 1
+#include <tmmintrin.h>
+#if defined _MSC_VER
+#include <intrin.h>
+#define WEBSOCKET_TARGET_SSSE3
+#else
+#define WEBSOCKET_TARGET_SSSE3 __attribute__((target("ssse3")))
+#endif
+#endif
+
+namespace websocket { namespace details
+{
+    // A block kernel validates as much of [p, end) as it can, starting at a character boundary.
+    // Returns where the scalar validator must continue (the start of a character cut by the last block),
+    // or nullptr if the text is not valid UTF-8.
+    using utf8_kernel_fn = const std::uint8_t*(*)(const std::uint8_t* p, const std::uint8_t* end);
+
+    // skips ASCII 8 bytes at a time
+    inline const std::uint8_t* skipAsciiWordwise(const std::uint8_t* p, const std::uint8_t* end)
+    {
+        for (; end - p >= 8; p += 8)
+        {
+            std::uint64_t word;
+            std::memcpy(&word, p, 8);
+            if (word & 0x8080808080808080u)
+                break;
+        }
+
+        return p;
+    }
+
+#if defined WEBSOCKET_HAS_SSSE3
+    namespace utf8_impl
+    {
+        // Lookup tables of the "Validating UTF-8 In Less Than One Instruction Per Byte" algorithm
+        // (John Keiser, Daniel Lemire). Each bit is a kind of error; a byte pair is invalid
+        // if a bit is set in all three lookups for its first byte high/low nibble and second byte high nibble.
+        const std::uint8_t TooShort = 1 << 0;     // lead byte followed by a lead byte or ASCII
+        const std::uint8_t TooLong = 1 << 1;      // ASCII followed by a continuation byte
+        const std::uint8_t Overlong3 = 1 << 2;    // E0 80..9F
+        const std::uint8_t TooLarge = 1 << 3;     // F4 90..BF, F5..FF
+        const std::uint8_t Surrogate = 1 << 4;    // ED A0..BF
+        const std::uint8_t Overlong2 = 1 << 5;    // C0..C1
+        const std::uint8_t TooLarge1000 = 1 << 6; // F5..FF 80..8F
+        const std::uint8_t Overlong4 = 1 << 6;    // F0 80..8F
+        const std::uint8_t TwoConts = 1 << 7;     // two continuation bytes
+        const std::uint8_t Carry = TooShort | TooLong | TwoConts;
+
+        WEBSOCKET_TARGET_SSSE3
+        inline __m128i table(std::uint8_t b0, std::uint8_t b1, std::uint8_t b2, std::uint8_t b3,
+            std::uint8_t b4, std::uint8_t b5, std::uint8_t b6, std::uint8_t b7,
+            std::uint8_t b8, std::uint8_t b9, std::uint8_t b10, std::uint8_t b11,
+            std::uint8_t b12, std::uint8_t b13, std::uint8_t b14, std::uint8_t b15)
+        {
+            return _mm_setr_epi8(char(b0), char(b1), char(b2), char(b3), char(b4), char(b5), char(b6), char(b7),
+                char(b8), char(b9), char(b10), char(b11), char(b12), char(b13), char(b14), char(b15));
+        }
+
+        WEBSOCKET_TARGET_SSSE3
+        inline __m128i highNibbles(__m128i v)
+        {
+            return _mm_and_si128(_mm_srli_epi16(v, 4), _mm_set1_epi8(0x0F));
+        }
+
+        struct Tables
+        {
+            __m128i byte1High;
+            __m128i byte1Low;
+            __m128i byte2High;
+        };
+
+        WEBSOCKET_TARGET_SSSE3
+        inline Tables makeTables()
+        {
+            Tables t;
+
+            t.byte1High = table(
+                TooLong, TooLong, TooLong, TooLong, TooLong, TooLong, TooLong, TooLong, // 0_______
+                TwoConts, TwoConts, TwoConts, TwoConts,                                 // 10______
+                TooShort | Overlong2,                                                   // 1100____
+                TooShort,                                                               // 1101____
+                TooShort | Overlong3 | Surrogate,                                       // 1110____
+                TooShort | TooLarge | TooLarge1000 | Overlong4);                        // 1111____
+
+            t.byte1Low = table(
+                Carry | Overlong3 | Overlong2 | Overlong4,           // ____0000
+                Carry | Overlong2,                                   // ____0001
+                Carry,                                               // ____0010
+                Carry,                                               // ____0011
+                Carry | TooLarge,                                    // ____0100
+                Carry | TooLarge | TooLarge1000,                     // ____0101
+                Carry | TooLarge | TooLarge1000,                     // ____0110
+                Carry | TooLarge | TooLarge1000,                     // ____0111
+                Carry | TooLarge | TooLarge1000,                     // ____1000
+                Carry | TooLarge | TooLarge1000,                     // ____1001
+                Carry | TooLarge | TooLarge1000,                     // ____1010
+                Carry | TooLarge | TooLarge1000,                     // ____1011
+                Carry | TooLarge | TooLarge1000,                     // ____1100
+                Carry | TooLarge | TooLarge1000 | Surrogate,         // ____1101
+                Carry | TooLarge | TooLarge1000,                     // ____1110
+                Carry | TooLarge | TooLarge1000);                    // ____1111
+
+            t.byte2High = table(
+                TooShort, TooShort, TooShort, TooShort, TooShort, TooShort, TooShort, TooShort,           // 0_______
+                TooLong | Overlong2 | TwoConts | Overlong3 | TooLarge1000 | Overlong4,                    // 1000____
+                TooLong | Overlong2 | TwoConts | Overlong3 | TooLarge,                                    // 1001____
+                TooLong | Overlong2 | TwoConts | Surrogate | TooLarge,                                    // 1010____
+                TooLong | Overlong2 | TwoConts | Surrogate | TooLarge,                                    // 1011____
+                TooShort, TooShort, TooShort, TooShort);                                                  // 11______
+
+            return t;
+        }
+
+        WEBSOCKET_TARGET_SSSE3
+        inline __m128i checkBlock(__m128i input, __m128i prevInput, const Tables& t)
+        {
+            auto prev1 = _mm_alignr_epi8(input, prevInput, 15);
+            auto byte1High = _mm_shuffle_epi8(t.byte1High, highNibbles(prev1));
+            auto byte1Low = _mm_shuffle_epi8(t.byte1Low, _mm_and_si128(prev1, _mm_set1_epi8(0x0F)));
+            auto byte2High = _mm_shuffle_epi8(t.byte2High, highNibbles(input));
+            auto special = _mm_and_si128(_mm_and_si128(byte1High, byte1Low), byte2High);
+
+            // third and fourth bytes of 3- and 4-byte sequences must be continuation bytes
+            auto prev2 = _mm_alignr_epi8(input, prevInput, 14);
+            auto prev3 = _mm_alignr_epi8(input, prevInput, 13);
+            auto isThirdByte = _mm_subs_epu8(prev2, _mm_set1_epi8(char(0xE0 - 0x80)));
+            auto isFourthByte = _mm_subs_epu8(prev3, _mm_set1_epi8(char(0xF0 - 0x80)));
+            auto must23 = _mm_and_si128(_mm_or_si128(isThirdByte, isFourthByte), _mm_set1_epi8(char(0x80)));
+
+            return _mm_xor_si128(must23, special);
+        }
+    }
+
+    WEBSOCKET_TARGET_SSSE3
+    inline const std::uint8_t* validateUtf8Ssse3(const std::uint8_t* p, const std::uint8_t* end)
+    {
+        if (end - p < 16)
+            return p;
+
+        // a block ending with these bytes has an incomplete character
+        const auto maxValue = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+            char(0xF0 - 1), char(0xE0 - 1), char(0xC0 - 1));
+
+        const auto tables = utf8_impl::makeTables();
+        auto prevInput = _mm_setzero_si128();
+        auto prevIncomplete = _mm_setzero_si128();
+        auto error = _mm_setzero_si128();
+
+        for (; end - p >= 16; p += 16)
+        {
+            auto input = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+            if (_mm_movemask_epi8(input) == 0)
+            {
+                // ASCII fast path
+                error = _mm_or_si128(error, prevIncomplete);
+                prevIncomplete = _mm_setzero_si128();
+            }
+            else
+            {
+                error = _mm_or_si128(error, utf8_impl::checkBlock(input, prevInput, tables));
+                prevIncomplete = _mm_subs_epu8(input, maxValue);
+            }
+
+            prevInput = input;
+        }
+
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(error, _mm_setzero_si128())) != 0xFFFF)
+            return nullptr;
+
+        // let the scalar validator finish a character cut by the last block
+        for (auto i = 1; i <= 3; ++i)
+        {
+            auto c = p[-i];
+            if (c < 0x80)
+                break;
+
+            if (c >= 0xC0)
+            {
+                auto charLen = c >= 0xF0 ? 4 : c >= 0xE0 ? 3 : 2;
+                return charLen > i ? p - i : p;
+            }
+        }
+
+        return p;
+    }
+
+    inline bool cpuHasSsse3()
+    {
+#if defined _MSC_VER
+        int info[4];
+        __cpuid(info, 1);
+        return (info[2] & (1 << 9)) != 0;
+#else
+        return __builtin_cpu_supports("ssse3") != 0;
+#endif
+    }
+#endif
+
+    inline utf8_kernel_fn selectUtf8Kernel()
+    {
+#if defined WEBSOCKET_HAS_SSSE3
+        if (cpuHasSsse3())
+            return validateUtf8Ssse3;
+#endif
+        return skipAsciiWordwise;
+    }
+
+    // Incremental UTF-8 validator: a text can be fed in arbitrary pieces
+    class Utf8Validator
+    {
+    public:
+        Utf8Validator()
+        {
+            static const auto kernel = selectUtf8Kernel();
+            m_kernel = kernel;
+        }
+
+        explicit Utf8Validator(utf8_kernel_fn kernel)
+            : m_kernel{kernel}
+        {}
+
+        // returns false as soon as the text can't be valid UTF-8
+        bool validate(const void* data, std::size_t size)
+        {
+            auto p = static_cast<const std::uint8_t*>(data);
+            auto end = p + size;
+
+            while (p != end)
+            {
+                if (m_needed == 0)
+                {
+                    p = m_kernel(p, end);
+                    if (!p)
+                        return false;
+
+                    if (p == end)
+                        break;
+                }
+
+                if (!step(*p++))
+                    return false;
+            }
+
+            return true;
+        }
+
+        // true if the text doesn't end in the middle of a character
+        bool isComplete() const { return m_needed == 0; }
+
+        void reset() { m_needed = 0; }
+
+    private:
+        // see RFC 3629, 4. Syntax of UTF-8 Byte Sequences
+        bool step(std::uint8_t c)
+        {
+            if (m_needed == 0)
+            {
+                m_lower = 0x80;
+                m_upper = 0xBF;
+
+                if (c < 0x80)
+                    return true;
+
+                if (c < 0xC2)
+                    return false;
+
+                if (c < 0xE0)
+                {
+                    m_needed = 1;
+                }
+                else if (c < 0xF0)
+                {
+                    m_needed = 2;
+                    if (c == 0xE0) m_lower = 0xA0; // overlong
+                    if (c == 0xED) m_upper = 0x9F; // surrogates
+                }
+                else if (c < 0xF5)
+                {
+                    m_needed = 3;
+                    if (c == 0xF0) m_lower = 0x90; // overlong
+                    if (c == 0xF4) m_upper = 0x8F; // above U+10FFFF
+                }
+                else
+                {
+                    return false;
+                }
+
+                return true;
+            }
+
+            if (c < m_lower || c > m_upper)
+                return false;
+
+            --m_needed;
+            m_lower = 0x80;
+            m_upper = 0xBF;
+            return true;
+        }
+
+        utf8_kernel_fn m_kernel;
+        int m_needed{0};
+        std::uint8_t m_lower{0x80};
+        std::uint8_t m_upper{0xBF};
+    };
+}}
@@ -3,12 +3,266 @@
 
 #pragma once
 
+#include <chrono>
+#include <cstddef>
 #include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
 
 namespace websocket
 {
-    using ConnectionId = std::uint32_t;
-    // 1.36 years at 100 new connections per second
+    // see details::ConnectionIdLayout; never 0
+    using ConnectionId = std::uint64_t;
 
-    enum class Event { NewConnection, Message, Disconnect };
+    // 0 is the default route "/", ServerOptions::routes[i] is i + 1
+    using RouteId = std::uint32_t;
+
+    enum class Event
+    {
+        NewConnection,
+        Message,
+        Disconnect,
+        MessageFragment,
+        HighWatermark, // the send queue has grown to ServerOptions::sendQueueHighWatermark bytes
+        LowWatermark,  // ... and then drained to ServerOptions::sendQueueLowWatermark bytes
+    };
+
+    struct ServerEvent
+    {
+        Event event;
+        ConnectionId connId;
+        // the query string of the request for Event::NewConnection;
+        // for Event::Disconnect the payload of the client's Close frame, if any:
+        // 2-byte status code in network byte order and the UTF-8 reason
+        std::string message;
+        RouteId route{0};
+    };
+
+    struct OutgoingMessage
+    {
+        ConnectionId connId;
+        std::string message;
+        bool isBinary{false};
+    };
+
+    // non-owning view of a message, valid only during a handler call
+    class MessageView
+    {
+    public:
+        MessageView(const char* data, std::size_t size)
+            : m_data{data}
+            , m_size{size}
+        {}
+
+        const char* data() const { return m_data; }
+        std::size_t size() const { return m_size; }
+        bool empty() const { return m_size == 0; }
+        const char* begin() const { return m_data; }
+        const char* end() const { return m_data + m_size; }
+        std::string str() const { return{m_data, m_size}; }
+
+    private:
+        const char* m_data;
+        std::size_t m_size;
+    };
+
+    // Produces a streamed message part by part on the server thread: appends the next part to `chunk`
+    // and returns false after the last one. It is called again as soon as the connection's send queue
+    // holds less than ServerOptions::sendBatchBytes, so memory use stays bounded whatever the message size.
+    using MessageProducer = std::function<bool(std::string& chunk)>;
+
+    // see RFC 6455, 7.4.1 Defined Status Codes
+    enum class CloseCode : std::uint16_t
+    {
+        Normal = 1000,
+        GoingAway = 1001,
+        ProtocolError = 1002,
+        UnsupportedData = 1003,
+        InvalidPayload = 1007,
+        PolicyViolation = 1008,
+        MessageTooBig = 1009,
+        InternalError = 1011,
+    };
+
+    // Server operations available to handlers. Connections of the calling server thread are served inline,
+    // the others through their threads' queues.
+    class LoopContext
+    {
+    public:
+        virtual void sendText(ConnectionId connId, std::string message) = 0;
+        virtual void sendBinary(ConnectionId connId, std::string message) = 0;
+        virtual void broadcastText(std::string message) = 0;
+        virtual void broadcastBinary(std::string message) = 0;
+
+        // each part goes out as a fragment; messages sent meanwhile follow the whole stream
+        virtual void sendStream(ConnectionId connId, MessageProducer producer, bool isBinary) = 0;
+
+        // see Server::sendFile()
+        virtual void sendFile(ConnectionId connId, int fd, std::uint64_t offset, std::uint64_t length) = 0;
+
+        virtual void drop(ConnectionId connId) = 0;
+
+        // close handshake: send the queued messages and a Close frame, wait for the client's Close
+        virtual void drop(ConnectionId connId, CloseCode code, std::string reason) = 0;
+
+        // 0 for connections of other server threads
+        virtual std::size_t queuedBytes(ConnectionId connId) = 0;
+
+    protected:
+        ~LoopContext() {}
+    };
+
+    // Handlers called on a server thread instead of queueing events for poll().
+    // With several server threads they are called concurrently. Empty handlers are skipped.
+    struct Handlers
+    {
+        std::function<void(LoopContext&, ConnectionId)> onOpen;
+
+        // isFinal is false only for fragments streamed with ServerOptions::streamFragments
+        std::function<void(LoopContext&, ConnectionId, MessageView message, bool isFinal)> onMessage;
+
+        std::function<void(LoopContext&, ConnectionId)> onClose;
+
+        // Event::HighWatermark and Event::LowWatermark
+        std::function<void(LoopContext&, ConnectionId, Event)> onEvent;
+    };
+
+    // what to do when a message doesn't fit the send queue limits
+    enum class OverflowPolicy
+    {
+        DropNewest, // discard the new message
+        DropOldest, // discard the oldest messages that aren't being written yet; compressed ones are kept, the new one is discarded if that isn't enough
+        Disconnect, // drop the slow connection
+    };
+
+    // permessage-deflate extension (RFC 7692)
+    struct DeflateOptions
+    {
+        bool enabled{false};
+
+        // reset the compression context after each message:
+        // saves the window memory between messages at the cost of compression ratio
+        bool serverNoContextTakeover{false};
+        bool clientNoContextTakeover{false};
+
+        // LZ77 window size is 2^bits bytes, 9..15 for the server and 8..15 for the client
+        int serverMaxWindowBits{15};
+        int clientMaxWindowBits{15};
+
+        // zlib compression level (0..9) and memory level (1..9)
+        int compressionLevel{6};
+        int memLevel{8};
+
+        // messages shorter than this are sent uncompressed
+        std::size_t minCompressSize{64};
+    };
+
+    // tuning of the listening and the accepted sockets; the options marked Linux are ignored elsewhere
+    struct TcpOptions
+    {
+        // pending connections in the kernel queue of each listening socket, 0 - SOMAXCONN
+        int backlog{0};
+
+        // TCP_NODELAY: send small messages at once instead of waiting for the ACK of the previous ones (Nagle)
+        bool noDelay{true};
+
+        // TCP_CORK while a connection has queued frames, so headers, payloads and files leave in full segments;
+        // the rest is flushed as soon as the queue is empty (Linux)
+        bool cork{false};
+
+        // SO_RCVBUF and SO_SNDBUF of the connections in bytes, 0 - system default
+        int receiveBufferSize{0};
+        int sendBufferSize{0};
+
+        // TCP_DEFER_ACCEPT: accept a connection only when its request arrives, at most this many seconds later (Linux)
+        int deferAcceptSeconds{0};
+
+        // TCP_FASTOPEN: the request may come with the SYN; the length of the queue of such connections, 0 - off
+        int fastOpenQueue{0};
+
+        // connections accepted at once when the listening socket becomes readable
+        std::size_t acceptBatch{16};
+    };
+
+    // an endpoint served by the server
+    struct Route
+    {
+        // "/chat" serves "/chat?query"; with matchPrefix also "/chat/..." unless a longer route matches
+        std::string path;
+        bool matchPrefix{false};
+
+        std::size_t maxMessageSize{1024 * 1024};
+        DeflateOptions deflate;
+
+        // connections of all server threads, 0 - no limit; more clients get 503 Service Unavailable
+        std::size_t maxConnections{0};
+
+        // called on the server threads for the connections of this route if any is set,
+        // their events go to the event queue otherwise
+        Handlers handlers;
+    };
+
+    struct ServerOptions
+    {
+        // number of server threads, 0 - one per core;
+        // each thread accepts (SO_REUSEPORT) and serves its own connections
+        unsigned threads{1};
+
+        // events waiting for Server::poll(); server threads wait while the queue is full
+        std::size_t eventQueueSize{64 * 1024};
+
+        // a client must complete the opening handshake within this time
+        std::chrono::milliseconds handshakeTimeout{10000};
+
+        // per server thread; more clients wait in the listen backlog
+        std::size_t maxPendingHandshakes{1024};
+
+        // ping a client after this long without data from it, 0 - never; pings from clients are always answered
+        std::chrono::milliseconds pingInterval{0};
+
+        // drop a client after this long without data from it, 0 - never
+        std::chrono::milliseconds idleTimeout{0};
+
+        // after the server sends a Close frame (Server::drop() with a status code, Server::stop()),
+        // wait this long for the send queue to drain and the client's Close, then drop the client
+        std::chrono::milliseconds closeTimeout{5000};
+
+        // resolution of pingInterval, idleTimeout and closeTimeout
+        std::chrono::milliseconds timerTick{1000};
+
+        // sends, broadcasts and drops waiting for each server thread; more of them are kept in a slower locked list
+        std::size_t commandQueueSize{16 * 1024};
+
+        // client messages longer than this are rejected and the connection is dropped
+        std::size_t maxMessageSize{1024 * 1024};
+
+        // deliver each fragment of a fragmented message as it arrives:
+        // every fragment but the last one comes as Event::MessageFragment, the last one as Event::Message;
+        // maxMessageSize then limits a single fragment rather than the whole message
+        bool streamFragments{false};
+
+        // check that text messages are valid UTF-8, fail the connection with CloseCode::InvalidPayload otherwise
+        bool validateUtf8{true};
+
+        DeflateOptions deflate;
+
+        TcpOptions tcp;
+
+        // endpoints besides "/", which uses maxMessageSize, deflate and the handlers passed to Server::start()
+        std::vector<Route> routes;
+
+        // queued frames are gathered into one write of at most this many bytes and frames;
+        // a frame longer than sendBatchBytes is written alone
+        std::size_t sendBatchBytes{64 * 1024};
+        std::size_t sendBatchFrames{64};
+
+        // limits of a connection send queue; control frames and a message sent to an empty queue always fit
+        std::size_t sendQueueMaxBytes{16 * 1024 * 1024};
+        std::size_t sendQueueMaxFrames{64 * 1024};
+        OverflowPolicy overflowPolicy{OverflowPolicy::Disconnect};
+
+        std::size_t sendQueueHighWatermark{1024 * 1024};
+        std::size_t sendQueueLowWatermark{256 * 1024};
+    };
 }
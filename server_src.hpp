@@ -5,27 +5,63 @@
 
 #include "Server.hpp"
 
+#include <algorithm>
+#include <atomic>
+#include <future>
 #include <memory>
 #include <mutex>
 #include <thread>
 #include <tuple>
 #include <ostream>
+#include <vector>
 #include <boost/asio.hpp>
 
-#include "details/Acceptor.hpp"
-#include "details/ServerLogic.hpp"
+#include "details/BoundedQueue.hpp"
+#include "details/EventNotifier.hpp"
+#include "details/Shard.hpp"
 
 namespace websocket
 {
-    class Server::Impl
+    class Server::Impl : public details::ShardRouter
     {
     public:
-        template<typename Callback>
-        Impl(boost::asio::ip::tcp::endpoint endpoint, std::ostream& log, Callback&& callback)
-            : m_logic{log, std::forward<Callback>(callback)}
-            , m_acceptor{m_ioService, endpoint, m_logic}
+        Impl(boost::asio::ip::tcp::endpoint endpoint, std::ostream& log, const ServerOptions& options, Handlers handlers)
+            : m_events{options.eventQueueSize}
+            , m_handlers(std::move(handlers))
+            , m_routes{options, isInLoop(m_handlers) ? &m_handlers : nullptr}
         {
-            m_workerThread.reset(new std::thread{[this]{ workerThread(); }});
+            auto&& callback = [this](Event event, ConnectionId connId, std::string message, RouteId route)
+            {
+                ServerEvent e{event, connId, std::move(message), route};
+
+                // wait for the consumer, unless it has stopped the server
+                while (!m_events.tryPush(e))
+                {
+                    if (m_isStopped)
+                        return;
+
+                    std::this_thread::yield();
+                }
+
+                m_notifier.notify();
+            };
+
+            auto threads = options.threads != 0 ? options.threads : std::max(1u, std::thread::hardware_concurrency());
+#if !defined SO_REUSEPORT
+            threads = 1; // no way to share the port between acceptors
+#endif
+            m_idLayout.shardBits = details::ConnectionIdLayout::bitsFor(threads);
+
+            for (unsigned i = 0; i != threads; ++i)
+            {
+                details::ConnectionIdLayout idLayout{i, m_idLayout.shardBits};
+                m_shards.push_back(std::make_unique<details::Shard>(endpoint, log, options, m_routes, callback,
+                    *this, idLayout, threads > 1));
+            }
+
+            // handlers of one shard can reach the others, so all of them must exist first
+            for (auto&& shard : m_shards)
+                shard->start();
         }
 
         ~Impl()
@@ -36,105 +72,289 @@ namespace websocket
 
         void stop()
         {
-            enqueue([this]
+            m_isStopped = true;
+
+            for (auto&& shard : m_shards)
+                shard->stop();
+
+            for (auto&& shard : m_shards)
+                shard->join();
+        }
+
+        void send(ConnectionId connId, std::string message, bool isBinary) override
+        {
+            if (auto shard = findShard(connId))
             {
-                m_isStopped = true;
-                m_acceptor.stop();
-                m_logic.stop();
-            });
+                details::Command command;
+                command.connId = connId;
+                command.isBinary = isBinary;
+                command.message = std::move(message);
+                shard->submit(std::move(command));
+            }
+        }
 
-            m_workerThread->join();
+        void sendStream(ConnectionId connId, MessageProducer producer, bool isBinary) override
+        {
+            if (auto shard = findShard(connId))
+            {
+                details::Command command;
+                command.type = details::Command::Type::Stream;
+                command.connId = connId;
+                command.isBinary = isBinary;
+                command.producer = std::move(producer);
+                shard->submit(std::move(command));
+            }
+        }
+
+        void sendFile(ConnectionId connId, int fd, std::uint64_t offset, std::uint64_t length)
+        {
+            // the descriptor is duplicated here, errors go to the caller
+            auto file = std::make_shared<const details::FilePayload>(fd, offset, length);
+            sendFrame(connId, std::make_shared<const details::ServerFrame>(details::Opcode::Binary, std::move(file)));
         }
 
-        void send(ConnectionId connId, std::string message, bool isBinary)
+        void sendFrame(ConnectionId connId, const details::frame_ptr& frame) override
         {
-            enqueue([=]
+            if (auto shard = findShard(connId))
             {
-                if (auto conn = m_logic.find(connId))
-                {
-                    auto op = isBinary ? details::Opcode::Binary : details::Opcode::Text;
-                    conn->sendFrame(op, message);
-                }
-            });
+                details::Command command;
+                command.type = details::Command::Type::Broadcast;
+                command.frame = frame;
+                command.connIds.push_back(connId);
+                shard->submit(std::move(command));
+            }
         }
 
-        void drop(ConnectionId connId)
+        void sendMany(std::vector<OutgoingMessage>& messages)
         {
-            enqueue([=]
+            std::vector<bool> isTouched(m_shards.size());
+            for (auto&& m : messages)
             {
-                if (auto conn = m_logic.find(connId))
-                    m_logic.drop(*conn);
-            });
+                auto index = m_idLayout.shardOf(m.connId);
+                if (index >= m_shards.size())
+                    continue;
+
+                details::Command command;
+                command.connId = m.connId;
+                command.isBinary = m.isBinary;
+                command.message = std::move(m.message);
+                m_shards[index]->push(command);
+                isTouched[index] = true;
+            }
+
+            for (std::size_t i = 0; i != m_shards.size(); ++i)
+            {
+                if (isTouched[i])
+                    m_shards[i]->wakeUp();
+            }
         }
 
-    private:
-        void workerThread()
+        void broadcast(std::string message, bool isBinary)
         {
-            while (!m_isStopped)
+            broadcast(makeFrame(std::move(message), isBinary), nullptr);
+        }
+
+        void broadcast(const details::frame_ptr& frame, const details::Shard* except) override
+        {
+            for (auto&& shard : m_shards)
             {
-                try
-                {
-                    m_ioService.run();
-                    assert(m_isStopped);
-                }
-                catch (std::exception& e)
+                if (shard.get() == except)
+                    continue;
+
+                details::Command command;
+                command.type = details::Command::Type::Broadcast;
+                command.frame = frame;
+                shard->submit(std::move(command));
+            }
+        }
+
+        void broadcast(std::vector<ConnectionId> connIds, std::string message, bool isBinary)
+        {
+            // one command per shard with its own connections
+            std::vector<std::vector<ConnectionId>> shardConnIds(m_shards.size());
+            if (m_shards.size() == 1)
+            {
+                shardConnIds[0] = std::move(connIds);
+            }
+            else
+            {
+                for (auto connId : connIds)
                 {
-                    m_logic.log("ERROR: ", e.what());
+                    auto index = m_idLayout.shardOf(connId);
+                    if (index < m_shards.size())
+                        shardConnIds[index].push_back(connId);
                 }
             }
+
+            auto frame = makeFrame(std::move(message), isBinary);
+            for (std::size_t i = 0; i != m_shards.size(); ++i)
+            {
+                if (shardConnIds[i].empty())
+                    continue;
+
+                details::Command command;
+                command.type = details::Command::Type::Broadcast;
+                command.frame = frame;
+                command.connIds = std::move(shardConnIds[i]);
+                m_shards[i]->submit(std::move(command));
+            }
         }
 
+        std::size_t queuedBytes(ConnectionId connId)
+        {
+            std::promise<std::size_t> result;
+            auto future = result.get_future();
+            if (!withShard(connId, [&](details::Shard& shard) { result.set_value(shard.queuedBytes(connId)); }))
+                return 0;
+
+            return future.get();
+        }
+
+        bool poll(Event& event, ConnectionId& connId, std::string& message)
+        {
+            ServerEvent e;
+            if (!m_events.tryPop(e))
+            {
+                m_notifier.arm();
+                if (!m_events.tryPop(e))
+                    return false;
+            }
+
+            event = e.event;
+            connId = e.connId;
+            message = std::move(e.message);
+            return true;
+        }
+
+        std::size_t pollBatch(std::vector<ServerEvent>& events, std::size_t maxEvents)
+        {
+            auto&& consume = [&](ServerEvent&& e) { events.push_back(std::move(e)); };
+            auto count = m_events.popBatch(maxEvents, consume);
+            if (count == 0 && maxEvents != 0)
+            {
+                m_notifier.arm();
+                count = m_events.popBatch(maxEvents, consume);
+            }
+
+            return count;
+        }
+
+        bool wait(std::chrono::milliseconds timeout)
+        {
+            m_notifier.arm();
+            return !m_events.isEmpty() || m_notifier.wait(timeout);
+        }
+
+        int eventFd() const { return m_notifier.fd(); }
+
+        void drop(ConnectionId connId) override
+        {
+            if (auto shard = findShard(connId))
+            {
+                details::Command command;
+                command.type = details::Command::Type::Drop;
+                command.connId = connId;
+                shard->submit(std::move(command));
+            }
+        }
+
+        void drop(ConnectionId connId, CloseCode code, std::string reason) override
+        {
+            if (auto shard = findShard(connId))
+            {
+                details::Command command;
+                command.type = details::Command::Type::Close;
+                command.connId = connId;
+                command.closeCode = code;
+                command.message = std::move(reason);
+                shard->submit(std::move(command));
+            }
+        }
+
+    private:
+        details::Shard* findShard(ConnectionId connId)
+        {
+            auto index = m_idLayout.shardOf(connId);
+            return index < m_shards.size() ? m_shards[index].get() : nullptr;
+        }
+
+        // run `f` on the thread owning the connection
         template<typename F>
-        void enqueue(F&& f)
+        bool withShard(ConnectionId connId, F&& f)
         {
-            m_ioService.post(std::forward<F>(f));
+            auto index = m_idLayout.shardOf(connId);
+            if (index >= m_shards.size())
+                return false;
+
+            auto&& shard = *m_shards[index];
+            shard.post([&shard, f = std::forward<F>(f)]() mutable { f(shard); });
+            return true;
+        }
+
+        static bool isInLoop(const Handlers& handlers)
+        {
+            return handlers.onOpen || handlers.onMessage || handlers.onClose || handlers.onEvent;
         }
 
-        bool m_isStopped{false};
+        // encoded in the caller's thread; never compressed, so it can go to any connection
+        static details::frame_ptr makeFrame(std::string message, bool isBinary)
+        {
+            auto op = isBinary ? details::Opcode::Binary : details::Opcode::Text;
+            return std::make_shared<const details::ServerFrame>(op, std::move(message));
+        }
 
-        boost::asio::io_service m_ioService;
-        std::unique_ptr<std::thread> m_workerThread;
+        // the queue is declared first: it must outlive the server threads
+        details::BoundedQueue<ServerEvent> m_events;
+        details::EventNotifier m_notifier;
+        Handlers m_handlers;
+        details::RouteTable m_routes;
 
-        details::ServerLogic m_logic;
-        details::Acceptor<details::ServerLogic> m_acceptor;
+        std::atomic<bool> m_isStopped{false};
+        details::ConnectionIdLayout m_idLayout;
+        std::vector<std::unique_ptr<details::Shard>> m_shards;
     };
 
     Server::Server() {}
     Server::~Server() {}
-    void Server::start(const std::string& ip, unsigned short port, std::ostream& log)
+    void Server::start(const std::string& ip, unsigned short port, std::ostream& log, const ServerOptions& options)
     {
         assert(!m_impl);
 
-        auto&& callback = [this](Event event, ConnectionId connId, std::string message)
-        {
-            decltype(m_queue) tmpList;
-            tmpList.emplace_back(event, connId, std::move(message));
+        boost::asio::ip::tcp::endpoint endpoint{boost::asio::ip::address_v4::from_string(ip), port};
+        m_impl = std::make_unique<Impl>(endpoint, log, options, Handlers());
+    }
 
-            std::lock_guard<std::mutex> lock{m_mutex};
-            m_queue.splice(end(m_queue), tmpList);
-        };
+    void Server::start(const std::string& ip, unsigned short port, std::ostream& log, Handlers handlers, const ServerOptions& options)
+    {
+        assert(!m_impl);
 
         boost::asio::ip::tcp::endpoint endpoint{boost::asio::ip::address_v4::from_string(ip), port};
-        m_impl = std::make_unique<Impl>(endpoint, log, callback);
+        m_impl = std::make_unique<Impl>(endpoint, log, options, std::move(handlers));
     }
     void Server::stop() { m_impl->stop(); }
     void Server::sendText(ConnectionId connId, std::string message) { m_impl->send(connId, std::move(message), false); }
     void Server::sendBinary(ConnectionId connId, std::string message) { m_impl->send(connId, std::move(message), true); }
+    void Server::broadcastText(std::string message) { m_impl->broadcast(std::move(message), false); }
+    void Server::broadcastText(std::vector<ConnectionId> connIds, std::string message) { m_impl->broadcast(std::move(connIds), std::move(message), false); }
+    void Server::broadcastBinary(std::string message) { m_impl->broadcast(std::move(message), true); }
+    void Server::broadcastBinary(std::vector<ConnectionId> connIds, std::string message) { m_impl->broadcast(std::move(connIds), std::move(message), true); }
+    void Server::sendStream(ConnectionId connId, MessageProducer producer, bool isBinary) { m_impl->sendStream(connId, std::move(producer), isBinary); }
+    void Server::sendFile(ConnectionId connId, int fd, std::uint64_t offset, std::uint64_t length) { m_impl->sendFile(connId, fd, offset, length); }
+    void Server::sendMany(std::vector<OutgoingMessage> messages) { m_impl->sendMany(messages); }
     void Server::drop(ConnectionId connId) { m_impl->drop(connId); }
+    void Server::drop(ConnectionId connId, CloseCode code, std::string reason) { m_impl->drop(connId, code, std::move(reason)); }
+    std::size_t Server::queuedBytes(ConnectionId connId) { return m_impl->queuedBytes(connId); }
 
     bool Server::poll(Event& event, ConnectionId& connId, std::string& message)
     {
-        decltype(m_queue) tmpList;
-
-        {
-            std::lock_guard<std::mutex> lock{m_mutex};
-            if (m_queue.empty())
-                return false;
+        return m_impl && m_impl->poll(event, connId, message);
+    }
 
-            tmpList.splice(begin(tmpList), m_queue, begin(m_queue));
-        }
-        
-        std::tie(event, connId, message) = std::move(tmpList.front());
-        return true;
+    std::size_t Server::pollBatch(std::vector<ServerEvent>& events, std::size_t maxEvents)
+    {
+        return m_impl ? m_impl->pollBatch(events, maxEvents) : 0;
     }
+
+    bool Server::wait(std::chrono::milliseconds timeout) { return m_impl->wait(timeout); }
+    int Server::eventFd() const { return m_impl->eventFd(); }
 }
\ No newline at end of file
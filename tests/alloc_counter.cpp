@@ -0,0 +1,46 @@
+#include "alloc_counter.hpp"
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+namespace
+{
+    std::atomic<bool> isCounting{false};
+    std::atomic<std::size_t> minCountedSize{0};
+    std::atomic<std::size_t> allocCount{0};
+}
+
+void alloc_counter::start(std::size_t minSize)
+{
+    minCountedSize = minSize;
+    allocCount = 0;
+    isCounting = true;
+}
+
+std::size_t alloc_counter::stop()
+{
+    isCounting = false;
+    return allocCount;
+}
+
+void* operator new(std::size_t size)
+{
+    if (isCounting && size >= minCountedSize)
+        ++allocCount;
+
+    if (auto p = std::malloc(size ? size : 1))
+        return p;
+
+    throw std::bad_alloc{};
+}
+
+void operator delete(void* p) noexcept
+{
+    std::free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept
+{
+    std::free(p);
+}
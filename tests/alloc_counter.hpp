@@ -0,0 +1,13 @@
+// Counts heap allocations made by any thread, for tests that check how often data is copied
+#pragma once
+
+#include <cstddef>
+
+namespace alloc_counter
+{
+    // start counting allocations of at least `minSize` bytes
+    void start(std::size_t minSize);
+
+    // stop counting, return the number of allocations since start()
+    std::size_t stop();
+}
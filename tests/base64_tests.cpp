@@ -29,4 +29,12 @@ TEST_CASE("Base64 encoding", "[base64]")
 
     REQUIRE(b64encode("a") == "YQ==");
     REQUIRE(b64encode("ab") == "YWI=");
-}
\ No newline at end of file
+}
+
+TEST_CASE("Base64 encoding to a buffer", "[base64]")
+{
+    char out[8] = "xxxxxxx";
+    REQUIRE(b64encodedSize(5) == 8);
+    REQUIRE(b64encode("abcde", 5, out) == 8);
+    REQUIRE(std::string(out, 8) == "YWJjZGU=");
+}
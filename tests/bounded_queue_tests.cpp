@@ -0,0 +1,113 @@
+// tests for BoundedQueue.hpp
+#include "details/BoundedQueue.hpp"
+
+#include "third_party/catch/catch.hpp"
+
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace ws_details = websocket::details;
+
+TEST_CASE("BoundedQueue push and pop", "[queue]")
+{
+    ws_details::BoundedQueue<std::string> queue{3};
+    REQUIRE(queue.capacity() == 4);
+
+    std::string value;
+    REQUIRE_FALSE(queue.tryPop(value));
+
+    // several rounds over the slots
+    for (auto round = 0; round != 3; ++round)
+    {
+        for (auto i = 0; i != 4; ++i)
+        {
+            std::string s = std::to_string(round * 4 + i);
+            REQUIRE(queue.tryPush(s));
+            REQUIRE(s.empty());
+        }
+
+        std::string extra = "extra";
+        REQUIRE_FALSE(queue.tryPush(extra));
+        REQUIRE(extra == "extra");
+
+        for (auto i = 0; i != 4; ++i)
+        {
+            REQUIRE(queue.tryPop(value));
+            REQUIRE(value == std::to_string(round * 4 + i));
+        }
+
+        REQUIRE_FALSE(queue.tryPop(value));
+    }
+}
+
+TEST_CASE("BoundedQueue pop batch", "[queue]")
+{
+    ws_details::BoundedQueue<int> queue{8};
+    std::vector<int> out;
+    auto&& consume = [&](int&& value) { out.push_back(value); };
+
+    REQUIRE(queue.isEmpty());
+    REQUIRE(queue.popBatch(4, consume) == 0);
+
+    for (auto round = 0; round != 3; ++round)
+    {
+        for (auto i = 0; i != 6; ++i)
+        {
+            auto value = round * 6 + i;
+            REQUIRE(queue.tryPush(value));
+        }
+
+        REQUIRE_FALSE(queue.isEmpty());
+        out.clear();
+        REQUIRE(queue.popBatch(4, consume) == 4);
+        REQUIRE(queue.popBatch(100, consume) == 2);
+        REQUIRE(queue.isEmpty());
+
+        for (auto i = 0; i != 6; ++i)
+            REQUIRE(out[i] == round * 6 + i);
+    }
+}
+
+TEST_CASE("BoundedQueue with several producers", "[queue]")
+{
+    const auto producers = 4;
+    const auto itemsPerProducer = 20000;
+    ws_details::BoundedQueue<std::pair<int, int>> queue{64};
+
+    std::vector<std::thread> threads;
+    for (auto p = 0; p != producers; ++p)
+    {
+        threads.emplace_back([&queue, p]
+        {
+            for (auto i = 0; i != itemsPerProducer; ++i)
+            {
+                std::pair<int, int> item{p, i};
+                while (!queue.tryPush(item))
+                    std::this_thread::yield();
+            }
+        });
+    }
+
+    // items of each producer come in order, none is lost or duplicated
+    std::vector<int> next(producers, 0);
+    for (auto n = 0; n != producers * itemsPerProducer; )
+    {
+        std::pair<int, int> item;
+        if (!queue.tryPop(item))
+        {
+            std::this_thread::yield();
+            continue;
+        }
+
+        REQUIRE(item.second == next[item.first]);
+        ++next[item.first];
+        ++n;
+    }
+
+    for (auto&& t : threads)
+        t.join();
+
+    std::pair<int, int> item;
+    REQUIRE_FALSE(queue.tryPop(item));
+}
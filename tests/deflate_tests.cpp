@@ -0,0 +1,223 @@
+// tests for deflate.hpp
+#include "details/deflate.hpp"
+
+#include "third_party/catch/catch.hpp"
+
+#include <string>
+
+namespace ws_details = websocket::details;
+using Result = ws_details::PerMessageDeflate::Result;
+
+namespace
+{
+    ws_details::DeflateParams negotiate(const std::string& extensions, websocket::DeflateOptions options = {})
+    {
+        options.enabled = true;
+        ws_details::DeflateParams params;
+        ws_details::negotiateDeflate(extensions, options, params);
+        return params;
+    }
+
+    std::string sampleText()
+    {
+        std::string text;
+        for (auto i = 0; i < 1000; ++i)
+            text += "message #" + std::to_string(i % 37) + ", ";
+        return text;
+    }
+}
+
+TEST_CASE("negotiate permessage-deflate", "[deflate]")
+{
+    SECTION("disabled")
+    {
+        ws_details::DeflateParams params;
+        REQUIRE_FALSE(ws_details::negotiateDeflate("permessage-deflate", websocket::DeflateOptions{}, params));
+        REQUIRE_FALSE(params.enabled);
+    }
+
+    SECTION("no offer")
+    {
+        REQUIRE_FALSE(negotiate("").enabled);
+        REQUIRE_FALSE(negotiate("x-webkit-deflate-frame").enabled);
+    }
+
+    SECTION("plain offer")
+    {
+        auto params = negotiate("permessage-deflate");
+        REQUIRE(params.enabled);
+        REQUIRE_FALSE(params.serverNoContextTakeover);
+        REQUIRE_FALSE(params.clientNoContextTakeover);
+        REQUIRE(params.serverMaxWindowBits == 15);
+        REQUIRE(params.clientMaxWindowBits == 15);
+        REQUIRE(ws_details::deflateResponse(params) == "permessage-deflate");
+    }
+
+    SECTION("parameters")
+    {
+        auto params = negotiate("permessage-deflate; server_no_context_takeover; client_no_context_takeover;"
+            " server_max_window_bits=10; client_max_window_bits=\"12\"");
+        REQUIRE(params.enabled);
+        REQUIRE(params.serverNoContextTakeover);
+        REQUIRE(params.clientNoContextTakeover);
+        REQUIRE(params.serverMaxWindowBits == 10);
+        REQUIRE(params.clientMaxWindowBits == 12);
+        REQUIRE(ws_details::deflateResponse(params) == "permessage-deflate; server_no_context_takeover;"
+            " client_no_context_takeover; server_max_window_bits=10; client_max_window_bits=12");
+    }
+
+    SECTION("client_max_window_bits is sent only if offered")
+    {
+        websocket::DeflateOptions options;
+        options.clientMaxWindowBits = 11;
+        REQUIRE(negotiate("permessage-deflate", options).clientMaxWindowBits == 15);
+        REQUIRE(negotiate("permessage-deflate; client_max_window_bits", options).clientMaxWindowBits == 11);
+    }
+
+    SECTION("server options")
+    {
+        websocket::DeflateOptions options;
+        options.serverNoContextTakeover = true;
+        options.serverMaxWindowBits = 8;
+        auto params = negotiate("permessage-deflate", options);
+        REQUIRE(params.serverNoContextTakeover);
+        REQUIRE(params.serverMaxWindowBits == 9);
+    }
+
+    SECTION("invalid offer is skipped")
+    {
+        REQUIRE_FALSE(negotiate("permessage-deflate; foo").enabled);
+        REQUIRE_FALSE(negotiate("permessage-deflate; server_max_window_bits=16").enabled);
+        REQUIRE_FALSE(negotiate("permessage-deflate; server_max_window_bits").enabled);
+        REQUIRE_FALSE(negotiate("permessage-deflate; server_no_context_takeover=1").enabled);
+        REQUIRE_FALSE(negotiate("permessage-deflate; server_max_window_bits=8").enabled);
+
+        auto params = negotiate("permessage-deflate; bar, permessage-deflate; client_no_context_takeover");
+        REQUIRE(params.enabled);
+        REQUIRE(params.clientNoContextTakeover);
+    }
+}
+
+TEST_CASE("permessage-deflate compression", "[deflate]")
+{
+    ws_details::DeflateParams params;
+    params.enabled = true;
+    websocket::DeflateOptions options;
+
+    SECTION("RFC 7692 example")
+    {
+        ws_details::PerMessageDeflate deflate{params, options};
+        REQUIRE(deflate.compress("Hello", 5) == std::string("\xf2\x48\xcd\xc9\xc9\x07\x00", 7));
+
+        std::string out;
+        REQUIRE(deflate.decompress("\xf2\x48\xcd\xc9\xc9\x07\x00", 7, true, out, 100) == Result::OK);
+        REQUIRE(out == "Hello");
+
+        // stored block, RFC 7692 7.2.3.3
+        out.clear();
+        REQUIRE(deflate.decompress("\x00\x05\x00\xfa\xff\x48\x65\x6c\x6c\x6f\x00", 11, true, out, 100) == Result::OK);
+        REQUIRE(out == "Hello");
+    }
+
+    SECTION("shared context")
+    {
+        ws_details::PerMessageDeflate deflate{params, options};
+        auto first = deflate.compress("Hello", 5);
+        auto second = deflate.compress("Hello", 5);
+        REQUIRE(second.size() < first.size());
+
+        ws_details::PerMessageDeflate inflate{params, options};
+        std::string out;
+        REQUIRE(inflate.decompress(first.data(), first.size(), true, out, 100) == Result::OK);
+        REQUIRE(inflate.decompress(second.data(), second.size(), true, out, 100) == Result::OK);
+        REQUIRE(out == "HelloHello");
+    }
+
+    SECTION("no context takeover")
+    {
+        params.serverNoContextTakeover = true;
+        ws_details::PerMessageDeflate deflate{params, options};
+        REQUIRE(deflate.compress("Hello", 5) == deflate.compress("Hello", 5));
+    }
+
+    SECTION("roundtrip in fragments")
+    {
+        auto text = sampleText();
+        ws_details::PerMessageDeflate deflate{params, options};
+        auto compressed = deflate.compress(text.data(), text.size());
+        REQUIRE(compressed.size() < text.size() / 4);
+
+        std::string out;
+        auto half = compressed.size() / 2;
+        REQUIRE(deflate.decompress(compressed.data(), half, false, out, text.size()) == Result::OK);
+        REQUIRE(deflate.decompress(compressed.data() + half, compressed.size() - half, true, out, text.size()) == Result::OK);
+        REQUIRE(out == text);
+    }
+
+    SECTION("decompressed size limit")
+    {
+        auto text = sampleText();
+        ws_details::PerMessageDeflate deflate{params, options};
+        auto compressed = deflate.compress(text.data(), text.size());
+
+        std::string out;
+        REQUIRE(deflate.decompress(compressed.data(), compressed.size(), true, out, text.size() - 1) == Result::TooBig);
+    }
+
+    SECTION("invalid data")
+    {
+        ws_details::PerMessageDeflate deflate{params, options};
+        std::string out;
+        REQUIRE(deflate.decompress("\xff\xff\xff\xff", 4, true, out, 100) == Result::Error);
+    }
+
+    SECTION("small messages are not compressed")
+    {
+        ws_details::PerMessageDeflate deflate{params, options};
+        REQUIRE_FALSE(deflate.shouldCompress(0));
+        REQUIRE_FALSE(deflate.shouldCompress(options.minCompressSize - 1));
+        REQUIRE(deflate.shouldCompress(options.minCompressSize));
+    }
+}
+
+TEST_CASE("permessage-deflate compression of 4 GiB", "[deflate][.][huge]")
+{
+    ws_details::DeflateParams params;
+    params.enabled = true;
+    ws_details::PerMessageDeflate deflate{params, websocket::DeflateOptions{}};
+
+    // longer than uInt can hold; needs about 9 GB of memory
+    const std::size_t size = (std::size_t(1) << 32) + 100;
+    std::string compressed;
+    {
+        std::string message(size, '\0');
+        message.back() = 'x';
+        compressed = deflate.compress(message.data(), message.size());
+    }
+
+    z_stream inflate;
+    std::memset(&inflate, 0, sizeof(inflate));
+    REQUIRE(inflateInit2(&inflate, -15) == Z_OK);
+    compressed.append("\x00\x00\xff\xff", 4);
+    inflate.next_in = reinterpret_cast<Bytef*>(&compressed[0]);
+    inflate.avail_in = static_cast<uInt>(compressed.size());
+
+    std::size_t total = 0;
+    char last = 0;
+    static char buf[0x100000];
+    while (inflate.avail_in != 0)
+    {
+        inflate.next_out = reinterpret_cast<Bytef*>(buf);
+        inflate.avail_out = sizeof(buf);
+        auto rc = ::inflate(&inflate, Z_SYNC_FLUSH);
+        REQUIRE((rc == Z_OK || rc == Z_BUF_ERROR));
+        auto n = sizeof(buf) - inflate.avail_out;
+        if (n != 0)
+            last = buf[n - 1];
+        total += n;
+    }
+
+    inflateEnd(&inflate);
+    REQUIRE(total == size);
+    REQUIRE(last == 'x');
+}
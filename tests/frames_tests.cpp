@@ -2,6 +2,11 @@
 
 #include "third_party/catch/catch.hpp"
 
+#if !defined _WIN32
+#include <stdlib.h>
+#include <unistd.h>
+#endif
+
 namespace ws_details = websocket::details;
 
 namespace
@@ -40,23 +45,74 @@ TEST_CASE_METHOD(FrameReceiverFixture, "is frame complete", "[websocket]")
 
 TEST_CASE_METHOD(FrameReceiverFixture, "not final fragment", "[websocket]")
 {
-    REQUIRE(write_n_check_more("\x00") == 0);
+    REQUIRE(write_n_check_more("\x01") > 0);
+    REQUIRE(receiver.isValidFrame(1));
+
+    REQUIRE(write_n_check_more("\x00") > 0);
+    REQUIRE(receiver.isValidFrame(1));
+}
+
+TEST_CASE_METHOD(FrameReceiverFixture, "fragmented control frame", "[websocket]")
+{
+    REQUIRE(write_n_check_more("\x09") == 0);
     REQUIRE_FALSE(receiver.isValidFrame(1));
 }
 
+TEST_CASE_METHOD(FrameReceiverFixture, "long control frame", "[websocket]")
+{
+    REQUIRE(write_n_check_more("\x89\xfe") == 0);
+    REQUIRE_FALSE(receiver.isValidFrame(2));
+}
+
 TEST_CASE_METHOD(FrameReceiverFixture, "not masked", "[websocket]")
 {
     REQUIRE(write_n_check_more("\x81\x01") == 0);
     REQUIRE_FALSE(receiver.isValidFrame(2));
 }
 
+TEST_CASE_METHOD(FrameReceiverFixture, "reserved bits", "[websocket]")
+{
+    REQUIRE(write_n_check_more("\xa1") == 0);
+    REQUIRE_FALSE(receiver.isValidFrame(1));
+
+    REQUIRE(write_n_check_more("\x91") == 0);
+    REQUIRE_FALSE(receiver.isValidFrame(1));
+
+    REQUIRE(write_n_check_more("\xc1") == 0);
+    REQUIRE_FALSE(receiver.isValidFrame(1));
+
+    receiver.enableCompression();
+    REQUIRE(write_n_check_more("\xc1") > 0);
+    REQUIRE(receiver.isValidFrame(1));
+    REQUIRE(receiver.isCompressed());
+
+    REQUIRE(write_n_check_more("\x40") == 0);
+    REQUIRE_FALSE(receiver.isValidFrame(1));
+
+    REQUIRE(write_n_check_more("\xc9") == 0);
+    REQUIRE_FALSE(receiver.isValidFrame(1));
+}
+
+TEST_CASE_METHOD(FrameReceiverFixture, "extended length header is incomplete", "[websocket]")
+{
+    REQUIRE(write_n_check_more("\x81\xfe") == 2 + 4);
+    REQUIRE(write_n_check_more("\x81\xfe\x00") == 1 + 4);
+    REQUIRE(write_n_check_more("\x81\xff" "\x00\x00\x00\x00") == 4 + 4);
+}
+
 TEST_CASE_METHOD(FrameReceiverFixture, "too long", "[websocket]")
 {
-    REQUIRE(write_n_check_more("\x81\xfe") == 0);
-    REQUIRE_FALSE(receiver.isValidFrame(2));
+    ws_details::FrameReceiver smallReceiver{200};
 
-    REQUIRE(write_n_check_more("\x81\xff") == 0);
-    REQUIRE_FALSE(receiver.isValidFrame(2));
+    memcpy(smallReceiver.getBufferTail(), "\x81\xfe\x00\xc8", 4);
+    REQUIRE(smallReceiver.isValidFrame(4));
+
+    memcpy(smallReceiver.getBufferTail(), "\x81\xfe\x00\xc9", 4);
+    REQUIRE(smallReceiver.needReceiveMore(4) == 0);
+    REQUIRE_FALSE(smallReceiver.isValidFrame(4));
+
+    memcpy(smallReceiver.getBufferTail(), "\x81\xff\x80\x00\x00\x00\x00\x00\x00\x00", 10);
+    REQUIRE_FALSE(smallReceiver.isValidFrame(10));
 }
 
 TEST_CASE_METHOD(FrameReceiverFixture, "parse opcode", "[websocket]")
@@ -71,6 +127,105 @@ TEST_CASE_METHOD(FrameReceiverFixture, "parse length", "[websocket]")
     REQUIRE(receiver.payloadLen() == 1);
 }
 
+TEST_CASE_METHOD(FrameReceiverFixture, "parse 16-bit length", "[websocket]")
+{
+    receiver.addBytes(write("\x82\xfe\x01\x02KKKK"));
+    REQUIRE(receiver.payloadLen() == 0x102);
+    REQUIRE(receiver.payloadStart() == 8);
+    REQUIRE(receiver.frameLen() == 8 + 0x102);
+}
+
+TEST_CASE_METHOD(FrameReceiverFixture, "parse 64-bit length", "[websocket]")
+{
+    receiver.addBytes(write("\x82\xff\x00\x00\x00\x00\x00\x01\x02\x03KKKK"));
+    REQUIRE(receiver.payloadLen() == 0x10203);
+    REQUIRE(receiver.payloadStart() == 14);
+    REQUIRE(receiver.frameLen() == 14 + 0x10203);
+}
+
+TEST_CASE("receive buffer grows and shrinks", "[websocket]")
+{
+    ws_details::FrameReceiver receiver{0x10000};
+
+    auto&& receiveFrame = [&](std::size_t payloadLen)
+    {
+        std::string frame{"\x82\xfe"};
+        frame.push_back(char(payloadLen >> 8));
+        frame.push_back(char(payloadLen & 0xFF));
+        frame.append(4, '\0');
+        frame.append(payloadLen, 'x');
+
+        std::size_t sent = 0;
+        while (!receiver.isFrameComplete())
+        {
+            auto n = std::min(receiver.getBufferTailSize(), frame.size() - sent);
+            n = std::min(n, receiver.needReceiveMore(0));
+            memcpy(receiver.getBufferTail(), frame.data() + sent, n);
+            receiver.addBytes(n);
+            sent += n;
+
+            REQUIRE(receiver.isValidFrame());
+            receiver.prepareBuffer();
+        }
+
+        REQUIRE(sent == frame.size());
+        REQUIRE(receiver.message() == std::string(payloadLen, 'x'));
+        receiver.shiftBuffer();
+    };
+
+    const auto initialSize = ws_details::FrameReceiver::InitialBufferSize;
+    REQUIRE(receiver.bufferSize() == initialSize);
+
+    receiveFrame(10000);
+    auto grownSize = receiver.bufferSize();
+    REQUIRE(grownSize >= 10000);
+
+    // a stream of large frames reuses the buffer
+    for (auto i = 0; i != 10; ++i)
+    {
+        receiveFrame(10000);
+        REQUIRE(receiver.bufferSize() == grownSize);
+    }
+
+    for (auto i = 0; i != ws_details::FrameReceiver::ShrinkAfterFrames; ++i)
+        receiveFrame(200);
+
+    REQUIRE(receiver.bufferSize() == initialSize);
+}
+
+TEST_CASE_METHOD(FrameReceiverFixture, "several frames in the buffer", "[websocket]")
+{
+    receiver.addBytes(write("\x81\x81" "\0\0\0\0" "a" "\x82\x82" "\0\0\0\0" "bc" "\x81\x83" "\0\0"));
+
+    REQUIRE(receiver.isFrameComplete());
+    REQUIRE(receiver.opcode() == ws_details::Opcode::Text);
+    REQUIRE(receiver.message() == "a");
+    receiver.shiftBuffer();
+
+    REQUIRE(receiver.isFrameComplete());
+    REQUIRE(receiver.opcode() == ws_details::Opcode::Binary);
+    REQUIRE(receiver.message() == "bc");
+    receiver.shiftBuffer();
+
+    REQUIRE(receiver.isValidFrame());
+    REQUIRE_FALSE(receiver.isFrameComplete());
+    REQUIRE(receiver.needReceiveMore(0) == 2);
+
+    // the incomplete frame is moved to the buffer start only when there is not enough space after it
+    auto tail = receiver.getBufferTail();
+    receiver.prepareBuffer();
+    REQUIRE(receiver.getBufferTail() == tail);
+
+    memcpy(receiver.getBufferTail(), "\0\0" "def", 5);
+    receiver.addBytes(5);
+    REQUIRE(receiver.isFrameComplete());
+    REQUIRE(receiver.message() == "def");
+    receiver.shiftBuffer();
+
+    REQUIRE(receiver.bytesAvailable() == 0);
+    REQUIRE(receiver.getBufferTailSize() == receiver.bufferSize());
+}
+
 TEST_CASE_METHOD(FrameReceiverFixture, "unmask", "[websocket]")
 {
     receiver.addBytes(write("\x81\x85" "\x1\x1\x1\x1" "10325"));
@@ -98,4 +253,55 @@ TEST_CASE("ServerFrame construction", "[websocket]")
 
     test(0x10000, 10, "\x81\x7f\x00\x00\x00\x00\x00\x01\x00\x00");
     test(0x100ff, 10, "\x81\x7f\x00\x00\x00\x00\x00\x01\x00\xff");
+
+    ws_details::ServerFrame compressed{ws_details::Opcode::Binary, "x", true};
+    REQUIRE(std::memcmp(compressed.m_header, "\xc2\x01", 2) == 0);
+}
+
+TEST_CASE("close payload", "[websocket]")
+{
+    REQUIRE(ws_details::closePayload(websocket::CloseCode::GoingAway) == std::string("\x03\xe9"));
+    REQUIRE(ws_details::closePayload(websocket::CloseCode::Normal, "bye") == std::string("\x03\xe8" "bye"));
+
+    // cut to 123 bytes without splitting a character
+    auto reason = std::string(122, 'x') + "\xce\xba";
+    auto payload = ws_details::closePayload(websocket::CloseCode::Normal, reason);
+    REQUIRE(payload.size() == 2 + 122);
+    REQUIRE(payload.substr(2) == std::string(122, 'x'));
+
+    REQUIRE(ws_details::isValidCloseCode(1000));
+    REQUIRE(ws_details::isValidCloseCode(4999));
+    REQUIRE_FALSE(ws_details::isValidCloseCode(1005));
+    REQUIRE_FALSE(ws_details::isValidCloseCode(999));
+    REQUIRE_FALSE(ws_details::isValidCloseCode(2000));
+}
+
+TEST_CASE("ServerFrame fragments", "[websocket]")
+{
+    ws_details::ServerFrame first{ws_details::Opcode::Binary, "ab", false, false};
+    REQUIRE(std::memcmp(first.m_header, "\x02\x02", 2) == 0);
+    REQUIRE_FALSE(first.isFinal());
+
+    ws_details::ServerFrame last{ws_details::Opcode::Continuation, "c"};
+    REQUIRE(std::memcmp(last.m_header, "\x80\x01", 2) == 0);
+    REQUIRE(last.isFinal());
+}
+
+#if !defined _WIN32
+TEST_CASE("ServerFrame with a file payload", "[websocket]")
+{
+    char path[] = "/tmp/websocket-frame-XXXXXX";
+    auto fd = ::mkstemp(path);
+    REQUIRE(fd != -1);
+    ::unlink(path);
+    REQUIRE(::ftruncate(fd, 100 + 0x10000) == 0);
+    auto file = std::make_shared<const ws_details::FilePayload>(fd, 100, 0x10000);
+    ::close(fd);
+
+    ws_details::ServerFrame frame{ws_details::Opcode::Binary, file};
+    REQUIRE(frame.m_headerLen == 10);
+    REQUIRE(std::memcmp(frame.m_header, "\x82\x7f\x00\x00\x00\x00\x00\x01\x00\x00", 10) == 0);
+    REQUIRE(frame.m_data.empty());
+    REQUIRE(frame.size() == 10); // the file isn't held in memory
 }
+#endif
@@ -1,24 +1,21 @@
 #include "details/handshake.hpp"
 
 #include "third_party/catch/catch.hpp"
+#include "alloc_counter.hpp"
+
+#include <chrono>
+#include <iostream>
 
 namespace ws_details = websocket::details;
 
 TEST_CASE("Validate request", "[websocket]")
 {
-    http::Request rq;
+    http::RequestView rq;
     rq.method = http::Method::GET;
-    rq.requestPath = "/";
     rq.httpVersion = http::Version::v1_1;
     rq.secWebSocketVersion = 13;
-    rq.secWebSocketKey = "AA==";
-
-    rq.upgrade.push_back({"websocket", ""});
-
-    rq.connection.push_back("keep-alive");
-    rq.connection.push_back("upgrade");
-
-    rq.secWebSocketVersion = 13;
+    rq.upgradeWebsocket = true;
+    rq.connectionUpgrade = true;
 
     SECTION("ok")
     {
@@ -31,12 +28,6 @@ TEST_CASE("Validate request", "[websocket]")
         REQUIRE(ws_details::validateRequest(rq) == http::Status::MethodNotAllowed);
     }
 
-    SECTION("404")
-    {
-        rq.requestPath = "/foo";
-        REQUIRE(ws_details::validateRequest(rq) == http::Status::NotFound);
-    }
-
     SECTION("not HTTP/1.1")
     {
         rq.httpVersion = http::Version::v1_0;
@@ -51,15 +42,13 @@ TEST_CASE("Validate request", "[websocket]")
 
     SECTION("no `websocket' in upgrade field")
     {
-        rq.upgrade.clear();
-        rq.upgrade.push_back({"foo", ""});
+        rq.upgradeWebsocket = false;
         REQUIRE(ws_details::validateRequest(rq) == http::Status::BadRequest);
     }
 
     SECTION("no `upgrade' in connection field")
     {
-        rq.connection.clear();
-        rq.connection.push_back("keep-alive");
+        rq.connectionUpgrade = false;
         REQUIRE(ws_details::validateRequest(rq) == http::Status::BadRequest);
     }
 }
@@ -69,23 +58,179 @@ TEST_CASE("calc Sec-WebSocket-Accept", "[websocket]")
     REQUIRE(ws_details::calcSecKeyHash("dGhlIHNhbXBsZSBub25jZQ==") == "s3pPLMBiTxaQ9kYGzzhZRbK+xOo=");
 }
 
-TEST_CASE("handshake", "[websocket]")
+TEST_CASE("calc Sec-WebSocket-Accept throughput", "[websocket][.][bench]")
 {
-    std::istringstream request(
+    const std::string key = "dGhlIHNhbXBsZSBub25jZQ==";
+    const auto rounds = 1000000;
+
+    auto start = std::chrono::steady_clock::now();
+    for (auto i = 0; i != rounds; ++i)
+    {
+        char hash[ws_details::SecKeyHashSize];
+        ws_details::calcSecKeyHash(key.data(), key.size(), hash);
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    std::cout << "to a buffer: " << elapsed.count() / rounds * 1e9 << " ns\n";
+
+    start = std::chrono::steady_clock::now();
+    for (auto i = 0; i != rounds; ++i)
+        ws_details::calcSecKeyHash(key);
+    elapsed = std::chrono::steady_clock::now() - start;
+    std::cout << "std::string: " << elapsed.count() / rounds * 1e9 << " ns\n";
+}
+
+TEST_CASE("handshake in place", "[websocket]")
+{
+    std::string request =
         "GET / HTTP/1.1\r\n"
         "Host: localhost\r\n"
         "Upgrade: websocket\r\n"
         "Connection: Upgrade\r\n"
         "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
         "Sec-WebSocket-Version: 13\r\n"
+        "Sec-WebSocket-Extensions: permessage-deflate\r\n"
+        "\r\n";
+
+    ws_details::HandshakeReply reply;
+    ws_details::DeflateParams params;
+
+    alloc_counter::start(1);
+    auto status = ws_details::handshake(request.data(), request.data() + request.size(), reply, websocket::DeflateOptions{}, params);
+    auto allocations = alloc_counter::stop();
+    REQUIRE(allocations == 0);
+
+    REQUIRE(status == http::Status::OK);
+    REQUIRE_FALSE(params.enabled);
+    REQUIRE(std::string(reply.data(), reply.size()) ==
+        "HTTP/1.1 101 Switching Protocols\r\n"
+        "Upgrade: websocket\r\n"
+        "Connection: Upgrade\r\n"
+        "Sec-WebSocket-Accept: s3pPLMBiTxaQ9kYGzzhZRbK+xOo=\r\n"
         "\r\n");
+}
 
-    std::ostringstream reply;
-    REQUIRE(ws_details::handshake(request, reply) == http::Status::OK);
-    REQUIRE(reply.str() ==
+TEST_CASE("handshake in place with permessage-deflate", "[websocket]")
+{
+    std::string request =
+        "GET / HTTP/1.1\r\n"
+        "Upgrade: websocket\r\n"
+        "Connection: Upgrade\r\n"
+        "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+        "Sec-WebSocket-Version: 13\r\n"
+        "Sec-WebSocket-Extensions: x-webkit-deflate-frame\r\n"
+        "Sec-WebSocket-Extensions: permessage-deflate; client_max_window_bits\r\n"
+        "\r\n";
+
+    websocket::DeflateOptions options;
+    options.enabled = true;
+    options.clientMaxWindowBits = 9;
+
+    ws_details::HandshakeReply reply;
+    ws_details::DeflateParams params;
+    REQUIRE(ws_details::handshake(request.data(), request.data() + request.size(), reply, options, params) == http::Status::OK);
+    REQUIRE(params.enabled);
+    REQUIRE(std::string(reply.data(), reply.size()) ==
         "HTTP/1.1 101 Switching Protocols\r\n"
         "Upgrade: websocket\r\n"
         "Connection: Upgrade\r\n"
         "Sec-WebSocket-Accept: s3pPLMBiTxaQ9kYGzzhZRbK+xOo=\r\n"
+        "Sec-WebSocket-Extensions: permessage-deflate; client_max_window_bits=9\r\n"
         "\r\n");
-}
\ No newline at end of file
+}
+
+TEST_CASE("handshake in place, errors", "[websocket]")
+{
+    auto handshake = [](const std::string& request)
+    {
+        ws_details::HandshakeReply reply;
+        ws_details::DeflateParams params;
+        auto status = ws_details::handshake(request.data(), request.data() + request.size(), reply, websocket::DeflateOptions{}, params);
+        REQUIRE(std::string(reply.data(), reply.size()) == "HTTP/1.1 " + std::to_string(int(status)) + " :(\r\n\r\n");
+        return status;
+    };
+
+    const std::string headers =
+        "Upgrade: websocket\r\n"
+        "Connection: Upgrade\r\n"
+        "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+        "Sec-WebSocket-Version: 13\r\n"
+        "\r\n";
+
+    REQUIRE(handshake("POST / HTTP/1.1\r\n" + headers) == http::Status::MethodNotAllowed);
+    REQUIRE(handshake("GET /foo HTTP/1.1\r\n" + headers) == http::Status::NotFound);
+    REQUIRE(handshake("GET / HTTP/1.0\r\n" + headers) == http::Status::HTTPVersionNotSupported);
+    REQUIRE(handshake("GET / HTTP/1.1\r\n" + headers + "\x81") == http::Status::BadRequest);
+    REQUIRE(handshake("GET / HTTP/1.1\r\nUpgrade: websocket\r\nSec-WebSocket-Version: 13\r\n\r\n") == http::Status::BadRequest);
+}
+
+TEST_CASE("handshake with routes", "[websocket]")
+{
+    const std::string headers =
+        "Upgrade: websocket\r\n"
+        "Connection: Upgrade\r\n"
+        "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+        "Sec-WebSocket-Version: 13\r\n"
+        "Sec-WebSocket-Extensions: permessage-deflate\r\n"
+        "\r\n";
+
+    websocket::DeflateOptions chatOptions;
+    chatOptions.enabled = true;
+    websocket::DeflateOptions newsOptions;
+
+    std::string selectedPath;
+    auto selectRoute = [&](const http::RequestView& rq, const websocket::DeflateOptions*& options)
+    {
+        selectedPath.assign(rq.requestPath.begin, rq.requestPath.end);
+        if (http::parser::equals(rq.requestPath, "/chat"))
+            options = &chatOptions;
+        else if (http::parser::equals(rq.requestPath, "/news"))
+            options = &newsOptions;
+        else
+            return http::Status::NotFound;
+        return http::Status::OK;
+    };
+
+    auto handshake = [&](const std::string& request, ws_details::HandshakeReply& reply, ws_details::DeflateParams& params)
+    {
+        selectedPath.clear();
+        return ws_details::routeHandshake(request.data(), request.data() + request.size(), reply, selectRoute, params);
+    };
+
+    SECTION("extensions of the route")
+    {
+        ws_details::HandshakeReply reply;
+        ws_details::DeflateParams params;
+        REQUIRE(handshake("GET /chat?room=1 HTTP/1.1\r\n" + headers, reply, params) == http::Status::OK);
+        REQUIRE(selectedPath == "/chat");
+        REQUIRE(params.enabled);
+        REQUIRE(std::string(reply.data(), reply.size()) ==
+            "HTTP/1.1 101 Switching Protocols\r\n"
+            "Upgrade: websocket\r\n"
+            "Connection: Upgrade\r\n"
+            "Sec-WebSocket-Accept: s3pPLMBiTxaQ9kYGzzhZRbK+xOo=\r\n"
+            "Sec-WebSocket-Extensions: permessage-deflate\r\n"
+            "\r\n");
+
+        ws_details::HandshakeReply newsReply;
+        REQUIRE(handshake("GET /news HTTP/1.1\r\n" + headers, newsReply, params) == http::Status::OK);
+        REQUIRE(selectedPath == "/news");
+        REQUIRE_FALSE(params.enabled);
+    }
+
+    SECTION("unknown path")
+    {
+        ws_details::HandshakeReply reply;
+        ws_details::DeflateParams params;
+        REQUIRE(handshake("GET /foo HTTP/1.1\r\n" + headers, reply, params) == http::Status::NotFound);
+        REQUIRE(selectedPath == "/foo");
+        REQUIRE(std::string(reply.data(), reply.size()) == "HTTP/1.1 404 :(\r\n\r\n");
+    }
+
+    SECTION("invalid request doesn't reach the route selector")
+    {
+        ws_details::HandshakeReply reply;
+        ws_details::DeflateParams params;
+        REQUIRE(handshake("POST /chat HTTP/1.1\r\n" + headers, reply, params) == http::Status::MethodNotAllowed);
+        REQUIRE(selectedPath.empty());
+    }
+}
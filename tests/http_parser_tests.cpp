@@ -48,4 +48,76 @@ TEST_CASE("headers", "[http][parser]")
 
     stream.peek();
     REQUIRE(stream.eof());
-}
\ No newline at end of file
+}
+
+TEST_CASE("request end", "[http][parser]")
+{
+    std::string request = "GET / HTTP/1.1\r\nHost: localhost\r\n\r\n";
+    auto begin = request.data();
+    auto end = begin + request.size();
+
+    REQUIRE(http::parser::findRequestEnd(begin, end) == end);
+    REQUIRE(http::parser::findRequestEnd(begin, end - 1) == nullptr);
+    REQUIRE(http::parser::findRequestEnd(begin, begin + 16) == nullptr);
+
+    // scanning resumes 3 bytes before the old end
+    REQUIRE(http::parser::findRequestEnd(end - 4 - 3 + 1, end) == end);
+}
+
+TEST_CASE("request view", "[http][parser]")
+{
+    std::string request =
+        "GET /chat HTTP/1.1\r\n"
+        "Host: localhost\r\n"
+        "connection: keep-alive, Upgrade\r\n"
+        "UPGRADE: WebSocket/13\r\n"
+        "Sec-WebSocket-Version: 13\r\n"
+        "Sec-WebSocket-Key:  dGhlIHNhbXBsZSBub25jZQ== \r\n"
+        "Sec-WebSocket-Extensions: x-webkit-deflate-frame\r\n"
+        "Sec-WebSocket-Extensions: permessage-deflate; client_max_window_bits \r\n"
+        "some-name: some-value\r\n"
+        "\r\n";
+    auto end = request.data() + request.size();
+
+    http::RequestView rq;
+    REQUIRE(http::parser::parseRequest(request.data(), end, rq) == end);
+
+    REQUIRE(rq.method == http::Method::GET);
+    REQUIRE(rq.requestPath.str() == "/chat");
+    REQUIRE(rq.httpVersion == http::Version::v1_1);
+    REQUIRE(rq.upgradeWebsocket);
+    REQUIRE(rq.connectionUpgrade);
+    REQUIRE(rq.secWebSocketVersion == 13);
+    REQUIRE(rq.secWebSocketKey.str() == "dGhlIHNhbXBsZSBub25jZQ==");
+    REQUIRE(rq.extensionHeaders == 2);
+    REQUIRE(rq.secWebSocketExtensions[0].str() == "x-webkit-deflate-frame");
+    REQUIRE(rq.secWebSocketExtensions[1].str() == "permessage-deflate; client_max_window_bits");
+}
+
+TEST_CASE("malformed request view", "[http][parser]")
+{
+    auto parse = [](const std::string& request)
+    {
+        http::RequestView rq;
+        return http::parser::parseRequest(request.data(), request.data() + request.size(), rq) != nullptr;
+    };
+
+    REQUIRE(parse("GET / HTTP/1.1\r\n\r\n"));
+    REQUIRE_FALSE(parse("GET / HTTP/1.1\r\n"));
+    REQUIRE_FALSE(parse("GET\r\n\r\n"));
+    REQUIRE_FALSE(parse("GET / HTTP/1.1\n\n"));
+    REQUIRE_FALSE(parse("GET / HTTP/1.1\r\nConnection: ,\r\n\r\n"));
+    REQUIRE_FALSE(parse("GET / HTTP/1.1\r\nUpgrade: websocket x\r\n\r\n"));
+    REQUIRE_FALSE(parse("GET / HTTP/1.1\r\nSec-WebSocket-Key: ???\r\n\r\n"));
+}
+
+TEST_CASE("request view with a query", "[http][parser]")
+{
+    std::string request = "GET /chat?room=1&user=2 HTTP/1.1\r\n\r\n";
+    auto end = request.data() + request.size();
+
+    http::RequestView rq;
+    REQUIRE(http::parser::parseRequest(request.data(), end, rq) == end);
+    REQUIRE(rq.requestPath.str() == "/chat");
+    REQUIRE(rq.query.str() == "room=1&user=2");
+}
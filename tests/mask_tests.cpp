@@ -0,0 +1,104 @@
+// tests for mask.hpp
+#include "details/mask.hpp"
+
+#include "third_party/catch/catch.hpp"
+
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace ws_details = websocket::details;
+
+namespace
+{
+    std::vector<std::pair<const char*, ws_details::mask_fn>> maskKernels()
+    {
+        std::vector<std::pair<const char*, ws_details::mask_fn>> kernels;
+        kernels.emplace_back("bytewise", ws_details::applyMaskBytewise);
+        kernels.emplace_back("wordwise", ws_details::applyMaskWordwise);
+#if defined WEBSOCKET_HAS_SSE2
+        kernels.emplace_back("sse2", ws_details::applyMaskSse2);
+#endif
+#if defined WEBSOCKET_HAS_AVX2
+        if (ws_details::cpuHasAvx2())
+            kernels.emplace_back("avx2", ws_details::applyMaskAvx2);
+#endif
+        kernels.emplace_back("dispatch", [](char* data, std::size_t size, const char* key, std::size_t keyOffset)
+        {
+            ws_details::applyMask(data, size, key, keyOffset);
+        });
+        return kernels;
+    }
+
+    std::string referenceMask(std::string data, const char* key, std::size_t keyOffset)
+    {
+        for (auto i = 0u; i != data.size(); ++i)
+            data[i] ^= key[(keyOffset + i) % 4];
+        return data;
+    }
+}
+
+TEST_CASE("mask kernels match the reference", "[mask]")
+{
+    const char key[] = "\x12\x8a\xff\x03";
+
+    std::string input(1000, '\0');
+    for (auto i = 0u; i != input.size(); ++i)
+        input[i] = char(i * 7 + 3);
+
+    for (auto&& kernel : maskKernels())
+    {
+        INFO(kernel.first);
+
+        for (auto misalign : {0u, 1u, 3u, 7u, 13u, 31u})
+        {
+            for (auto size : {0u, 1u, 3u, 4u, 15u, 16u, 31u, 32u, 63u, 64u, 127u, 128u, 129u, 500u, 900u})
+            {
+                for (auto keyOffset : {0u, 1u, 2u, 3u, 6u})
+                {
+                    std::string buffer = input;
+                    kernel.second(&buffer[misalign], size, key, keyOffset);
+
+                    REQUIRE(buffer.substr(0, misalign) == input.substr(0, misalign));
+                    REQUIRE(buffer.substr(misalign, size) == referenceMask(input.substr(misalign, size), key, keyOffset));
+                    REQUIRE(buffer.substr(misalign + size) == input.substr(misalign + size));
+                }
+            }
+        }
+    }
+}
+
+TEST_CASE("mask a payload in pieces", "[mask]")
+{
+    const char key[] = "abcd";
+    std::string data(300, 'x');
+    auto expected = referenceMask(data, key, 0);
+
+    ws_details::applyMask(&data[0], 5, key, 0);
+    ws_details::applyMask(&data[5], 100, key, 5);
+    ws_details::applyMask(&data[105], 195, key, 105);
+    REQUIRE(data == expected);
+}
+
+TEST_CASE("mask throughput", "[mask][.][bench]")
+{
+    const char key[] = "\x12\x34\x56\x78";
+    const std::size_t size = 1024 * 1024;
+    const auto rounds = 256;
+    std::vector<char> buffer(size + 1);
+
+    for (auto&& kernel : maskKernels())
+    {
+        for (auto misalign : {0, 1})
+        {
+            auto start = std::chrono::steady_clock::now();
+            for (auto i = 0; i != rounds; ++i)
+                kernel.second(buffer.data() + misalign, size, key, 0);
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+            std::cout << kernel.first << (misalign ? " (unaligned)" : "") << ": "
+                << double(size) * rounds / elapsed.count() / 1e9 << " GB/s\n";
+        }
+    }
+}
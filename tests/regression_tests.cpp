@@ -1,12 +1,31 @@
 #include "Server.hpp"
+#include "details/Acceptor.hpp"
+#include "details/deflate.hpp"
 
 #include "third_party/catch/catch.hpp"
+#include "alloc_counter.hpp"
 
+#include <atomic>
+#include <future>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <vector>
 #include <thread>
 #include <tuple>
 #include <boost/asio.hpp>
 
+#if !defined _WIN32
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
 namespace
 {
     template<std::size_t N>
@@ -18,6 +37,12 @@ namespace
     const auto ServerIp = "127.0.0.1";
     const unsigned short ServerPort = 8888;
 
+    // unmasked server text frame
+    std::string textFrame(const std::string& payload)
+    {
+        return char(0x81) + std::string(1, char(payload.size())) + payload;
+    }
+
     using event_t = std::tuple<websocket::Event, websocket::ConnectionId, std::string>;
 }
 
@@ -31,6 +56,9 @@ namespace std
         case websocket::Event::NewConnection: o << "connected"; break;
         case websocket::Event::Message: o << "says"; break;
         case websocket::Event::Disconnect: o << "disconnected"; break;
+        case websocket::Event::MessageFragment: o << "sends fragment"; break;
+        case websocket::Event::HighWatermark: o << "is slow"; break;
+        case websocket::Event::LowWatermark: o << "caught up"; break;
         default: o << "???"; break;
         }
         o << " '" << std::get<2>(e) << '\'';
@@ -45,19 +73,21 @@ namespace
         boost::asio::io_service m_ioService;
         boost::asio::ip::tcp::socket m_socket{ m_ioService };
 
-        Client()
+        explicit Client(const std::string& extensions = "", const std::string& acceptedExtensions = "", const std::string& target = "/")
         {
             boost::asio::ip::tcp::endpoint serverEndpoint{ boost::asio::ip::address_v4::from_string(ServerIp), ServerPort };
             m_socket.connect(serverEndpoint);
 
             std::string request =
-                "GET / HTTP/1.1" "\r\n"
+                "GET " + target + " HTTP/1.1" "\r\n"
                 "Host: localhost" "\r\n"
                 "Upgrade: websocket" "\r\n"
                 "Connection: Upgrade" "\r\n"
                 "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==" "\r\n"
-                "Sec-WebSocket-Version: 13" "\r\n"
-                "\r\n";
+                "Sec-WebSocket-Version: 13" "\r\n";
+            if (!extensions.empty())
+                request += "Sec-WebSocket-Extensions: " + extensions + "\r\n";
+            request += "\r\n";
             boost::asio::write(m_socket, boost::asio::buffer(request));
 
             boost::asio::streambuf replyBuf;
@@ -70,8 +100,10 @@ namespace
                 "HTTP/1.1 101 Switching Protocols\r\n"
                 "Upgrade: websocket\r\n"
                 "Connection: Upgrade\r\n"
-                "Sec-WebSocket-Accept: s3pPLMBiTxaQ9kYGzzhZRbK+xOo=\r\n"
-                "\r\n";
+                "Sec-WebSocket-Accept: s3pPLMBiTxaQ9kYGzzhZRbK+xOo=\r\n";
+            if (!acceptedExtensions.empty())
+                expectedReply += "Sec-WebSocket-Extensions: " + acceptedExtensions + "\r\n";
+            expectedReply += "\r\n";
 
             REQUIRE(replyStr == expectedReply);
         }
@@ -83,6 +115,42 @@ namespace
             boost::asio::write(m_socket, boost::asio::buffer(frame));
         }
 
+        static std::string makeFrame(const std::string& payload, unsigned char firstByte = 0x81)
+        {
+            std::string frame;
+            frame.push_back(firstByte);
+
+            auto n = payload.size();
+            if (n <= 125)
+            {
+                frame.push_back(char(0x80 | n));
+            }
+            else if (n <= 0xFFFF)
+            {
+                frame.push_back(char(0x80 | 126));
+                frame.push_back(char(n >> 8));
+                frame.push_back(char(n & 0xFF));
+            }
+            else
+            {
+                frame.push_back(char(0x80 | 127));
+                for (auto i = 7; i >= 0; --i)
+                    frame.push_back(char((std::uint64_t(n) >> (8 * i)) & 0xFF));
+            }
+
+            const char key[] = "\x12\x34\x56\x78";
+            frame.append(key, 4);
+            for (auto i = 0u; i != n; ++i)
+                frame.push_back(payload[i] ^ key[i % 4]);
+
+            return frame;
+        }
+
+        void sendMessage(const std::string& payload, unsigned char firstByte = 0x81)
+        {
+            boost::asio::write(m_socket, boost::asio::buffer(makeFrame(payload, firstByte)));
+        }
+
         std::string recvFrame()
         {
             const unsigned bufSize = 0x20000;
@@ -116,27 +184,54 @@ namespace
         }
     };
 
+    // status line of the reply to a handshake request for `target`
+    std::string handshakeStatus(const std::string& target)
+    {
+        boost::asio::io_service ioService;
+        boost::asio::ip::tcp::socket socket{ioService};
+        socket.connect({boost::asio::ip::address_v4::from_string(ServerIp), ServerPort});
+
+        std::string request =
+            "GET " + target + " HTTP/1.1" "\r\n"
+            "Upgrade: websocket" "\r\n"
+            "Connection: Upgrade" "\r\n"
+            "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==" "\r\n"
+            "Sec-WebSocket-Version: 13" "\r\n"
+            "\r\n";
+        boost::asio::write(socket, boost::asio::buffer(request));
+
+        boost::asio::streambuf replyBuf;
+        boost::asio::read_until(socket, replyBuf, "\r\n");
+        std::istream replyStream{&replyBuf};
+        std::string statusLine;
+        std::getline(replyStream, statusLine);
+        return statusLine;
+    }
+
     struct WebsocketTestsFixture
     {
         websocket::Server server;
+        websocket::RouteId lastRoute{0}; // of the last event from waitServerEvent()
 
-        WebsocketTestsFixture()
+        WebsocketTestsFixture(const websocket::ServerOptions& options = websocket::ServerOptions())
         {
-            server.start(ServerIp, ServerPort, std::cout);
+            server.start(ServerIp, ServerPort, std::cout, options);
         }
 
         event_t waitServerEvent()
         {
-            for (auto n = 0; n < 10; ++n)
+            auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+            do
             {
-                websocket::Event event;
-                websocket::ConnectionId connId;
-                std::string message;
-                if (server.poll(event, connId, message))
-                    return event_t(event, connId, message);
-
-                std::this_thread::sleep_for(std::chrono::milliseconds(1));
-            }
+                std::vector<websocket::ServerEvent> events;
+                if (server.pollBatch(events, 1) != 0)
+                {
+                    auto&& e = events.front();
+                    lastRoute = e.route;
+                    return event_t(e.event, e.connId, e.message);
+                }
+            } while (server.wait(std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()))
+                || std::chrono::steady_clock::now() < deadline);
 
             FAIL("timeout");
             return{}; // suppress warning
@@ -179,6 +274,428 @@ TEST_CASE_METHOD(WebsocketTestsFixture, "Server message", "[websocket][slow]")
     REQUIRE(client.recvFrame() == "\x81\x04test");
 }
 
+TEST_CASE_METHOD(WebsocketTestsFixture, "Broadcast", "[websocket][slow]")
+{
+    Client client1;
+    waitServerEvent(websocket::Event::NewConnection);
+    Client client2;
+    waitServerEvent(websocket::Event::NewConnection);
+    Client client3;
+    waitServerEvent(websocket::Event::NewConnection);
+
+    server.broadcastText("all");
+    REQUIRE(client1.recvFrame() == "\x81\x03" "all");
+    REQUIRE(client2.recvFrame() == "\x81\x03" "all");
+    REQUIRE(client3.recvFrame() == "\x81\x03" "all");
+
+    server.broadcastBinary({1, 3, 42}, "some");
+    server.sendText(2, "two");
+    REQUIRE(client1.recvFrame() == "\x82\x04" "some");
+    REQUIRE(client2.recvFrame() == "\x81\x03" "two");
+    REQUIRE(client3.recvFrame() == "\x82\x04" "some");
+}
+
+TEST_CASE_METHOD(WebsocketTestsFixture, "Server message burst", "[websocket][slow]")
+{
+    Client client;
+    waitServerEvent(websocket::Event::NewConnection);
+
+    std::string expected;
+    for (auto i = 0; i != 1000; ++i)
+    {
+        auto message = std::to_string(i);
+        server.sendText(1, message);
+        expected += textFrame(message);
+    }
+
+    server.sendBinary(1, std::string(100000, 'b'));
+    expected += "\x82\x7f" + std::string(5, '\0') + "\x01\x86\xa0" + std::string(100000, 'b');
+
+    std::string received(expected.size(), '\0');
+    boost::asio::read(client.m_socket, boost::asio::buffer(&received[0], received.size()));
+    REQUIRE(received == expected);
+}
+
+TEST_CASE_METHOD(WebsocketTestsFixture, "Poll a batch of events", "[websocket][slow]")
+{
+    Client client;
+    waitServerEvent(websocket::Event::NewConnection);
+
+    std::string frames;
+    for (auto i = 0; i != 10; ++i)
+        frames += Client::makeFrame(std::to_string(i));
+    boost::asio::write(client.m_socket, boost::asio::buffer(frames));
+
+    std::vector<websocket::ServerEvent> events;
+    while (events.size() < 10)
+    {
+        REQUIRE(server.wait(std::chrono::seconds(1)));
+        server.pollBatch(events, 4);
+    }
+
+    REQUIRE(events.size() == 10);
+    for (auto i = 0; i != 10; ++i)
+    {
+        REQUIRE(events[i].event == websocket::Event::Message);
+        REQUIRE(events[i].connId == 1);
+        REQUIRE(events[i].message == std::to_string(i));
+    }
+
+    REQUIRE(server.pollBatch(events, 4) == 0);
+    REQUIRE_FALSE(server.wait(std::chrono::milliseconds(10)));
+}
+
+#if !defined _WIN32
+TEST_CASE_METHOD(WebsocketTestsFixture, "Event fd", "[websocket][slow]")
+{
+    pollfd pfd{server.eventFd(), POLLIN, 0};
+    REQUIRE(pfd.fd != -1);
+
+    // armed by a poll that finds nothing
+    websocket::Event event;
+    websocket::ConnectionId connId;
+    std::string message;
+    REQUIRE_FALSE(server.poll(event, connId, message));
+    REQUIRE(::poll(&pfd, 1, 0) == 0);
+
+    Client client;
+    REQUIRE(::poll(&pfd, 1, 1000) == 1);
+    REQUIRE(server.poll(event, connId, message));
+    REQUIRE(event == websocket::Event::NewConnection);
+
+    REQUIRE_FALSE(server.poll(event, connId, message));
+    REQUIRE(::poll(&pfd, 1, 0) == 0);
+}
+#endif
+
+TEST_CASE_METHOD(WebsocketTestsFixture, "Send many messages", "[websocket][slow]")
+{
+    Client client1;
+    waitServerEvent(websocket::Event::NewConnection);
+    Client client2;
+    waitServerEvent(websocket::Event::NewConnection);
+
+    std::vector<websocket::OutgoingMessage> messages;
+    std::string expected1, expected2;
+    for (auto i = 0; i != 1000; ++i)
+    {
+        auto message = std::to_string(i);
+        messages.push_back({websocket::ConnectionId(1 + i % 2), message});
+        (i % 2 == 0 ? expected1 : expected2) += textFrame(message);
+    }
+
+    messages.push_back({1, "bin", true});
+    expected1 += "\x82\x03" "bin";
+
+    server.sendMany(std::move(messages));
+    server.sendText(2, "last");
+    expected2 += textFrame("last");
+
+    std::string received1(expected1.size(), '\0');
+    boost::asio::read(client1.m_socket, boost::asio::buffer(&received1[0], received1.size()));
+    REQUIRE(received1 == expected1);
+
+    std::string received2(expected2.size(), '\0');
+    boost::asio::read(client2.m_socket, boost::asio::buffer(&received2[0], received2.size()));
+    REQUIRE(received2 == expected2);
+}
+
+TEST_CASE("Commands overflow the command queue", "[websocket][slow]")
+{
+    websocket::ServerOptions options;
+    options.commandQueueSize = 4;
+
+    WebsocketTestsFixture fixture{options};
+    Client client;
+    fixture.waitServerEvent(websocket::Event::NewConnection);
+
+    std::string expected;
+    for (auto i = 0; i != 300; ++i)
+    {
+        auto message = std::to_string(i);
+        if (i % 3 == 0)
+            fixture.server.sendMany({{1, message}});
+        else
+            fixture.server.sendText(1, message);
+        expected += textFrame(message);
+    }
+
+    std::string received(expected.size(), '\0');
+    boost::asio::read(client.m_socket, boost::asio::buffer(&received[0], received.size()));
+    REQUIRE(received == expected);
+}
+
+TEST_CASE_METHOD(WebsocketTestsFixture, "Streamed message", "[websocket][slow]")
+{
+    Client client;
+    waitServerEvent(websocket::Event::NewConnection);
+
+    // parts as long as a send batch, so the stream is still running when the next message is sent
+    const std::size_t partSize = 64 * 1024;
+    const int parts = 256;
+    std::atomic<int> produced{0};
+    server.sendStream(1, [&](std::string& chunk)
+    {
+        chunk.assign(partSize, char('a' + produced % 26));
+        return ++produced != parts;
+    }, true);
+    server.sendText(1, "after");
+
+    // the client doesn't read, the producer waits for room in the socket buffers
+    std::this_thread::sleep_for(std::chrono::milliseconds{200});
+    REQUIRE(produced < parts);
+
+    for (auto i = 0; i != parts; ++i)
+    {
+        unsigned char header[10];
+        boost::asio::read(client.m_socket, boost::asio::buffer(header));
+        REQUIRE(int(header[0]) == (i == 0 ? 0x02 : i == parts - 1 ? 0x80 : 0x00));
+        REQUIRE(int(header[1]) == 127);
+        REQUIRE(std::string(header + 2, header + 10) == str("\0\0\0\0\0\x01\0\0"));
+
+        std::string payload(partSize, '\0');
+        boost::asio::read(client.m_socket, boost::asio::buffer(&payload[0], payload.size()));
+        REQUIRE(payload == std::string(partSize, char('a' + i % 26)));
+    }
+
+    std::string expected = textFrame("after");
+    std::string received(expected.size(), '\0');
+    boost::asio::read(client.m_socket, boost::asio::buffer(&received[0], received.size()));
+    REQUIRE(received == expected);
+}
+
+#if !defined _WIN32
+TEST_CASE_METHOD(WebsocketTestsFixture, "Send a file", "[websocket][slow]")
+{
+    Client client;
+    waitServerEvent(websocket::Event::NewConnection);
+
+    std::string data(300 * 1000, '\0');
+    for (std::size_t i = 0; i != data.size(); ++i)
+        data[i] = char(i * 7 / 3);
+
+    char path[] = "/tmp/websocket-file-XXXXXX";
+    auto fd = ::mkstemp(path);
+    REQUIRE(fd != -1);
+    ::unlink(path);
+    REQUIRE(::write(fd, data.data(), data.size()) == ssize_t(data.size()));
+
+    server.sendFile(1, fd, 1000, 200000);
+    server.sendFile(1, fd, 10, 5);
+    ::close(fd); // the server has its own descriptor
+    server.sendText(1, "after");
+
+    std::string expected =
+        str("\x82\x7f\0\0\0\0\0\x03\x0d\x40") + data.substr(1000, 200000) +
+        str("\x82\x05") + data.substr(10, 5) +
+        textFrame("after");
+    std::string received(expected.size(), '\0');
+    boost::asio::read(client.m_socket, boost::asio::buffer(&received[0], received.size()));
+    REQUIRE(received == expected);
+}
+
+TEST_CASE_METHOD(WebsocketTestsFixture, "Client closes during a file transfer", "[websocket][slow]")
+{
+    Client other;
+    waitServerEvent(websocket::Event::NewConnection);
+
+    char path[] = "/tmp/websocket-file-XXXXXX";
+    auto fd = ::mkstemp(path);
+    REQUIRE(fd != -1);
+    ::unlink(path);
+    const std::uint64_t size = 64 * 1024 * 1024;
+    REQUIRE(::ftruncate(fd, off_t(size)) == 0);
+
+    // sendfile(2) to a reset connection raises SIGPIPE, the server must survive it
+    for (auto i = 0; i != 5; ++i)
+    {
+        websocket::ConnectionId connId;
+        {
+            Client leaving;
+            auto&& e = waitServerEvent();
+            REQUIRE(std::get<0>(e) == websocket::Event::NewConnection);
+            connId = std::get<1>(e);
+
+            server.sendFile(connId, fd, 0, size);
+            static char buf[0x10000];
+            boost::asio::read(leaving.m_socket, boost::asio::buffer(buf));
+
+            // reset instead of a graceful close
+            leaving.m_socket.set_option(boost::asio::socket_base::linger{true, 0});
+        }
+
+        REQUIRE(waitServerEvent() == event_t(websocket::Event::Disconnect, connId, ""));
+    }
+
+    ::close(fd);
+
+    server.sendText(1, "still here");
+    REQUIRE(other.recvFrame() == textFrame("still here"));
+}
+#endif
+
+TEST_CASE_METHOD(WebsocketTestsFixture, "Silent client doesn't block handshakes", "[websocket][slow]")
+{
+    boost::asio::io_service ioService;
+    boost::asio::ip::tcp::socket silent{ioService};
+    silent.connect({boost::asio::ip::address_v4::from_string(ServerIp), ServerPort});
+
+    Client client;
+    REQUIRE(waitServerEvent() == event_t(websocket::Event::NewConnection, 1, ""));
+}
+
+TEST_CASE("Handshake timeout", "[websocket][slow]")
+{
+    websocket::ServerOptions options;
+    options.handshakeTimeout = std::chrono::milliseconds{100};
+    options.maxPendingHandshakes = 1;
+
+    WebsocketTestsFixture fixture{options};
+    boost::asio::io_service ioService;
+    boost::asio::ip::tcp::socket silent{ioService};
+    silent.connect({boost::asio::ip::address_v4::from_string(ServerIp), ServerPort});
+
+    // waits in the backlog until the silent client is dropped
+    Client client;
+    fixture.waitServerEvent(websocket::Event::NewConnection);
+
+    char c;
+    boost::system::error_code ec;
+    boost::asio::read(silent, boost::asio::buffer(&c, 1), ec);
+    REQUIRE(ec == boost::asio::error::eof);
+}
+
+TEST_CASE_METHOD(WebsocketTestsFixture, "Ping gets a pong", "[websocket][slow]")
+{
+    Client client;
+    waitServerEvent(websocket::Event::NewConnection);
+
+    client.sendMessage("tick", 0x89);
+    REQUIRE(client.recvFrame() == std::string("\x8A\x04" "tick"));
+
+    // pongs are ignored
+    client.sendMessage("", 0x8A);
+    client.sendMessage("hello");
+    REQUIRE(waitServerEvent() == event_t(websocket::Event::Message, 1, "hello"));
+}
+
+TEST_CASE("Server pings a silent client", "[websocket][slow]")
+{
+    websocket::ServerOptions options;
+    options.pingInterval = std::chrono::milliseconds{50};
+    options.timerTick = std::chrono::milliseconds{10};
+
+    WebsocketTestsFixture fixture{options};
+    Client client;
+    fixture.waitServerEvent(websocket::Event::NewConnection);
+
+    REQUIRE(client.recvFrame() == std::string("\x89\x00", 2));
+}
+
+TEST_CASE("Idle client is dropped", "[websocket][slow]")
+{
+    websocket::ServerOptions options;
+    options.idleTimeout = std::chrono::milliseconds{200};
+    options.timerTick = std::chrono::milliseconds{10};
+
+    WebsocketTestsFixture fixture{options};
+    Client active;
+    fixture.waitServerEvent(websocket::Event::NewConnection);
+    Client idle;
+    fixture.waitServerEvent(websocket::Event::NewConnection);
+
+    // the active client keeps talking until the idle one is dropped
+    auto start = std::chrono::steady_clock::now();
+    websocket::Event event;
+    websocket::ConnectionId connId;
+    std::string message;
+    while (!fixture.server.poll(event, connId, message))
+    {
+        REQUIRE(std::chrono::steady_clock::now() - start < std::chrono::seconds{1});
+        std::this_thread::sleep_for(std::chrono::milliseconds{5});
+        active.sendMessage("ping", 0x89);
+        REQUIRE(active.recvFrame() == std::string("\x8A\x04" "ping"));
+    }
+
+    // dropped at the deadline, not just some time after it
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    REQUIRE(event_t(event, connId, message) == event_t(websocket::Event::Disconnect, 2, ""));
+    REQUIRE(elapsed >= options.idleTimeout - 2 * options.timerTick);
+    REQUIRE(elapsed < options.idleTimeout + 2 * options.timerTick + std::chrono::milliseconds{50});
+
+    char c;
+    boost::system::error_code ec;
+    boost::asio::read(idle.m_socket, boost::asio::buffer(&c, 1), ec);
+    REQUIRE(ec == boost::asio::error::eof);
+
+    active.sendMessage("hello");
+    REQUIRE(fixture.waitServerEvent() == event_t(websocket::Event::Message, 1, "hello"));
+}
+
+TEST_CASE("Routes", "[websocket][slow]")
+{
+    websocket::ServerOptions options;
+    websocket::Route chat;
+    chat.path = "/chat";
+    chat.maxMessageSize = 4;
+    chat.maxConnections = 1;
+    options.routes.push_back(chat);
+
+    WebsocketTestsFixture fixture{options};
+
+    Client chatClient{"", "", "/chat?room=1"};
+    REQUIRE(fixture.waitServerEvent() == event_t(websocket::Event::NewConnection, 1, "room=1"));
+    REQUIRE(fixture.lastRoute == 1);
+
+    REQUIRE(handshakeStatus("/chat") == "HTTP/1.1 503 :(\r");
+    REQUIRE(handshakeStatus("/news") == "HTTP/1.1 404 :(\r");
+
+    Client client;
+    REQUIRE(fixture.waitServerEvent() == event_t(websocket::Event::NewConnection, 2, ""));
+    REQUIRE(fixture.lastRoute == 0);
+
+    client.sendMessage("hello");
+    REQUIRE(fixture.waitServerEvent() == event_t(websocket::Event::Message, 2, "hello"));
+    REQUIRE(fixture.lastRoute == 0);
+
+    // the route has its own message size limit
+    chatClient.sendMessage("hi");
+    REQUIRE(fixture.waitServerEvent() == event_t(websocket::Event::Message, 1, "hi"));
+    REQUIRE(fixture.lastRoute == 1);
+
+    chatClient.sendMessage("hello");
+    REQUIRE(fixture.waitServerEvent() == event_t(websocket::Event::Disconnect, 1, ""));
+    REQUIRE(fixture.lastRoute == 1);
+}
+
+TEST_CASE("Route handlers", "[websocket][slow]")
+{
+    websocket::ServerOptions options;
+    websocket::Route echo;
+    echo.path = "/echo";
+    echo.handlers.onMessage = [](websocket::LoopContext& context, websocket::ConnectionId connId, websocket::MessageView message, bool)
+    {
+        context.sendText(connId, message.str());
+    };
+    options.routes.push_back(echo);
+
+    WebsocketTestsFixture fixture{options};
+
+    Client echoClient{"", "", "/echo"};
+    Client client;
+    REQUIRE(fixture.waitServerEvent() == event_t(websocket::Event::NewConnection, 2, ""));
+    REQUIRE(fixture.lastRoute == 0);
+
+    echoClient.sendMessage("ping");
+    std::string expected = textFrame("ping");
+    std::string received(expected.size(), '\0');
+    boost::asio::read(echoClient.m_socket, boost::asio::buffer(&received[0], received.size()));
+    REQUIRE(received == expected);
+
+    client.sendMessage("hello");
+    REQUIRE(fixture.waitServerEvent() == event_t(websocket::Event::Message, 2, "hello"));
+}
+
 TEST_CASE_METHOD(WebsocketTestsFixture, "Client closes socket", "[websocket][slow]")
 {
     {
@@ -189,6 +706,30 @@ TEST_CASE_METHOD(WebsocketTestsFixture, "Client closes socket", "[websocket][slo
     REQUIRE(waitServerEvent() == event_t(websocket::Event::Disconnect, 1, ""));
 }
 
+TEST_CASE_METHOD(WebsocketTestsFixture, "Stale connection id", "[websocket][slow]")
+{
+    websocket::ConnectionId oldId;
+    {
+        Client client;
+        auto&& e = waitServerEvent();
+        REQUIRE(std::get<0>(e) == websocket::Event::NewConnection);
+        oldId = std::get<1>(e);
+    }
+    waitServerEvent(websocket::Event::Disconnect);
+
+    Client client;
+    auto&& e = waitServerEvent();
+    REQUIRE(std::get<0>(e) == websocket::Event::NewConnection);
+    auto newId = std::get<1>(e);
+    REQUIRE(newId != oldId);
+
+    // the slot is reused, but the old id doesn't reach the new connection
+    server.sendText(oldId, "old");
+    server.drop(oldId);
+    server.sendText(newId, "new");
+    REQUIRE(client.recvFrame() == "\x81\x03" "new");
+}
+
 TEST_CASE_METHOD(WebsocketTestsFixture, "Client closes connection", "[websocket][slow]")
 {
     Client client;
@@ -199,3 +740,929 @@ TEST_CASE_METHOD(WebsocketTestsFixture, "Client closes connection", "[websocket]
 
     REQUIRE(client.recvFrame() == str("\x88\x00"));
 }
+
+TEST_CASE_METHOD(WebsocketTestsFixture, "Client closes with a status code", "[websocket][slow]")
+{
+    Client client;
+    waitServerEvent(websocket::Event::NewConnection);
+
+    client.sendMessage("\x03\xe8" "bye", 0x88);
+    REQUIRE(waitServerEvent() == event_t(websocket::Event::Disconnect, 1, "\x03\xe8" "bye"));
+    REQUIRE(client.recvFrame() == str("\x88\x02\x03\xe8"));
+
+    char c;
+    boost::system::error_code ec;
+    boost::asio::read(client.m_socket, boost::asio::buffer(&c, 1), ec);
+    REQUIRE(ec == boost::asio::error::eof);
+}
+
+TEST_CASE_METHOD(WebsocketTestsFixture, "Client sends an invalid close code", "[websocket][slow]")
+{
+    Client client;
+    waitServerEvent(websocket::Event::NewConnection);
+
+    client.sendMessage("\x03\xed", 0x88); // 1005 must not be sent
+    REQUIRE(waitServerEvent() == event_t(websocket::Event::Disconnect, 1, ""));
+    REQUIRE(client.recvFrame() == str("\x88\x02\x03\xea"));
+}
+
+TEST_CASE_METHOD(WebsocketTestsFixture, "Server closes with a status code", "[websocket][slow]")
+{
+    Client client;
+    waitServerEvent(websocket::Event::NewConnection);
+
+    server.sendText(1, "last words");
+    server.drop(1, websocket::CloseCode::PolicyViolation, "go away");
+    server.sendText(1, "too late");
+
+    std::string expected = textFrame("last words") + str("\x88\x09\x03\xf0" "go away");
+    std::string received(expected.size(), '\0');
+    boost::asio::read(client.m_socket, boost::asio::buffer(&received[0], received.size()));
+    REQUIRE(received == expected);
+
+    // messages crossing the Close frame are ignored
+    client.sendMessage("hello");
+    client.sendMessage("\x03\xf0", 0x88);
+    REQUIRE(waitServerEvent() == event_t(websocket::Event::Disconnect, 1, "\x03\xf0"));
+
+    char c;
+    boost::system::error_code ec;
+    boost::asio::read(client.m_socket, boost::asio::buffer(&c, 1), ec);
+    REQUIRE(ec == boost::asio::error::eof);
+}
+
+TEST_CASE("Close timeout", "[websocket][slow]")
+{
+    websocket::ServerOptions options;
+    options.closeTimeout = std::chrono::milliseconds{100};
+    options.timerTick = std::chrono::milliseconds{10};
+
+    WebsocketTestsFixture fixture{options};
+    Client client;
+    fixture.waitServerEvent(websocket::Event::NewConnection);
+
+    fixture.server.drop(1, websocket::CloseCode::Normal);
+    REQUIRE(client.recvFrame() == str("\x88\x02\x03\xe8"));
+    REQUIRE(fixture.waitServerEvent() == event_t(websocket::Event::Disconnect, 1, ""));
+
+    char c;
+    boost::system::error_code ec;
+    boost::asio::read(client.m_socket, boost::asio::buffer(&c, 1), ec);
+    REQUIRE(ec == boost::asio::error::eof);
+}
+
+TEST_CASE("Stop drains the send queues", "[websocket][slow]")
+{
+    websocket::Server server;
+    server.start(ServerIp, ServerPort, std::cout);
+
+    Client client;
+    websocket::Event event;
+    websocket::ConnectionId connId;
+    std::string message;
+    while (!server.poll(event, connId, message))
+        server.wait(std::chrono::milliseconds{100});
+
+    server.sendText(connId, "bye");
+    auto stopped = std::async(std::launch::async, [&] { server.stop(); });
+
+    std::string expected = textFrame("bye") + str("\x88\x02\x03\xe9");
+    std::string received(expected.size(), '\0');
+    boost::asio::read(client.m_socket, boost::asio::buffer(&received[0], received.size()));
+    REQUIRE(received == expected);
+
+    // the server waits for the client's answer
+    REQUIRE(stopped.wait_for(std::chrono::milliseconds{100}) == std::future_status::timeout);
+    client.sendMessage("\x03\xe9", 0x88);
+    REQUIRE(stopped.wait_for(std::chrono::seconds{1}) == std::future_status::ready);
+}
+
+TEST_CASE_METHOD(WebsocketTestsFixture, "Client long messages", "[websocket][slow]")
+{
+    Client client;
+    waitServerEvent(websocket::Event::NewConnection);
+
+    std::string message16(1000, 'a');
+    client.sendMessage(message16);
+    REQUIRE(waitServerEvent() == event_t(websocket::Event::Message, 1, message16));
+
+    std::string message64(100000, 'b');
+    client.sendMessage(message64);
+    REQUIRE(waitServerEvent() == event_t(websocket::Event::Message, 1, message64));
+}
+
+TEST_CASE_METHOD(WebsocketTestsFixture, "Client message is copied once", "[websocket][slow]")
+{
+    Client client;
+    waitServerEvent(websocket::Event::NewConnection);
+
+    const std::size_t messageSize = 200000;
+    auto frame = Client::makeFrame(std::string(messageSize, 'm'), 0x82);
+
+    // the first message grows the receive buffer
+    boost::asio::write(client.m_socket, boost::asio::buffer(frame));
+    waitServerEvent(websocket::Event::Message);
+
+    websocket::Event event;
+    websocket::ConnectionId connId;
+    std::string message;
+
+    alloc_counter::start(messageSize);
+    boost::asio::write(client.m_socket, boost::asio::buffer(frame));
+    while (!server.poll(event, connId, message))
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    auto allocations = alloc_counter::stop();
+
+    REQUIRE(event == websocket::Event::Message);
+    REQUIRE(message == std::string(messageSize, 'm'));
+    REQUIRE(allocations == 1);
+}
+
+TEST_CASE_METHOD(WebsocketTestsFixture, "Client pipelined messages", "[websocket][slow]")
+{
+    Client client;
+    waitServerEvent(websocket::Event::NewConnection);
+
+    std::string frames;
+    for (auto i = 0; i != 100; ++i)
+    {
+        auto message = std::to_string(i);
+        frames.append({'\x81', char(0x80 | message.size()), 0, 0, 0, 0});
+        frames.append(message);
+    }
+
+    boost::asio::write(client.m_socket, boost::asio::buffer(frames));
+
+    for (auto i = 0; i != 100; ++i)
+        REQUIRE(waitServerEvent() == event_t(websocket::Event::Message, 1, std::to_string(i)));
+}
+
+TEST_CASE_METHOD(WebsocketTestsFixture, "Client sends invalid UTF-8", "[websocket][slow]")
+{
+    Client client;
+    waitServerEvent(websocket::Event::NewConnection);
+
+    client.sendMessage("\xce\xba\xe1\xbd\xb9\xcf\x83\xce\xbc\xce\xb5");
+    REQUIRE(waitServerEvent() == event_t(websocket::Event::Message, 1, "\xce\xba\xe1\xbd\xb9\xcf\x83\xce\xbc\xce\xb5"));
+
+    // a character split between fragments
+    client.sendMessage("\xce", 0x01);
+    client.sendMessage("\xba", 0x80);
+    REQUIRE(waitServerEvent() == event_t(websocket::Event::Message, 1, "\xce\xba"));
+
+    client.sendMessage("\xed\xa0\x80");
+    REQUIRE(waitServerEvent() == event_t(websocket::Event::Disconnect, 1, ""));
+    REQUIRE(client.recvFrame() == str("\x88\x02\x03\xef"));
+}
+
+TEST_CASE_METHOD(WebsocketTestsFixture, "Client fragmented message", "[websocket][slow]")
+{
+    Client client;
+    waitServerEvent(websocket::Event::NewConnection);
+
+    client.sendMessage("fr", 0x01);
+    client.sendMessage("ag", 0x00);
+    client.sendMessage("", 0x89); // ping in between
+    client.sendMessage("ment", 0x80);
+    REQUIRE(waitServerEvent() == event_t(websocket::Event::Message, 1, "fragment"));
+
+    client.sendMessage("next", 0x81);
+    REQUIRE(waitServerEvent() == event_t(websocket::Event::Message, 1, "next"));
+}
+
+TEST_CASE_METHOD(WebsocketTestsFixture, "Unexpected continuation frame", "[websocket][slow]")
+{
+    Client client;
+    waitServerEvent(websocket::Event::NewConnection);
+
+    client.sendMessage("oops", 0x80);
+    REQUIRE(waitServerEvent() == event_t(websocket::Event::Disconnect, 1, ""));
+}
+
+namespace
+{
+    struct StreamingFixture : WebsocketTestsFixture
+    {
+        static websocket::ServerOptions streamingOptions()
+        {
+            websocket::ServerOptions options;
+            options.streamFragments = true;
+            return options;
+        }
+
+        StreamingFixture() : WebsocketTestsFixture{streamingOptions()} {}
+    };
+}
+
+TEST_CASE_METHOD(StreamingFixture, "Client fragmented message, streaming", "[websocket][slow]")
+{
+    Client client;
+    waitServerEvent(websocket::Event::NewConnection);
+
+    client.sendMessage("fr", 0x01);
+    REQUIRE(waitServerEvent() == event_t(websocket::Event::MessageFragment, 1, "fr"));
+
+    client.sendMessage("ag", 0x00);
+    REQUIRE(waitServerEvent() == event_t(websocket::Event::MessageFragment, 1, "ag"));
+
+    client.sendMessage("ment", 0x80);
+    REQUIRE(waitServerEvent() == event_t(websocket::Event::Message, 1, "ment"));
+
+    client.sendMessage("whole", 0x81);
+    REQUIRE(waitServerEvent() == event_t(websocket::Event::Message, 1, "whole"));
+}
+
+namespace
+{
+    struct ThreadsFixture : WebsocketTestsFixture
+    {
+        static websocket::ServerOptions threadsOptions()
+        {
+            websocket::ServerOptions options;
+            options.threads = 4;
+            return options;
+        }
+
+        ThreadsFixture() : WebsocketTestsFixture{threadsOptions()} {}
+    };
+}
+
+TEST_CASE_METHOD(ThreadsFixture, "Several server threads", "[websocket][slow]")
+{
+    const auto clientCount = 16;
+    std::vector<std::unique_ptr<Client>> clients;
+    std::map<websocket::ConnectionId, std::size_t> clientIndices;
+
+    for (auto i = 0; i != clientCount; ++i)
+    {
+        clients.push_back(std::make_unique<Client>());
+        auto&& e = waitServerEvent();
+        REQUIRE(std::get<0>(e) == websocket::Event::NewConnection);
+        clientIndices[std::get<1>(e)] = i;
+    }
+
+    REQUIRE(clientIndices.size() == clientCount);
+
+    // ids encode the server thread, the kernel spreads connections between the threads
+    std::set<websocket::ConnectionId> shards;
+    for (auto&& c : clientIndices)
+        shards.insert(c.first & 3);
+    REQUIRE(shards.size() > 1);
+
+    // each client tells its index, the server replies to the owner of the id
+    for (auto i = 0; i != clientCount; ++i)
+        clients[i]->sendMessage(std::to_string(i));
+
+    for (auto i = 0; i != clientCount; ++i)
+    {
+        auto&& e = waitServerEvent();
+        REQUIRE(std::get<0>(e) == websocket::Event::Message);
+        REQUIRE(std::get<2>(e) == std::to_string(clientIndices[std::get<1>(e)]));
+        server.sendText(std::get<1>(e), std::get<2>(e));
+    }
+
+    for (auto i = 0; i != clientCount; ++i)
+        REQUIRE(clients[i]->recvFrame() == textFrame(std::to_string(i)));
+
+    server.broadcastText("all");
+    for (auto&& client : clients)
+        REQUIRE(client->recvFrame() == "\x81\x03" "all");
+
+    std::vector<websocket::ConnectionId> someIds;
+    for (auto&& c : clientIndices)
+    {
+        if (c.second % 2 == 0)
+            someIds.push_back(c.first);
+    }
+
+    server.broadcastText(someIds, "even");
+    server.broadcastText("end");
+    for (auto i = 0; i != clientCount; ++i)
+    {
+        auto expected = std::string(i % 2 == 0 ? "\x81\x04" "even" : "") + "\x81\x03" "end";
+        std::string received(expected.size(), '\0');
+        boost::asio::read(clients[i]->m_socket, boost::asio::buffer(&received[0], received.size()));
+        REQUIRE(received == expected);
+    }
+}
+
+namespace
+{
+    struct TcpOptionsFixture : WebsocketTestsFixture
+    {
+        static websocket::ServerOptions tcpOptions()
+        {
+            websocket::ServerOptions options;
+            options.tcp.backlog = 64;
+            options.tcp.cork = true;
+            options.tcp.receiveBufferSize = 256 * 1024;
+            options.tcp.sendBufferSize = 256 * 1024;
+            options.tcp.deferAcceptSeconds = 1;
+            options.tcp.fastOpenQueue = 16;
+            options.tcp.acceptBatch = 4;
+            return options;
+        }
+
+        TcpOptionsFixture() : WebsocketTestsFixture{tcpOptions()} {}
+    };
+
+#if !defined _WIN32
+    bool isEndpoint(const sockaddr_in& addr, const boost::asio::ip::tcp::endpoint& endpoint)
+    {
+        return addr.sin_family == AF_INET && ntohs(addr.sin_port) == endpoint.port()
+            && ntohl(addr.sin_addr.s_addr) == endpoint.address().to_v4().to_ulong();
+    }
+
+    // the tests share the process with the server, so they can find its sockets and read their options
+    int serverSocket(const Client& client)
+    {
+        auto clientEndpoint = client.m_socket.local_endpoint();
+        for (auto fd = 0; fd != 1024; ++fd)
+        {
+            sockaddr_in peer{};
+            socklen_t size = sizeof(peer);
+            if (::getpeername(fd, (sockaddr*)&peer, &size) == 0 && isEndpoint(peer, clientEndpoint))
+                return fd;
+        }
+
+        return -1;
+    }
+
+    int intOption(int fd, int level, int name)
+    {
+        int value = 0;
+        socklen_t size = sizeof(value);
+        REQUIRE(::getsockopt(fd, level, name, &value, &size) == 0);
+        return value;
+    }
+
+    int listeningSocket()
+    {
+        boost::asio::ip::tcp::endpoint serverEndpoint{boost::asio::ip::address_v4::from_string(ServerIp), ServerPort};
+        for (auto fd = 0; fd != 1024; ++fd)
+        {
+            int isListening = 0;
+            socklen_t optionSize = sizeof(isListening);
+            sockaddr_in local{};
+            socklen_t size = sizeof(local);
+            if (::getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &isListening, &optionSize) == 0 && isListening
+                && ::getsockname(fd, (sockaddr*)&local, &size) == 0 && isEndpoint(local, serverEndpoint))
+                return fd;
+        }
+
+        return -1;
+    }
+
+    // what the kernel makes of SO_SNDBUF or SO_RCVBUF set to `size`, Linux doubles it
+    int bufferSize(int name, int size)
+    {
+        auto fd = ::socket(AF_INET, SOCK_STREAM, 0);
+        REQUIRE(fd != -1);
+        ::setsockopt(fd, SOL_SOCKET, name, &size, sizeof(size));
+        auto value = intOption(fd, SOL_SOCKET, name);
+        ::close(fd);
+        return value;
+    }
+#endif
+
+#if defined __linux__
+    // TCP_INFO of a listening socket has the length of its accept queue and the backlog
+    tcp_info listenInfo(int fd)
+    {
+        tcp_info info{};
+        socklen_t size = sizeof(info);
+        REQUIRE(::getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &size) == 0);
+        return info;
+    }
+
+    std::size_t acceptQueueLength(int fd) { return listenInfo(fd).tcpi_unacked; }
+#endif
+}
+
+TEST_CASE_METHOD(TcpOptionsFixture, "TCP options", "[websocket][slow]")
+{
+    const auto clientCount = 20;
+    std::vector<std::unique_ptr<Client>> clients;
+    for (auto i = 0; i != clientCount; ++i)
+        clients.push_back(std::make_unique<Client>());
+
+    std::set<websocket::ConnectionId> connIds;
+    for (auto i = 0; i != clientCount; ++i)
+    {
+        auto&& e = waitServerEvent();
+        REQUIRE(std::get<0>(e) == websocket::Event::NewConnection);
+        connIds.insert(std::get<1>(e));
+    }
+
+    REQUIRE(connIds.size() == clientCount);
+
+#if !defined _WIN32
+    auto connFd = serverSocket(*clients.front());
+    REQUIRE(connFd != -1);
+    REQUIRE(intOption(connFd, IPPROTO_TCP, TCP_NODELAY) != 0);
+    REQUIRE(intOption(connFd, SOL_SOCKET, SO_SNDBUF) == bufferSize(SO_SNDBUF, 256 * 1024));
+    REQUIRE(intOption(connFd, SOL_SOCKET, SO_RCVBUF) == bufferSize(SO_RCVBUF, 256 * 1024));
+
+    auto listenFd = listeningSocket();
+    REQUIRE(listenFd != -1);
+#endif
+#if defined __linux__
+    REQUIRE(listenInfo(listenFd).tcpi_sacked == 64); // the backlog
+    REQUIRE(intOption(listenFd, IPPROTO_TCP, TCP_DEFER_ACCEPT) != 0);
+    REQUIRE(intOption(listenFd, IPPROTO_TCP, TCP_FASTOPEN) == 16);
+#endif
+
+    // the cork is pulled out once the queue is written, a lone small message isn't held back
+    auto start = std::chrono::steady_clock::now();
+    server.sendText(*connIds.begin(), "test");
+    REQUIRE(clients.front()->recvFrame() == "\x81\x04test");
+    REQUIRE(std::chrono::steady_clock::now() - start < std::chrono::milliseconds(150));
+
+    std::string expected;
+    for (auto i = 0; i != 100; ++i)
+    {
+        server.sendText(*connIds.begin(), std::to_string(i));
+        expected += textFrame(std::to_string(i));
+    }
+
+    std::string received(expected.size(), '\0');
+    boost::asio::read(clients.front()->m_socket, boost::asio::buffer(&received[0], received.size()));
+    REQUIRE(received == expected);
+}
+
+#if defined __linux__
+namespace
+{
+    // stands in for ServerLogic, completes every handshake at once
+    struct AcceptCounter
+    {
+        websocket::ServerOptions m_options;
+        std::size_t m_accepted{0};
+
+        const websocket::ServerOptions& options() const { return m_options; }
+
+        template<typename... Ts>
+        void log(Ts&&...) {}
+
+        void onAccept(boost::asio::ip::tcp::socket&, boost::asio::yield_context&) { ++m_accepted; }
+    };
+}
+
+TEST_CASE("Accept connections in batches", "[websocket][slow]")
+{
+    AcceptCounter callback;
+    callback.m_options.tcp.acceptBatch = 4;
+
+    boost::asio::io_service ioService;
+    boost::asio::ip::tcp::endpoint serverEndpoint{boost::asio::ip::address_v4::from_string(ServerIp), ServerPort};
+    websocket::details::Acceptor<AcceptCounter> acceptor{ioService, serverEndpoint, callback};
+
+    // the server thread isn't running yet, the clients pile up in the accept queue
+    const std::size_t clientCount = 6;
+    std::vector<std::unique_ptr<boost::asio::ip::tcp::socket>> clients;
+    for (std::size_t i = 0; i != clientCount; ++i)
+    {
+        clients.push_back(std::make_unique<boost::asio::ip::tcp::socket>(ioService));
+        clients.back()->connect(serverEndpoint);
+    }
+
+    auto listenFd = listeningSocket();
+    REQUIRE(listenFd != -1);
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+    while (acceptQueueLength(listenFd) != clientCount)
+    {
+        REQUIRE(std::chrono::steady_clock::now() < deadline);
+        std::this_thread::sleep_for(std::chrono::milliseconds{1});
+    }
+
+    // by the time the first handshake runs, a whole batch has left the queue without a trip through the reactor
+    while (callback.m_accepted == 0)
+        REQUIRE(ioService.run_one() == 1);
+
+    REQUIRE(acceptQueueLength(listenFd) <= clientCount - 4);
+
+    while (callback.m_accepted != clientCount)
+        REQUIRE(ioService.run_one() == 1);
+
+    REQUIRE(acceptQueueLength(listenFd) == 0);
+
+    acceptor.stop();
+    ioService.run();
+}
+#endif
+
+namespace
+{
+    struct DeflateFixture : WebsocketTestsFixture
+    {
+        static websocket::ServerOptions deflateOptions()
+        {
+            websocket::ServerOptions options;
+            options.deflate.enabled = true;
+            return options;
+        }
+
+        DeflateFixture() : WebsocketTestsFixture{deflateOptions()} {}
+    };
+}
+
+TEST_CASE_METHOD(DeflateFixture, "Compressed messages", "[websocket][slow]")
+{
+    Client client{"permessage-deflate; client_max_window_bits", "permessage-deflate"};
+    waitServerEvent(websocket::Event::NewConnection);
+
+    client.sendMessage(str("\xf2\x48\xcd\xc9\xc9\x07\x00"), 0xc1);
+    REQUIRE(waitServerEvent() == event_t(websocket::Event::Message, 1, "Hello"));
+
+    // fragmented compressed message
+    client.sendMessage(str("\xf2\x48\xcd"), 0x41);
+    client.sendMessage(str("\xc9\xc9\x07\x00"), 0x80);
+    REQUIRE(waitServerEvent() == event_t(websocket::Event::Message, 1, "Hello"));
+
+    // uncompressed message on the same connection
+    client.sendMessage("plain");
+    REQUIRE(waitServerEvent() == event_t(websocket::Event::Message, 1, "plain"));
+
+    server.sendText(1, "short");
+    REQUIRE(client.recvFrame() == "\x81\x05short");
+
+    std::string text(1000, 'z');
+    server.sendText(1, text);
+    auto frame = client.recvFrame();
+    REQUIRE(std::uint8_t(frame[0]) == 0xc1);
+    REQUIRE(std::size_t(frame[1]) == frame.size() - 2);
+
+    websocket::details::DeflateParams params;
+    params.enabled = true;
+    websocket::details::PerMessageDeflate inflate{params, websocket::DeflateOptions{}};
+    std::string message;
+    REQUIRE(inflate.decompress(frame.data() + 2, frame.size() - 2, true, message, text.size()) == websocket::details::PerMessageDeflate::Result::OK);
+    REQUIRE(message == text);
+}
+
+TEST_CASE_METHOD(WebsocketTestsFixture, "Compressed frame without negotiation", "[websocket][slow]")
+{
+    Client client{"permessage-deflate"};
+    waitServerEvent(websocket::Event::NewConnection);
+
+    client.sendMessage(str("\xf2\x48\xcd\xc9\xc9\x07\x00"), 0xc1);
+    REQUIRE(waitServerEvent() == event_t(websocket::Event::Disconnect, 1, ""));
+}
+
+namespace
+{
+    struct BackpressureFixture : WebsocketTestsFixture
+    {
+        static websocket::ServerOptions backpressureOptions(websocket::OverflowPolicy policy)
+        {
+            websocket::ServerOptions options;
+            options.sendQueueMaxBytes = 4 * 1024 * 1024;
+            options.sendQueueHighWatermark = 1024 * 1024;
+            options.sendQueueLowWatermark = 512 * 1024;
+            options.overflowPolicy = policy;
+            return options;
+        }
+
+        explicit BackpressureFixture(websocket::OverflowPolicy policy = websocket::OverflowPolicy::DropNewest)
+            : WebsocketTestsFixture{backpressureOptions(policy)}
+        {}
+
+        // much more than the socket buffers can hold
+        void flood()
+        {
+            for (auto i = 0; i != 200; ++i)
+                server.sendBinary(1, std::string(200 * 1024, 'f'));
+        }
+    };
+
+    struct DropOldestFixture : BackpressureFixture
+    {
+        DropOldestFixture() : BackpressureFixture{websocket::OverflowPolicy::DropOldest} {}
+    };
+
+    struct DisconnectSlowFixture : BackpressureFixture
+    {
+        DisconnectSlowFixture() : BackpressureFixture{websocket::OverflowPolicy::Disconnect} {}
+    };
+}
+
+TEST_CASE_METHOD(BackpressureFixture, "Slow client, drop newest", "[websocket][slow]")
+{
+    Client client;
+    waitServerEvent(websocket::Event::NewConnection);
+
+    flood();
+    REQUIRE(waitServerEvent() == event_t(websocket::Event::HighWatermark, 1, ""));
+
+    auto queued = server.queuedBytes(1);
+    REQUIRE(queued > 0);
+    REQUIRE(queued <= 4 * 1024 * 1024);
+    REQUIRE(server.queuedBytes(42) == 0);
+
+    // drain until the server notices
+    std::size_t received = 0;
+    websocket::Event event;
+    websocket::ConnectionId connId;
+    std::string message;
+    static char buf[0x10000];
+    while (!server.poll(event, connId, message))
+        received += client.m_socket.read_some(boost::asio::buffer(buf));
+
+    REQUIRE(event_t(event, connId, message) == event_t(websocket::Event::LowWatermark, 1, ""));
+    REQUIRE(received < 200 * 200 * 1024);
+}
+
+TEST_CASE_METHOD(DropOldestFixture, "Slow client, drop oldest", "[websocket][slow]")
+{
+    Client client;
+    waitServerEvent(websocket::Event::NewConnection);
+
+    // numbered messages, so the client can tell which ones were dropped
+    const int messages = 200;
+    const std::size_t messageSize = 200 * 1024;
+    auto makeMessage = [&](int i)
+    {
+        std::string message(messageSize, char('a' + i % 26));
+        message[0] = char(i >> 8);
+        message[1] = char(i & 0xFF);
+        return message;
+    };
+
+    for (auto i = 0; i != messages; ++i)
+        server.sendBinary(1, makeMessage(i));
+
+    REQUIRE(waitServerEvent() == event_t(websocket::Event::HighWatermark, 1, ""));
+    REQUIRE(server.queuedBytes(1) <= 4 * 1024 * 1024);
+
+    // whole frames only, in order, ending with the newest message
+    auto last = -1;
+    auto received = 0;
+    while (last != messages - 1)
+    {
+        unsigned char header[10];
+        boost::asio::read(client.m_socket, boost::asio::buffer(header));
+        REQUIRE(int(header[0]) == 0x82);
+        REQUIRE(int(header[1]) == 127);
+        REQUIRE(std::string(header + 2, header + 10) == str("\0\0\0\0\0\x03\x20\0"));
+
+        std::string payload(messageSize, '\0');
+        boost::asio::read(client.m_socket, boost::asio::buffer(&payload[0], payload.size()));
+        auto i = (int((unsigned char)payload[0]) << 8) | (unsigned char)payload[1];
+        REQUIRE(i > last);
+        REQUIRE(payload == makeMessage(i));
+        last = i;
+        ++received;
+
+        REQUIRE(server.queuedBytes(1) <= 4 * 1024 * 1024);
+    }
+
+    REQUIRE(received < messages);
+}
+
+TEST_CASE_METHOD(DisconnectSlowFixture, "Slow client, disconnect", "[websocket][slow]")
+{
+    Client client;
+    waitServerEvent(websocket::Event::NewConnection);
+
+    flood();
+    REQUIRE(waitServerEvent() == event_t(websocket::Event::HighWatermark, 1, ""));
+
+    // the socket buffers may take some data before the queue overflows
+    for (;;)
+    {
+        auto&& e = waitServerEvent();
+        if (std::get<0>(e) == websocket::Event::Disconnect)
+            break;
+
+        REQUIRE((std::get<0>(e) == websocket::Event::LowWatermark || std::get<0>(e) == websocket::Event::HighWatermark));
+    }
+}
+
+TEST_CASE("Slow client, compressed messages", "[websocket][slow]")
+{
+    // a dropped message must not have reached the compressor, or the next ones refer to data the client never got
+    auto check = [](websocket::OverflowPolicy policy)
+    {
+        websocket::ServerOptions options;
+        options.deflate.enabled = true;
+        options.sendQueueMaxFrames = 2;
+        options.overflowPolicy = policy;
+
+        WebsocketTestsFixture fixture{options};
+        Client client{"permessage-deflate", "permessage-deflate"};
+        fixture.waitServerEvent(websocket::Event::NewConnection);
+
+        // similar messages, each one refers back to the previous ones in the compression window
+        auto makeMessage = [](int i)
+        {
+            std::string message;
+            for (auto j = 0; j != 20; ++j)
+                message += "message " + std::to_string(i) + ' ';
+            return message;
+        };
+
+        const int messages = 200;
+        for (auto i = 0; i != messages; ++i)
+            fixture.server.sendText(1, makeMessage(i));
+
+        // the socket buffers take the rest, then the last message has room
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+        while (fixture.server.queuedBytes(1) != 0)
+            REQUIRE(std::chrono::steady_clock::now() < deadline);
+        fixture.server.sendText(1, makeMessage(messages));
+
+        // the frames that get through decompress in the client's shared context
+        websocket::details::DeflateParams params;
+        params.enabled = true;
+        websocket::details::PerMessageDeflate inflate{params, websocket::DeflateOptions{}};
+
+        auto last = -1;
+        auto received = 0;
+        while (last != messages)
+        {
+            unsigned char header[4];
+            boost::asio::read(client.m_socket, boost::asio::buffer(header, 2));
+            REQUIRE(int(header[0]) == 0xc1);
+            std::size_t size = header[1];
+            if (size == 126)
+            {
+                boost::asio::read(client.m_socket, boost::asio::buffer(header + 2, 2));
+                size = (header[2] << 8) | header[3];
+            }
+
+            std::string payload(size, '\0');
+            boost::asio::read(client.m_socket, boost::asio::buffer(&payload[0], payload.size()));
+
+            std::string message;
+            REQUIRE(inflate.decompress(payload.data(), payload.size(), true, message, 0x10000) == websocket::details::PerMessageDeflate::Result::OK);
+
+            auto i = std::stoi(message.substr(8));
+            REQUIRE(i > last);
+            REQUIRE(message == makeMessage(i));
+            last = i;
+            ++received;
+        }
+
+        REQUIRE(received < messages);
+    };
+
+    SECTION("drop newest")
+    {
+        check(websocket::OverflowPolicy::DropNewest);
+    }
+
+    SECTION("drop oldest")
+    {
+        check(websocket::OverflowPolicy::DropOldest);
+    }
+}
+
+TEST_CASE("In-loop handlers", "[websocket][slow]")
+{
+    std::mutex mutex;
+    std::vector<std::string> log;
+    auto&& record = [&](std::string s)
+    {
+        std::lock_guard<std::mutex> lock{mutex};
+        log.push_back(std::move(s));
+    };
+
+    websocket::Handlers handlers;
+    handlers.onOpen = [&](websocket::LoopContext&, websocket::ConnectionId id) { record("open " + std::to_string(id)); };
+    handlers.onClose = [&](websocket::LoopContext&, websocket::ConnectionId id) { record("close " + std::to_string(id)); };
+    handlers.onMessage = [&](websocket::LoopContext& ctx, websocket::ConnectionId id, websocket::MessageView message, bool)
+    {
+        auto text = message.str();
+        if (text == "bye")
+            ctx.drop(id);
+        else if (text == "all")
+            ctx.broadcastText(text);
+        else
+            ctx.sendText(id, "echo " + text);
+    };
+
+    websocket::ServerOptions options;
+    options.threads = 2;
+
+    websocket::Server server;
+    server.start(ServerIp, ServerPort, std::cout, handlers, options);
+
+    {
+        Client client1;
+        Client client2;
+
+        client1.sendMessage("hello");
+        REQUIRE(client1.recvFrame() == "\x81\x0a" "echo hello");
+
+        // reaches the connections of both threads
+        client2.sendMessage("all");
+        REQUIRE(client1.recvFrame() == "\x81\x03" "all");
+        REQUIRE(client2.recvFrame() == "\x81\x03" "all");
+
+        // the handler drops the connection which is being read
+        client2.sendMessage("bye");
+        char c;
+        boost::system::error_code ec;
+        client2.m_socket.read_some(boost::asio::buffer(&c, 1), ec);
+        REQUIRE(ec);
+
+        // nothing goes to the event queue
+        websocket::Event event;
+        websocket::ConnectionId connId;
+        std::string message;
+        REQUIRE_FALSE(server.poll(event, connId, message));
+    }
+
+    server.stop();
+
+    std::lock_guard<std::mutex> lock{mutex};
+    REQUIRE(log.size() >= 3);
+    REQUIRE(log[0].compare(0, 5, "open ") == 0);
+    REQUIRE(log[1].compare(0, 5, "open ") == 0);
+    REQUIRE(log[2].compare(0, 6, "close ") == 0);
+}
+
+TEST_CASE("In-loop handler sends on a watermark event", "[websocket][slow]")
+{
+    // above the high watermark on its own, the send queue is empty when it has been written
+    const std::size_t messageSize = 2 * 1024 * 1024;
+
+    std::mutex mutex;
+    std::vector<websocket::Event> events;
+
+    websocket::Handlers handlers;
+    handlers.onMessage = [&](websocket::LoopContext& ctx, websocket::ConnectionId id, websocket::MessageView message, bool)
+    {
+        if (message.str() == "flood")
+            ctx.sendBinary(id, std::string(messageSize, 'f'));
+        else
+            ctx.sendText(id, "end");
+    };
+
+    // the LowWatermark handler runs while the completed write is being processed
+    handlers.onEvent = [&](websocket::LoopContext& ctx, websocket::ConnectionId id, websocket::Event event)
+    {
+        {
+            std::lock_guard<std::mutex> lock{mutex};
+            events.push_back(event);
+        }
+
+        if (event == websocket::Event::LowWatermark)
+            ctx.sendText(id, "caught up");
+    };
+
+    websocket::Server server;
+    server.start(ServerIp, ServerPort, std::cout, handlers);
+
+    {
+        Client client;
+        client.sendMessage("flood");
+
+        unsigned char header[10];
+        boost::asio::read(client.m_socket, boost::asio::buffer(header));
+        REQUIRE(std::string(header, header + 10) == str("\x82\x7f\0\0\0\0\0\x20\0\0"));
+
+        std::string payload(messageSize, '\0');
+        boost::asio::read(client.m_socket, boost::asio::buffer(&payload[0], payload.size()));
+        REQUIRE(payload == std::string(messageSize, 'f'));
+
+        // sent once, and nothing else is written in between
+        std::string expected = textFrame("caught up");
+        std::string received(expected.size(), '\0');
+        boost::asio::read(client.m_socket, boost::asio::buffer(&received[0], received.size()));
+        REQUIRE(received == expected);
+
+        client.sendMessage("done");
+        expected = textFrame("end");
+        received.assign(expected.size(), '\0');
+        boost::asio::read(client.m_socket, boost::asio::buffer(&received[0], received.size()));
+        REQUIRE(received == expected);
+    }
+
+    server.stop();
+
+    std::lock_guard<std::mutex> lock{mutex};
+    REQUIRE(events == (std::vector<websocket::Event>{websocket::Event::HighWatermark, websocket::Event::LowWatermark}));
+}
+
+TEST_CASE("Client message is too long", "[websocket][slow]")
+{
+    websocket::ServerOptions options;
+    options.maxMessageSize = 100;
+
+    websocket::Server server;
+    server.start(ServerIp, ServerPort, std::cout, options);
+
+    {
+        Client client;
+        client.sendMessage(std::string(101, 'x'));
+        REQUIRE(client.recvFrame() == str("\x88\x02\x03\xf1"));
+
+        char c;
+        boost::system::error_code ec;
+        client.m_socket.read_some(boost::asio::buffer(&c, 1), ec);
+        REQUIRE(ec);
+    }
+
+    server.stop();
+}
@@ -0,0 +1,99 @@
+// tests for RouteTable.hpp
+#include "details/RouteTable.hpp"
+
+#include "third_party/catch/catch.hpp"
+
+#include <cstring>
+
+namespace ws_details = websocket::details;
+
+namespace
+{
+    websocket::RouteId find(ws_details::RouteTable& routes, const char* path)
+    {
+        auto route = routes.find({path, path + std::strlen(path)});
+        return route ? route->id : ws_details::NoRoute;
+    }
+
+    websocket::Route route(const char* path, bool matchPrefix = false)
+    {
+        websocket::Route r;
+        r.path = path;
+        r.matchPrefix = matchPrefix;
+        return r;
+    }
+}
+
+TEST_CASE("default route", "[routes]")
+{
+    ws_details::RouteTable routes{websocket::ServerOptions{}, nullptr};
+
+    REQUIRE(routes.size() == 1);
+    REQUIRE(find(routes, "/") == 0);
+    REQUIRE(find(routes, "/chat") == ws_details::NoRoute);
+    REQUIRE(find(routes, "") == ws_details::NoRoute);
+    REQUIRE(find(routes, "chat") == ws_details::NoRoute);
+}
+
+TEST_CASE("exact and prefix routes", "[routes]")
+{
+    websocket::ServerOptions options;
+    options.routes.push_back(route("/chat"));
+    options.routes.push_back(route("/api", true));
+    options.routes.push_back(route("/api/v2/stream"));
+    options.routes.push_back(route("/files/", true));
+
+    ws_details::RouteTable routes{options, nullptr};
+    REQUIRE(routes.size() == 5);
+    REQUIRE(routes[2].route.path == "/api");
+
+    REQUIRE(find(routes, "/") == 0);
+    REQUIRE(find(routes, "/chat") == 1);
+    REQUIRE(find(routes, "/chat/") == 1);
+    REQUIRE(find(routes, "/chat/room") == ws_details::NoRoute);
+    REQUIRE(find(routes, "/chatroom") == ws_details::NoRoute);
+
+    REQUIRE(find(routes, "/api") == 2);
+    REQUIRE(find(routes, "/api/v1") == 2);
+    REQUIRE(find(routes, "/api/v2/stream") == 3);
+    REQUIRE(find(routes, "/api/v2/stream/x") == 2);
+    REQUIRE(find(routes, "/apis") == ws_details::NoRoute);
+
+    REQUIRE(find(routes, "/files") == 4);
+    REQUIRE(find(routes, "/files/a/b") == 4);
+}
+
+TEST_CASE("route settings", "[routes]")
+{
+    websocket::ServerOptions options;
+    options.maxMessageSize = 100;
+    options.deflate.enabled = true;
+
+    auto chat = route("/chat");
+    chat.maxMessageSize = 10;
+    chat.handlers.onOpen = [](websocket::LoopContext&, websocket::ConnectionId) {};
+    options.routes.push_back(chat);
+
+    websocket::Handlers handlers;
+    ws_details::RouteTable routes{options, &handlers};
+
+    REQUIRE(routes[0].route.maxMessageSize == 100);
+    REQUIRE(routes[0].route.deflate.enabled);
+    REQUIRE(routes[0].handlers == &handlers);
+
+    REQUIRE(routes[1].route.maxMessageSize == 10);
+    REQUIRE_FALSE(routes[1].route.deflate.enabled);
+    REQUIRE(routes[1].handlers == &routes[1].route.handlers);
+
+    options.routes[0].path = "chat";
+    auto isRejected = false;
+    try
+    {
+        ws_details::RouteTable{options, nullptr};
+    }
+    catch (const std::invalid_argument&)
+    {
+        isRejected = true;
+    }
+    REQUIRE(isRejected);
+}
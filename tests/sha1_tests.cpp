@@ -3,6 +3,12 @@
 
 #include "third_party/catch/catch.hpp"
 
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <utility>
+#include <vector>
+
 static std::string b2a_hex(const void* data, std::size_t size)
 {
     std::string a;
@@ -20,6 +26,17 @@ static std::string b2a_hex(const void* data, std::size_t size)
     return a;
 }
 
+static std::vector<std::pair<const char*, SHA1::kernel_fn>> sha1Kernels()
+{
+    std::vector<std::pair<const char*, SHA1::kernel_fn>> kernels;
+    kernels.emplace_back("portable", SHA1::processBlocksPortable);
+#if defined WEBSOCKET_HAS_SHA_NI
+    if (SHA1::cpuHasShaNi())
+        kernels.emplace_back("sha-ni", SHA1::processBlocksShaNi);
+#endif
+    return kernels;
+}
+
 static std::string calc_sha1(const std::string& text)
 {
     SHA1 sha;
@@ -55,4 +72,54 @@ TEST_CASE("sha1 of a message with length equal to block size", "[sha1]")
     uint8_t Message_Digest[20];
     sha.digest(Message_Digest);
     REQUIRE(b2a_hex(Message_Digest, 20) == "dea356a2cddd90c7a7ecedc5ebb563934f460452");
-}
\ No newline at end of file
+}
+
+TEST_CASE("sha1 kernels", "[sha1]")
+{
+    // pieces of every length, so the input reaches the kernels at any offset and in several blocks at once
+    std::string text;
+    for (auto i = 0; i != 1000; ++i)
+        text.push_back(char(i * 7));
+
+    for (auto&& kernel : sha1Kernels())
+    {
+        INFO(kernel.first);
+        for (std::size_t piece = 1; piece <= 200; piece += 13)
+        {
+            SHA1 sha{kernel.second};
+            for (std::size_t pos = 0; pos < text.size(); pos += piece)
+                sha.update(&text[pos], std::min(piece, text.size() - pos));
+
+            uint8_t Message_Digest[20];
+            sha.digest(Message_Digest);
+            REQUIRE(b2a_hex(Message_Digest, 20) == calc_sha1(text));
+        }
+
+        SHA1 sha{kernel.second};
+        sha.update("abc", 3);
+        uint8_t Message_Digest[20];
+        sha.digest(Message_Digest);
+        REQUIRE(b2a_hex(Message_Digest, 20) == "a9993e364706816aba3e25717850c26c9cd0d89d");
+    }
+}
+
+TEST_CASE("sha1 of a handshake key", "[sha1][.][bench]")
+{
+    const char key[] = "dGhlIHNhbXBsZSBub25jZQ==" "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+    const auto rounds = 1000000;
+
+    for (auto&& kernel : sha1Kernels())
+    {
+        uint8_t Message_Digest[20] = {};
+        auto start = std::chrono::steady_clock::now();
+        for (auto i = 0; i != rounds; ++i)
+        {
+            SHA1 sha{kernel.second};
+            sha.update(key, sizeof(key) - 1);
+            sha.digest(Message_Digest);
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+        std::cout << kernel.first << ": " << elapsed.count() / rounds * 1e9 << " ns per key\n";
+    }
+}
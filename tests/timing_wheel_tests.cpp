@@ -0,0 +1,116 @@
+// tests for TimingWheel.hpp
+#include "details/TimingWheel.hpp"
+
+#include "third_party/catch/catch.hpp"
+
+#include <memory>
+#include <vector>
+
+namespace ws_details = websocket::details;
+
+namespace
+{
+    struct Timer
+    {
+        int id;
+        ws_details::TimingWheel<Timer>::Node node{this};
+
+        explicit Timer(int id)
+            : id{id}
+        {}
+    };
+
+    // ids of the timers expired by the next tick
+    std::vector<int> tick(ws_details::TimingWheel<Timer>& wheel)
+    {
+        std::vector<int> expired;
+        wheel.advance([&](Timer& timer) { expired.push_back(timer.id); });
+        return expired;
+    }
+}
+
+TEST_CASE("timers expire on their tick", "[timing_wheel]")
+{
+    ws_details::TimingWheel<Timer> wheel{8};
+    Timer a{1}, b{2}, c{3};
+    wheel.schedule(a.node, 2);
+    wheel.schedule(b.node, 1);
+    wheel.schedule(c.node, 2);
+    REQUIRE(a.node.isScheduled());
+
+    REQUIRE(tick(wheel) == std::vector<int>{2});
+    REQUIRE(tick(wheel) == (std::vector<int>{1, 3}));
+    REQUIRE(tick(wheel).empty());
+    REQUIRE(wheel.now() == 3);
+    REQUIRE(!a.node.isScheduled());
+
+    // the past means the next tick
+    wheel.schedule(a.node, 0);
+    REQUIRE(a.node.dueTick() == 4);
+    REQUIRE(tick(wheel) == std::vector<int>{1});
+}
+
+TEST_CASE("timers further than the wheel size", "[timing_wheel]")
+{
+    ws_details::TimingWheel<Timer> wheel{4};
+    Timer a{1};
+    wheel.schedule(a.node, 10);
+
+    for (auto i = 1; i != 10; ++i)
+        REQUIRE(tick(wheel).empty());
+
+    REQUIRE(tick(wheel) == std::vector<int>{1});
+}
+
+TEST_CASE("rescheduled, cancelled and destroyed timers", "[timing_wheel]")
+{
+    ws_details::TimingWheel<Timer> wheel{8};
+    Timer a{1}, b{2};
+    wheel.schedule(a.node, 1);
+    wheel.schedule(b.node, 1);
+    wheel.schedule(a.node, 3);
+    wheel.cancel(b.node);
+    REQUIRE(!b.node.isScheduled());
+
+    std::unique_ptr<Timer> c{new Timer{3}};
+    wheel.schedule(c->node, 3);
+    c.reset();
+
+    REQUIRE(tick(wheel).empty());
+    REQUIRE(tick(wheel).empty());
+    REQUIRE(tick(wheel) == std::vector<int>{1});
+}
+
+TEST_CASE("expiry callback changes other timers", "[timing_wheel]")
+{
+    ws_details::TimingWheel<Timer> wheel{8};
+    std::unique_ptr<Timer> a{new Timer{1}}, b{new Timer{2}};
+    Timer c{3};
+    wheel.schedule(a->node, 1);
+    wheel.schedule(b->node, 1);
+    wheel.schedule(c.node, 1);
+
+    std::vector<int> expired;
+    wheel.advance([&](Timer& timer)
+    {
+        expired.push_back(timer.id);
+        if (timer.id == 1)
+        {
+            b.reset();
+            wheel.schedule(timer.node, wheel.now() + 8); // same slot, next turn
+        }
+    });
+
+    REQUIRE(expired == (std::vector<int>{1, 3}));
+    REQUIRE(a->node.dueTick() == 9);
+}
+
+TEST_CASE("wheel outlives no timers", "[timing_wheel]")
+{
+    Timer a{1};
+    {
+        ws_details::TimingWheel<Timer> wheel{8};
+        wheel.schedule(a.node, 5);
+    }
+    REQUIRE(!a.node.isScheduled());
+}
@@ -0,0 +1,185 @@
+// tests for utf8.hpp
+#include "details/utf8.hpp"
+
+#include "third_party/catch/catch.hpp"
+
+#include <string>
+#include <vector>
+
+namespace ws_details = websocket::details;
+
+namespace
+{
+    const std::uint8_t* noKernel(const std::uint8_t* p, const std::uint8_t*) { return p; }
+
+    std::vector<std::pair<const char*, ws_details::utf8_kernel_fn>> utf8Kernels()
+    {
+        std::vector<std::pair<const char*, ws_details::utf8_kernel_fn>> kernels;
+        kernels.emplace_back("scalar", noKernel);
+        kernels.emplace_back("wordwise", ws_details::skipAsciiWordwise);
+#if defined WEBSOCKET_HAS_SSSE3
+        if (ws_details::cpuHasSsse3())
+            kernels.emplace_back("ssse3", ws_details::validateUtf8Ssse3);
+#endif
+        return kernels;
+    }
+
+    bool isValid(const std::string& text, ws_details::utf8_kernel_fn kernel = noKernel)
+    {
+        ws_details::Utf8Validator validator{kernel};
+        return validator.validate(text.data(), text.size()) && validator.isComplete();
+    }
+}
+
+TEST_CASE("valid UTF-8", "[utf8]")
+{
+    const char* valid[] =
+    {
+        "",
+        "Hello, world",
+        "\xce\xba\xe1\xbd\xb9\xcf\x83\xce\xbc\xce\xb5", // greek "kosme"
+        "\xc2\x80",
+        "\xdf\xbf",
+        "\xe0\xa0\x80",
+        "\xed\x9f\xbf", // U+D7FF
+        "\xee\x80\x80", // U+E000
+        "\xef\xbf\xbf",
+        "\xf0\x90\x80\x80",
+        "\xf0\x9f\x98\x80", // emoji
+        "\xf4\x8f\xbf\xbf", // U+10FFFF
+    };
+
+    for (auto&& kernel : utf8Kernels())
+    {
+        for (auto text : valid)
+        {
+            INFO(kernel.first << ": " << text);
+
+            // inside long ASCII text
+            for (auto pos : {0u, 1u, 13u, 14u, 15u, 16u, 30u})
+            {
+                std::string s(40, 'a');
+                s.insert(pos, text);
+                REQUIRE(isValid(s, kernel.second));
+            }
+        }
+    }
+}
+
+TEST_CASE("invalid UTF-8", "[utf8]")
+{
+    const char* invalid[] =
+    {
+        "\x80",             // lone continuation
+        "\xbf",
+        "\xc0\x80",         // overlong
+        "\xc1\xbf",
+        "\xe0\x80\x80",
+        "\xe0\x9f\xbf",
+        "\xf0\x80\x80\x80",
+        "\xf0\x8f\xbf\xbf",
+        "\xed\xa0\x80",     // surrogates
+        "\xed\xbf\xbf",
+        "\xf4\x90\x80\x80", // above U+10FFFF
+        "\xf5\x80\x80\x80",
+        "\xff",
+        "\xc2",             // truncated
+        "\xe1\x80",
+        "\xf1\x80\x80",
+        "\xc2\x41",         // lead byte followed by ASCII
+        "\xe1\x80\x41",
+        "\xc2\xc2\x80",
+        "\xc2\x80\x80",     // too many continuations
+    };
+
+    for (auto&& kernel : utf8Kernels())
+    {
+        for (auto text : invalid)
+        {
+            INFO(kernel.first << ": " << text);
+
+            for (auto pos : {0u, 1u, 13u, 14u, 15u, 16u, 30u, 40u})
+            {
+                std::string s(40, 'a');
+                s.insert(pos, text);
+                REQUIRE_FALSE(isValid(s, kernel.second));
+            }
+        }
+    }
+}
+
+TEST_CASE("UTF-8 text in pieces", "[utf8]")
+{
+    std::string text = "abc\xce\xba\xe1\xbd\xb9\xcf\x83\xce\xbc\xce\xb5 \xf0\x9f\x98\x80 0123456789abcdef \xef\xbf\xbf";
+
+    for (auto split1 = 0u; split1 <= text.size(); ++split1)
+    {
+        for (auto split2 = split1; split2 <= text.size(); ++split2)
+        {
+            ws_details::Utf8Validator validator;
+            REQUIRE(validator.validate(text.data(), split1));
+            REQUIRE(validator.validate(text.data() + split1, split2 - split1));
+            REQUIRE(validator.validate(text.data() + split2, text.size() - split2));
+            REQUIRE(validator.isComplete());
+        }
+    }
+
+    ws_details::Utf8Validator validator;
+    REQUIRE(validator.validate("\xf0\x9f", 2));
+    REQUIRE_FALSE(validator.isComplete());
+    REQUIRE_FALSE(validator.validate("\x41", 1));
+}
+
+TEST_CASE("UTF-8 kernels agree with the scalar validator", "[utf8]")
+{
+    const char* pieces[] =
+    {
+        "a", "0123456789", "\xc2\x80", "\xdf\xbf", "\xe0\xa0\x80", "\xed\x9f\xbf", "\xef\xbf\xbf",
+        "\xf0\x90\x80\x80", "\xf4\x8f\xbf\xbf", "\x80", "\xc0", "\xe0", "\xed", "\xf0", "\xf4", "\xf5",
+        "\xa0", "\x90", "\x8f", "\xbf", "\xff",
+    };
+    const auto pieceCount = sizeof(pieces) / sizeof(pieces[0]);
+
+    std::uint32_t seed = 12345;
+    auto random = [&] { seed = seed * 1103515245 + 12345; return seed >> 16; };
+
+    for (auto&& kernel : utf8Kernels())
+    {
+        for (auto n = 0; n != 20000; ++n)
+        {
+            std::string s(random() % 16, 'x');
+            auto len = random() % 12;
+            for (auto i = 0u; i != len; ++i)
+                s += pieces[random() % pieceCount];
+
+            INFO(kernel.first << ": " << s);
+            REQUIRE(isValid(s, kernel.second) == isValid(s));
+        }
+    }
+}
+
+TEST_CASE("UTF-8 kernels agree on all byte pairs", "[utf8]")
+{
+    for (auto&& kernel : utf8Kernels())
+    {
+        INFO(kernel.first);
+
+        for (auto a = 0x80; a != 0x100; ++a)
+        {
+            for (auto b = 0; b != 0x100; ++b)
+            {
+                for (auto pos : {5u, 14u, 15u})
+                {
+                    std::string s(32, 'a');
+                    s[pos] = char(a);
+                    s[pos + 1] = char(b);
+                    s[pos + 2] = char(0x80);
+                    s[pos + 3] = char(0x80);
+
+                    if (isValid(s, kernel.second) != isValid(s))
+                        FAIL(std::hex << a << ' ' << b << " at " << pos);
+                }
+            }
+        }
+    }
+}